@@ -1,8 +1,13 @@
+#define _GNU_SOURCE
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xlibint.h>
+#include <X11/Xatom.h>
 #include <X11/extensions/XTest.h>
 #include <X11/extensions/record.h>
 #include <X11/extensions/Xfixes.h>
+#include <X11/extensions/XInput2.h>
+#include <X11/XKBlib.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -14,6 +19,58 @@
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <signal.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+
+// USDT probes, provider "autocopy". A probe is a single nop until a tracer
+// (bpftrace, perf) attaches; without <sys/sdt.h> they compile to nothing.
+// Capture-scoped probes take a key first: the capture id, or in daemon mode
+// the session address, since a display has one capture in flight at a time.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AUTOCOPY_HAVE_USDT 1
+#endif
+#endif
+#if defined(AUTOCOPY_HAVE_USDT)
+#define AUTOCOPY_PROBE1(name, a) DTRACE_PROBE1(autocopy, name, a)
+#define AUTOCOPY_PROBE2(name, a, b) DTRACE_PROBE2(autocopy, name, a, b)
+#else
+#define AUTOCOPY_PROBE1(name, a) do {} while (0)
+#define AUTOCOPY_PROBE2(name, a, b) do {} while (0)
+#endif
 
 #define APP_VERSION "0.0.5-linux"
 #define APP_AUTHOR "Igor Brzezek"
@@ -28,8 +85,6 @@ bool bCtrl1 = false;
 bool bCtrl2 = false;
 bool bTUI = false;
 int nRequiredClicks = 1;
-int nCurrentClicks = 0;
-Time lastClickTime = 0;
 int maxDoubleClickTime = 500;
 int minTime = 0;
 int maxTime = 500;
@@ -40,10 +95,98 @@ long long nTotalChars = 0;
 char szStartTime[64] = {0};
 char szLogFile[MAX_PATH] = {0};
 char szArgsInfo[512] = "Arguments: ";
+unsigned long long nCaptureId = 0;
 
 // TUI state
-#define MAX_TUI_LINES 10000
-char *tuiLogBuffer[MAX_TUI_LINES] = {0};
+#define MAX_TUI_LINES 100000
+
+typedef struct {
+  unsigned long long id;   // capture id, also used in the session file
+  int64_t timestamp_us;
+  char *text;              // NULL while the entry is held packed
+  size_t length;
+  unsigned char *packed;   // LZ4 block for entries of at least tuiCompressMin bytes
+  size_t packedSize;
+  uint32_t *lineIndex;     // line start offsets, built when first opened in the detail pane
+  size_t lineCount;
+  unsigned long long lastUse;  // eviction order: added, viewed or copied
+  unsigned flags;
+} TUIEntry;
+
+// Entries with either flag are never evicted
+#define TUI_ENTRY_PINNED 0x1u
+#define TUI_ENTRY_RECOPIED 0x2u
+#define TUI_ENTRY_KEPT (TUI_ENTRY_PINNED | TUI_ENTRY_RECOPIED)
+#define TUI_ENTRY_BLOB 0x8u  // text is a "[type, size] path" placeholder for a captured blob
+#define TUI_ENTRY_PERSISTED (TUI_ENTRY_KEPT | TUI_ENTRY_BLOB)
+// text/packed point into the session file mapping and are not freed
+#define TUI_ENTRY_MAPPED 0x4u
+#define TUI_ENTRY_MARKED 0x10u  // part of the multi-selection; not persisted
+
+TUIEntry tuiLogBuffer[MAX_TUI_LINES] = {0};
+
+// Recently decoded packed entries
+#define TUI_UNPACK_CACHE_SLOTS 4
+
+typedef struct {
+  const unsigned char *packed;  // identifies the entry
+  char *text;
+  size_t length;
+  unsigned long lastUse;
+} TUIUnpackSlot;
+
+TUIUnpackSlot tuiUnpackCache[TUI_UNPACK_CACHE_SLOTS] = {0};
+unsigned long tuiUnpackClock = 0;
+size_t tuiCompressMin = 16384;
+size_t tuiResidentBytes = 0;
+size_t tuiPackedCount = 0;
+size_t tuiPackedRawBytes = 0;
+size_t tuiPackedBytes = 0;
+size_t tuiMaxMemory = 0;  // --maxmem, 0 = only the entry count limit applies
+unsigned long long tuiUseClock = 0;
+unsigned long tuiEvictedCount = 0;
+
+// Session snapshot file (--session)
+#define SESSION_FILE_MAGIC 0x5353534553434141ull  // "AACSESSS"
+#define SESSION_VERSION 1
+#define SESSION_REC_MAGIC 0x43455241u  // "AREC"
+#define SESSION_REC_ENTRY 1
+#define SESSION_REC_EVICT 2
+#define SESSION_REC_FLAGS 3
+#define SESSION_REC_SYNC 4   // everything before it was fdatasync'd
+#define SESSION_ENCODING_RAW 0
+#define SESSION_ENCODING_LZ4 1
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reserved;
+} SessionFileHeader;
+
+typedef struct {
+  uint32_t magic;
+  uint8_t type;
+  uint8_t encoding;
+  uint16_t entryFlags;
+  uint64_t id;
+  int64_t timestamp_us;
+  uint64_t length;        // decoded text length
+  uint64_t payloadSize;   // bytes following the header, before 8-byte padding
+  uint32_t payloadCrc;    // CRC32C of the payload
+  uint32_t headerCrc;     // CRC32C of the fields above
+} SessionRecord;
+
+typedef struct {
+  const SessionRecord *rec;
+  uint16_t flags;
+} SessionSlot;
+
+char szSessionFile[MAX_PATH] = {0};
+int sessionFd = -1;
+unsigned char *sessionMap = NULL;
+size_t sessionMapSize = 0;
+int sessionRestoredCount = 0;
+double sessionRestoreMs = 0.0;
 int tuiLogCount = 0;
 int tuiScrollOffset = 0;
 int tuiSelectedLine = -1;
@@ -53,46 +196,909 @@ int terminalWidth = 80;
 int terminalHeight = 24;
 bool bShouldRedrawLogs = false;
 
+// TUI keyboard/mouse input
+#define TUI_INPUT_PENDING_MAX 64
+#define TUI_ESC_TIMEOUT_MS 50
+#define TUI_WHEEL_STEP 3
+
+typedef enum {
+  TUI_KEY_NONE,
+  TUI_KEY_UP,
+  TUI_KEY_DOWN,
+  TUI_KEY_PGUP,
+  TUI_KEY_PGDN,
+  TUI_KEY_HOME,
+  TUI_KEY_END,
+  TUI_KEY_WHEEL_UP,
+  TUI_KEY_WHEEL_DOWN,
+  TUI_KEY_SHIFT_UP,
+  TUI_KEY_SHIFT_DOWN,
+  TUI_KEY_ESC
+} TUIKey;
+
+unsigned char tuiInputPending[256];
+size_t tuiInputPendingLen = 0;
+int tuiJumpNumber = 0;
+bool tuiNeedRedraw = false;
+int tuiMarkedCount = 0;  // entries with TUI_ENTRY_MARKED
+int tuiCopyLeftOut = 0;  // marked entries past MAX_COPY_GATHER, shown until the next key
+
+// Paste-from-history hotkey (--hotkey)
+KeySym hotkeyKeysym = NoSymbol;
+unsigned hotkeyModifiers = 0;
+KeyCode hotkeyKeycode = 0;
+int hotkeyIndex = -1;  // entry picked by the running cycle, -1 when idle
+unsigned long long hotkeyEntryId = 0;
+bool hotkeyGrabFailed = false;
+char szHotkey[64] = {0};
+
+// Detail pane showing every line of one entry
+bool bTuiDetailOpen = false;
+int tuiDetailEntry = -1;
+size_t tuiDetailTop = 0;
+
+// Event loop
+typedef struct LoopSource LoopSource;
+typedef void (*LoopHandler)(LoopSource *src, uint32_t events);
+struct LoopSource {
+  int fd;
+  LoopHandler handler;
+  Display *display;  // X connection behind fd, if any
+};
+
+int loopEpollFd = -1;
+int loopWakeFd = -1;
+bool loopShouldExit = false;
+LoopSource srcSignal = {-1}, srcWake = {-1}, srcCaptureTimer = {-1};
+LoopSource srcCtrl = {-1}, srcRecord = {-1}, srcOwner = {-1}, srcFetch = {-1};
+LoopSource srcStdin = {-1}, srcEscTimer = {-1}, srcRing = {-1}, srcOwnerTimer = {-1};
+
+// Capture pipeline, advanced by the capture timer and the fetch connection
+#define PRE_INJECT_DELAY_MS 200
+#define POST_INJECT_DELAY_MS 100
+#define FETCH_TIMEOUT_MS 1000
+
+typedef enum {
+  CAPTURE_IDLE,
+  CAPTURE_PRE_INJECT,   // letting the click's selection settle
+  CAPTURE_POST_INJECT,  // letting the app take CLIPBOARD after Ctrl+C
+  CAPTURE_FETCHING,     // ConvertSelection sent, waiting for SelectionNotify
+  CAPTURE_DEBOUNCE      // --monitor: waiting for the new owner to settle
+} CaptureState;
+
+CaptureState captureState = CAPTURE_IDLE;
+bool capturePending = false;
+
+// Click counting for one display
+typedef struct {
+  int clicks;
+  Time lastClickTime;
+} ClickState;
+
+ClickState clickState = {0, 0};
+
+// Clipboard fetch connection
+Display *fetchDisplay = NULL;
+Window fetchWindow = None;
+Atom fetchClipboardAtom, fetchUtf8Atom, fetchStringAtom, fetchPrimaryAtom;
+
+// Passive monitor mode (--monitor): XFixes owner-change notifications on the
+// fetch connection replace XRecord and key injection.
+#define MONITOR_DEBOUNCE_MS 50
+#define MONITOR_DEBOUNCE_MAX_MS 500
+#define MONITOR_CLIPBOARD 0x1u
+#define MONITOR_PRIMARY 0x2u
+
+bool bMonitor = false;
+bool bMonitorPrimary = false;
+bool bInputXI2 = false;  // --input xi2: raw button events and modifier state instead of XRecord
+int xi2Opcode = -1;
+unsigned char xi2ButtonMap[256];  // core pointer mapping: physical button - 1 -> logical
+int xi2ButtonCount = 0;
+int xkbEventBase = -1;
+int fixesEventBase = 0;
+unsigned monitorPending = 0;      // selections changed since the last fetch
+unsigned monitorFetching = 0;     // selection being fetched
+uint64_t monitorLastHash[3] = {0};
+struct timespec monitorDebounceStart;
+
+// Text normalization (--normalize), applied in place to each capture
+#define NORMALIZE_TRIM 0x1u    // trailing whitespace per line, blank lines at the ends
+#define NORMALIZE_EOL 0x2u     // CRLF and lone CR become LF
+#define NORMALIZE_SPACES 0x4u  // Unicode spaces become ' ', soft hyphens and zero-width marks go
+#define NORMALIZE_UNWRAP 0x8u  // hard-wrapped lines within a paragraph are joined
+
+unsigned normalizeFlags = 0;
+bool bNormalizeCopy = false;
+
+// Capture buffer pool (--pool). Buffers are carved out of one reserved
+// mapping at startup; pages are only backed once a capture touches them.
+#define CAPTURE_BUFFER_SIZE (1024 * 1024 + 1)  // fetch limit plus terminator
+#define MAX_CAPTURE_POOL 64
+#define POOL_WARMUP_CAPTURES 2  // Xlib and libc fill their caches first
+
+int capturePoolSize = 0;
+char *capturePool = NULL;
+atomic_ulong capturePoolFree = 0;  // bit i set: buffer i is free
+#if defined(AUTOCOPY_COUNT_MALLOC)
+atomic_ulong mallocCalls = 0;
+unsigned long captureMallocStart = 0;  // mallocCalls when the capture was triggered
+#endif
+
+// Readiness notification (--ready-fd, $NOTIFY_SOCKET)
+int readyFd = -1;
+char szNotifySocket[108] = {0};  // sun_path; '@' starts an abstract name
+struct timespec startupStart;
+atomic_bool readySent = false;
+atomic_int readyPending = 0;     // daemon: startup displays not yet recording
+
+// Multi-display daemon (--displays, --display-dir)
+#define MAX_DAEMON_WORKERS 16
+#define DAEMON_RETRY_MS 2000
+
+enum { DAEMON_ATOM_CLIPBOARD, DAEMON_ATOM_UTF8, DAEMON_ATOM_STRING, DAEMON_ATOM_TARGETS, DAEMON_ATOM_ATOM, DAEMON_ATOM_COUNT };
+
+typedef struct DaemonWorker {
+  pthread_t thread;
+  int epollFd;
+  int wakeFd;        // in the epoll set with a NULL source
+  int sessionCount;  // guarded by daemonMutex
+} DaemonWorker;
+
+typedef struct DisplaySession {
+  char name[64];            // as passed to XOpenDisplay, e.g. ":3"
+  char logPath[MAX_PATH];
+  char logTag[72];          // "[:3] " when sessions share one --log file
+  Display *record;          // XRecord data connection
+  Display *ctrl;            // XTest, pointer queries, fetching and owning
+  XRecordContext context;
+  Window window;            // fetch requestor and CLIPBOARD owner
+  Atom atoms[DAEMON_ATOM_COUNT];
+  LoopSource srcRecord, srcCtrl, srcTimer;
+  DaemonWorker *worker;
+  ClickState clicks;
+  CaptureState state;
+  bool pending;
+  bool dead;                // connection lost
+  bool detaching;
+  bool armPending;          // counted in readyPending until XRecord starts
+  char *owned;              // text served for --normalize-copy
+  struct DisplaySession *next;
+} DisplaySession;
+
+char szDaemonDisplays[1024] = {0};
+char szDaemonDir[MAX_PATH] = {0};
+int daemonWorkerCount = 2;
+DaemonWorker daemonWorkers[MAX_DAEMON_WORKERS];
+DisplaySession *daemonSessions = NULL;  // guarded by daemonMutex
+int daemonSessionCount = 0;
+pthread_mutex_t daemonMutex = PTHREAD_MUTEX_INITIALIZER;
+atomic_bool daemonExit = false;
+bool daemonStarting = false;  // attaching the displays present at startup
+LoopSource srcDaemonDir = {-1}, srcDaemonRetry = {-1};
+
+// Extra clipboard targets (--targets), requested with MULTIPLE and streamed
+// to content-addressed files in szBlobDir
+#define MAX_EXTRA_TARGETS 4
+#define BLOB_SLICE_LONGS 65536  // 256 KB per property read
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char buffer[64];
+} Sha256;
+
+typedef struct {
+  char mime[64];
+  const char *extension;
+  Atom target;         // on fetchDisplay
+  Atom property;       // where the owner stores it on fetchWindow
+  int fd;              // open while a transfer is running
+  char path[MAX_PATH]; // temporary file, final file once done
+  Sha256 sha;
+  uint64_t size;
+  bool incremental;    // INCR transfer in progress
+  bool done;           // complete blob waiting to be published
+} ExtraTarget;
+
+ExtraTarget extraTargets[MAX_EXTRA_TARGETS];
+int extraTargetCount = 0;
+char szBlobDir[MAX_PATH] = {0};
+Atom fetchMultipleAtom, fetchAtomPairAtom, fetchIncrAtom, fetchPairsProperty;
+Atom fetchSelection = None;
+Window fetchOwner = None;  // owner of fetchSelection when the fetch started
+bool fetchUsingMultiple = false;
+char *fetchPendingText = NULL;  // text held back until INCR blobs finish
+
+// Capture filters (--filter). Regex rules are compiled to DFAs over byte
+// classes at startup; nothing is compiled per capture.
+#define FILTER_MAX_REPEAT 100
+#define FILTER_MAX_DFA_STATES 4096
+#define FILTER_MAX_LITERAL 64
+
+typedef enum { FILTER_DROP, FILTER_REDACT, FILTER_HASH } FilterAction;
+typedef enum { FILTER_REGEX, FILTER_LITERAL, FILTER_ENTROPY } FilterKind;
+enum { RX_SET, RX_CAT, RX_ALT, RX_STAR, RX_PLUS, RX_QUEST, RX_EMPTY };
+
+typedef struct {
+  int type;
+  int a, b;  // children, or the byte set for RX_SET
+} RegexNode;
+
+typedef struct {
+  int32_t *next;          // stateCount x classCount: next state * classCount, -1 = dead
+  unsigned char *accept;  // indexed like next: state * classCount
+  int stateCount;
+  int classCount;
+} Dfa;
+
+typedef struct {
+  FilterAction action;
+  FilterKind kind;
+  char *literal;          // the keyword, or a literal every regex match contains
+  size_t literalLength;
+  bool literalFold;       // literal is lowercase, match it in either case
+  unsigned char byteClass[256];
+  Dfa search;             // unanchored: earliest match end
+  Dfa reverse;            // anchored, mirrored pattern: leftmost start
+  Dfa forward;            // anchored: longest end
+  double minEntropy;
+  int minLength;
+} FilterRule;
+
+typedef struct {
+  size_t start, end;
+  FilterAction action;
+} FilterSpan;
+
+char szFilterFile[MAX_PATH] = {0};
+FilterRule *filterRules = NULL;
+int filterRuleCount = 0;
+__thread FilterSpan *filterSpans = NULL;  // per thread: daemon workers filter concurrently
+__thread int filterSpanCount = 0, filterSpanCapacity = 0;
+__thread bool filterSpanLost = false;  // AddFilterSpan ran out of memory
+bool filterTokenBytes[256];  // base64, hex and URL-safe token bytes, for entropy rules
+
+// Post-processing pool (--workers). Captures of at least postWorkerMin bytes
+// are normalized, hashed and filtered off the loop thread; jobs publish in
+// capture order, so once one is pending every later capture queues behind it.
+#define MAX_POST_WORKERS 16
+#define MAX_POST_JOBS 16
+#define POST_TASK_CAPACITY 256
+
+typedef struct {
+  atomic_int remaining;
+  bool notify;  // signal postDoneFd once remaining reaches 0 (offloaded jobs)
+} PostGroup;
+
+typedef struct {
+  void (*run)(void *arg, int index);
+  void *arg;
+  int index;
+  PostGroup *group;  // counted down when run returns
+} PostTask;
+
+typedef struct {
+  char *text;              // owned; normalized and filtered if processed
+  char *clipboardCopy;     // --normalize-copy: the normalized text before filtering
+  size_t length;
+  uint64_t hash;           // of the normalized text, for --monitor
+  bool hashed;
+  bool processed;          // ran on a worker; otherwise it only waited for its turn
+  bool clipboard;          // fetched from CLIPBOARD
+  Window owner;            // for --output
+  unsigned monitorSelection;
+  char *blobs[MAX_EXTRA_TARGETS];
+  int blobCount;
+  PostGroup group;
+} PostJob;
+
+int postWorkerCount = 2;
+size_t postWorkerMin = 256 * 1024;
+pthread_t postThreads[MAX_POST_WORKERS];
+int postThreadCount = 0;
+PostTask postTasks[POST_TASK_CAPACITY];
+int postTaskHead = 0, postTaskCount = 0;
+bool postStopping = false;
+pthread_mutex_t postMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t postCond = PTHREAD_COND_INITIALIZER;  // a task queued or a group finished
+PostJob postJobs[MAX_POST_JOBS];  // FIFO, loop thread only
+int postJobHead = 0, postJobCount = 0;
+size_t postPendingBytes = 0;
+int postDoneFd = -1;
+LoopSource srcPostDone = {-1};
+
+// On-capture hooks (--on-capture). A few long-lived helpers run the command;
+// each capture goes to one of them as a "<id> <length>\n" header and length
+// bytes of text, and the helper answers every record with a line, "ok" on
+// success. Nothing here waits on a helper: pipes are non-blocking and a
+// capture no helper has room for is dropped.
+#define MAX_HOOK_HELPERS 8
+#define HOOK_QUEUE_RECORDS 32
+#define HOOK_QUEUE_BYTES (8 * 1024 * 1024)  // per helper, beyond what the pipe holds
+#define HOOK_RESTART_MS 1000
+
+typedef struct {
+  char *data;  // the part the pipe did not take; NULL once written
+  size_t length, offset;
+} HookRecord;
+
+typedef struct {
+  LoopSource input;  // write end of the helper's stdin
+  LoopSource reply;  // read end of its stdout
+  LoopSource timer;  // reply deadline of the oldest record, or restart delay
+  pid_t pid;         // 0 while waiting to be restarted
+  HookRecord queue[HOOK_QUEUE_RECORDS];  // sent or waiting, oldest first
+  int head, count;
+  size_t queuedBytes;  // unwritten bytes in queue
+  char line[256];
+  size_t lineLength;
+} HookHelper;
+
+char szOnCapture[1024] = {0};
+int hookHelperCount = 1;
+int hookTimeoutMs = 5000;
+HookHelper hookHelpers[MAX_HOOK_HELPERS];
+
+// Structured capture stream on stdout (--output). Records are built in a
+// buffer and written without blocking; once a consumer is more than
+// outputLimit bytes behind, records are dropped or the loop waits for it
+// (--output-full).
+typedef enum { OUTPUT_NONE, OUTPUT_JSONL, OUTPUT_NUL, OUTPUT_NETSTRING } OutputMode;
+
+OutputMode outputMode = OUTPUT_NONE;
+bool bOutputBlock = true;
+size_t outputLimit = 4 * 1024 * 1024;
+char *outputBuffer = NULL;
+size_t outputCapacity = 0, outputStart = 0, outputEnd = 0;  // unwritten: [outputStart, outputEnd)
+bool outputWaiting = false;  // srcOutput is waiting for EPOLLOUT
+int outputFlags = -1;        // stdout's file status flags before O_NONBLOCK
+LoopSource srcOutput = {-1};
+Window publishWindow = None;  // selection owner of the capture being published
+
 // Clipboard for copy to clipboard feature
 char *copyClipboardText = NULL;
 Window clipboardWindow = None;
 Display *clipboardDisplay = NULL;
 pthread_mutex_t clipboardMutex = PTHREAD_MUTEX_INITIALIZER;
-bool clipboardShouldExit = false;
+bool clipboardOwnPending = false;
+Atom ownerUtf8Atom, ownerStringAtom, ownerTargetsAtom, ownerAtomAtom, ownerClipboardAtom, ownerIncrAtom;
+char copyBlobMime[64] = {0};
+char copyBlobPath[MAX_PATH] = {0};  // set instead of copyClipboardText when re-serving a blob
+Atom copyBlobAtom = None;
+
+// Ctrl+Enter on several marked entries: the clipboard holds their capture
+// ids, and each request is answered from the history entries themselves.
+#define MAX_COPY_GATHER 256
+unsigned long long copyGatherIds[MAX_COPY_GATHER];
+int copyGatherCount = 0;
+char szCopySeparator[64] = "\n";
+size_t copySeparatorLength = 1;
+
+#define MAX_OWNER_TRANSFERS 4
+#define OWNER_CHUNK_SIZE (256 * 1024)
+#define OWNER_TRANSFER_TIMEOUT_MS 10000  // a requestor silent this long is dropped
+
+// Position in a gathered copy: the entry being written, how much of it has
+// gone out, and whether the separator before it has.
+typedef struct {
+  int next;
+  size_t offset;
+  bool started, separated;
+} GatherCursor;
+
+typedef struct {
+  Window requestor;
+  Atom property;
+  Atom type;
+  int fd;  // -1 when the slot is free, unless gatherIds is set
+  off_t offset;
+  unsigned long long *gatherIds;  // a gathered copy's own ids, instead of fd
+  int gatherCount;
+  GatherCursor gather;
+  uint64_t deadline;  // TraceNow() microseconds
+} OwnerTransfer;
+
+OwnerTransfer ownerTransfers[MAX_OWNER_TRANSFERS] = {
+    {None, None, None, -1, 0}, {None, None, None, -1, 0}, {None, None, None, -1, 0}, {None, None, None, -1, 0}};
+
+// Capture broadcast ring (memfd shared read-only with subscriber processes)
+#define RING_MAGIC 0x47524341u  // "ACRG"
+#define RING_VERSION 2
+#define RING_DATA_OFFSET 64
+#define RING_WAITERS_SIZE 4096
+#define RING_REC_PAD 0x1u
+#define RING_REC_TRUNCATED 0x2u
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;         // size of the data area in bytes
+  _Atomic uint64_t tail;     // start of the oldest intact record
+  _Atomic uint64_t reserve;  // end of the record currently being written
+  _Atomic uint64_t commit;   // end of the last complete record
+  _Atomic uint32_t seq;      // futex word, bumped once per record
+} RingHeader;
+
+typedef struct {
+  uint32_t size;             // total record size incl. header, multiple of 8
+  uint32_t flags;
+  uint64_t seq;
+  uint64_t id;
+  int64_t timestamp_us;
+  uint64_t length;           // original capture length
+  uint64_t stored;           // payload bytes following the header
+} RingRecord;
+
+_Static_assert(sizeof(RingHeader) <= RING_DATA_OFFSET, "ring header too large");
+
+char szRingSocket[sizeof(((struct sockaddr_un *)0)->sun_path)] = {0};
+char szSubscribeSocket[sizeof(((struct sockaddr_un *)0)->sun_path)] = {0};
+size_t ringSizeKB = 1024;
+int ringFd = -1;
+int ringListenFd = -1;
+int ringWaitersFd = -1;
+RingHeader *ringHeader = NULL;
+// Subscribers in FUTEX_WAIT on seq. One killed while waiting leaves it
+// high, which costs wake-ups but never loses one.
+_Atomic uint32_t *ringWaiters = NULL;
+unsigned char *ringData = NULL;
+uint64_t ringWritePos = 0;
+uint64_t ringWriteSeq = 0;
+
+// Metrics endpoint (--metrics). Counters are bumped with relaxed atomics so
+// the capture path never waits on a scrape.
+typedef struct {
+  atomic_ulong triggers;
+  atomic_ulong coalesced;
+  atomic_ulong injections;
+  atomic_ulong captures;
+  atomic_ulong captureBytes;
+  atomic_ulong fetchFailures;
+  atomic_ulong fetchTimeouts;
+  atomic_ulong ownerRequests;
+  atomic_ulong ownerRefused;
+  atomic_ulong ownerBytes;
+  atomic_ulong logWrites;
+  atomic_ulong logFailures;
+  atomic_ulong logWriteMicros;
+  atomic_ulong logLastMicros;
+  atomic_ulong ringSubscribers;
+  atomic_ulong scrapes;
+  atomic_ulong filterDropped;
+  atomic_ulong filterRedacted;
+  atomic_ulong filterMicros;
+  atomic_ulong poolMisses;
+  atomic_ulong startupMicros;
+  atomic_ulong offloaded;
+  atomic_ulong offloadMicros;
+  atomic_ulong hookRecords;
+  atomic_ulong hookFailures;
+  atomic_ulong hookDropped;
+  atomic_ulong outputRecords;
+  atomic_ulong outputDropped;
+} Metrics;
+
+#define MAX_METRICS_CLIENTS 8
+
+typedef struct {
+  LoopSource src;  // first, so handlers can cast back
+  char request[1024];
+  size_t length;
+} MetricsClient;
+
+Metrics metrics;
+char szMetricsAddress[MAX_PATH] = {0};
+int metricsListenFd = -1;
+bool bMetricsUnixSocket = false;
+LoopSource srcMetrics = {-1};
+MetricsClient metricsClients[MAX_METRICS_CLIENTS];
+
+static void MetricAdd(atomic_ulong *counter, unsigned long n) {
+  atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static unsigned long MetricGet(atomic_ulong *counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Pipeline trace (--trace-out)
+#define TRACE_BUFFER_EVENTS 4096
+
+typedef struct {
+  const char *name;  // string literal
+  uint64_t start;    // CLOCK_MONOTONIC microseconds
+  uint64_t duration;
+  unsigned long long captureId;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+  struct TraceBuffer *next;
+  pid_t tid;
+  bool named;
+  atomic_size_t count;
+  TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+char szTraceFile[MAX_PATH] = {0};
+bool bTraceEnabled = false;
+FILE *traceFile = NULL;
+pthread_mutex_t traceFileMutex = PTHREAD_MUTEX_INITIALIZER;
+_Atomic(TraceBuffer *) traceBuffers = NULL;
+static __thread TraceBuffer *traceLocal = NULL;
+unsigned long long traceCaptureSeq = 0;      // last id handed to a trigger
+unsigned long long traceCaptureId = 0;       // capture in the pipeline
+unsigned long long traceFinishedCapture = 0; // capture whose text is being output
+uint64_t traceStepStart = 0;
 
 // Global Ctrl key state for TUI mode
 bool bCtrlKeyPressed = false;
-pthread_mutex_t ctrlKeyMutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Global terminal settings for cleanup
 struct termios g_original_termios;
 bool g_termios_saved = false;
+int g_original_stdin_flags = -1;  // shared with stdout/stderr on a terminal
 
 Display *ctrl_display = NULL;
+Display *data_display = NULL;
+XRecordContext recordContext = 0;
 
-void cleanup_and_exit(int sig) {
-  // Restore terminal settings
+void RestoreTerminal() {
   if (g_termios_saved) {
     tcsetattr(STDIN_FILENO, TCSANOW, &g_original_termios);
+    g_termios_saved = false;
   }
-  
-  // Restore cursor visibility
+  if (g_original_stdin_flags >= 0) {
+    fcntl(STDIN_FILENO, F_SETFL, g_original_stdin_flags);
+    g_original_stdin_flags = -1;
+  }
+
+  // Stop mouse reporting, restore cursor visibility
+  printf("\033[?1000l\033[?1006l");
   printf("\033[?25h");
   printf("\033[0m");
   printf("\033[J");
   fflush(stdout);
-  
-  exit(0);
 }
 
 void GetTerminalSize();
 void DrawTUIHeader();
 void RedrawTUILogs();
-void AddTUILogMessage(const char *text);
+void AddTUILogMessage(const char *text, unsigned entryFlags);
 void CopyToClipboard(const char *text);
-void *clipboard_handler_thread(void *arg);
+void CopyBlobToClipboard(const char *mime, const char *path);
+void CopyEntriesToClipboard(const unsigned long long *ids, int count);
+void TUIMoveSelection(int delta);
+bool ParseBlobPlaceholder(const char *text, char *mime, size_t mimeSize, char *path, size_t pathSize);
+void PrintClipboardText(char *text);
+void PrintCapture(char *text, unsigned entryFlags);
+void PublishCapture(char *text, unsigned entryFlags);
+void OnCaptureTrigger();
+char *ReadClipboardFetchResult(XSelectionEvent *se);
+void FinishCapture();
+char *TakeBlobPlaceholder();
+bool PostJobQueue(char *text, size_t length);
+void PostPublishReady();
+bool LoopAdd(LoopSource *src, int fd, LoopHandler handler, Display *display);
+void LoopRemove(LoopSource *src);
+void LoopSetEvents(LoopSource *src, uint32_t events);
+void HookPublish(unsigned long long id, const char *text, size_t length);
+void OutputCapture(unsigned long long id, const char *text, size_t length, unsigned entryFlags);
+void LoopWakeup();
+void ArmTimer(int fd, int ms);
 void ShowLongHelp(const char *name);
 void ShowShortHelp(const char *name);
+bool RingCreate(const char *path, size_t sizeKB);
+void RingPublish(unsigned long long id, const char *text, size_t len);
+void HandleRingAccept(LoopSource *src, uint32_t events);
+int RunSubscriber(const char *path);
+int RunBenchmarks(const char *outPath);
+int RunDaemon();
+int64_t NowMicros();
+void WriteToLogFile(const char *path, const char *tag, const char *text);
+bool ClassifyClick(ClickState *state, Display *display, Time now);
+bool MetricsCreate(const char *spec);
+void HandleMetricsAccept(LoopSource *src, uint32_t events);
+uint64_t TraceBegin();
+void TraceSpan(const char *name, uint64_t start, unsigned long long captureId);
+void SessionAppendEntry(const TUIEntry *entry);
+void SessionAppendUpdate(unsigned type, const TUIEntry *entry);
+bool LoadFilterRules(const char *path);
+char *ApplyFilters(char *text);
+char *CaptureBufferAlloc(size_t size);
+void FreeCaptureText(char *text);
+void NotifyReady();
+bool XI2Init();
+void HandleXI2Events(Display *display);
+
+// Display width of UTF-8 text. ASCII is one column per byte and is skipped
+// 16/32 bytes at a time; everything else goes through the tables below.
+typedef struct {
+  uint32_t first;
+  uint32_t last;
+} CodepointRange;
+
+// Combining marks, joiners and other zero-width code points.
+static const CodepointRange zeroWidthRanges[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+  {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+  {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+  {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A},
+  {0x07A6, 0x07B0}, {0x0900, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C},
+  {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963},
+  {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD},
+  {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1},
+  {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD}, {0x1160, 0x11FF}, {0x1AB0, 0x1AFF},
+  {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+  {0x20D0, 0x20FF}, {0x302A, 0x302D}, {0x3099, 0x309A}, {0xFE00, 0xFE0F},
+  {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0x1F3FB, 0x1F3FF}, {0xE0001, 0xE0001},
+  {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+// East Asian wide/fullwidth and emoji presentation code points.
+static const CodepointRange wideRanges[] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+  {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+  {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+  {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+  {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+  {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+  {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+  {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+  {0x3040, 0xA4CF}, {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+  {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6},
+  {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+  {0x1F200, 0x1F251}, {0x1F300, 0x1F3FA}, {0x1F400, 0x1F64F}, {0x1F680, 0x1F6FF},
+  {0x1F7E0, 0x1F7EB}, {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD},
+  {0x30000, 0x3FFFD},
+};
+
+static bool InRanges(uint32_t cp, const CodepointRange *ranges, size_t count) {
+  if (cp < ranges[0].first || cp > ranges[count - 1].last)
+    return false;
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (cp > ranges[mid].last)
+      lo = mid + 1;
+    else if (cp < ranges[mid].first)
+      hi = mid;
+    else
+      return true;
+  }
+  return false;
+}
+
+int CodepointWidth(uint32_t cp) {
+  if (InRanges(cp, zeroWidthRanges, sizeof(zeroWidthRanges) / sizeof(zeroWidthRanges[0])))
+    return 0;
+  if (InRanges(cp, wideRanges, sizeof(wideRanges) / sizeof(wideRanges[0])))
+    return 2;
+  return 1;
+}
+
+// Decodes one code point; invalid or truncated sequences consume one byte
+// and decode as U+FFFD.
+size_t Utf8Decode(const unsigned char *s, size_t len, uint32_t *cp) {
+  unsigned char c = s[0];
+  size_t n;
+  uint32_t value;
+  if (c >= 0xF0 && c <= 0xF4) {
+    n = 4;
+    value = c & 0x07;
+  } else if (c >= 0xE0) {
+    n = (c <= 0xEF) ? 3 : 0;
+    value = c & 0x0F;
+  } else if (c >= 0xC2) {
+    n = 2;
+    value = c & 0x1F;
+  } else {
+    n = 0;
+    value = 0;
+  }
+  if (n == 0 || n > len) {
+    *cp = 0xFFFD;
+    return 1;
+  }
+  for (size_t i = 1; i < n; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      *cp = 0xFFFD;
+      return 1;
+    }
+    value = (value << 6) | (s[i] & 0x3F);
+  }
+  if ((n == 3 && value < 0x800) || (n == 4 && (value < 0x10000 || value > 0x10FFFF)) ||
+      (value >= 0xD800 && value <= 0xDFFF)) {
+    *cp = 0xFFFD;
+    return 1;
+  }
+  *cp = value;
+  return n;
+}
+
+// Length of the leading run of ASCII bytes in s[0..len).
+size_t AsciiPrefixLength(const unsigned char *s, size_t len) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(v);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    unsigned mask = (unsigned)_mm_movemask_epi8(v);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+#else
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, sizeof(word));
+    if (word & 0x8080808080808080ULL)
+      break;
+  }
+#endif
+  while (i < len && s[i] < 0x80)
+    i++;
+  return i;
+}
+
+// Returns how many bytes of s fit in maxCols display columns without
+// splitting a code point; the columns used are stored in *cols.
+size_t Utf8FitColumns(const char *text, size_t len, int maxCols, int *cols) {
+  const unsigned char *s = (const unsigned char *)text;
+  size_t pos = 0;
+  int used = 0;
+
+  while (pos < len && used < maxCols) {
+    size_t limit = len - pos;
+    if (limit > (size_t)(maxCols - used))
+      limit = (size_t)(maxCols - used);
+    size_t run = AsciiPrefixLength(s + pos, limit);
+    pos += run;
+    used += (int)run;
+    if (run == limit)
+      continue;
+
+    uint32_t cp;
+    size_t n = Utf8Decode(s + pos, len - pos, &cp);
+    int w = CodepointWidth(cp);
+    if (used + w > maxCols)
+      break;
+    pos += n;
+    used += w;
+  }
+
+  // Keep trailing combining marks with their base character.
+  while (pos < len && s[pos] >= 0x80) {
+    uint32_t cp;
+    size_t n = Utf8Decode(s + pos, len - pos, &cp);
+    if (CodepointWidth(cp) != 0)
+      break;
+    pos += n;
+  }
+
+  if (cols)
+    *cols = used;
+  return pos;
+}
+
+// Largest length <= len that does not end inside a UTF-8 sequence.
+size_t Utf8Boundary(const char *text, size_t len) {
+  const unsigned char *s = (const unsigned char *)text;
+  size_t cut = len;
+  while (cut > 0 && (s[cut] & 0xC0) == 0x80 && len - cut < 3)
+    cut--;
+  return ((s[cut] & 0xC0) == 0x80) ? len : cut;
+}
+
+// Prints text clipped to width display columns and padded with spaces to
+// exactly width columns.
+void PrintColumns(const char *text, int width) {
+  if (width <= 0)
+    return;
+  // A column never needs more than 4 bytes, plus some slack for marks.
+  size_t len = strnlen(text, (size_t)width * 4 + 16);
+  int cols;
+  size_t n = Utf8FitColumns(text, len, width, &cols);
+  fwrite(text, 1, n, stdout);
+  printf("%*s", width - cols, "");
+}
+
+// Length of the leading run of s[0..len) without C0 control bytes or DEL.
+size_t PrintablePrefixLength(const unsigned char *s, size_t len) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i ctl32 = _mm256_set1_epi8(0x1F);
+  const __m256i del32 = _mm256_set1_epi8(0x7F);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl32), v),
+                                  _mm256_cmpeq_epi8(v, del32));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i ctl16 = _mm_set1_epi8(0x1F);
+  const __m128i del16 = _mm_set1_epi8(0x7F);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl16), v),
+                               _mm_cmpeq_epi8(v, del16));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+  while (i < len && s[i] >= 0x20 && s[i] != 0x7F)
+    i++;
+  return i;
+}
+
+// Like PrintColumns, but control characters are shown escaped (\n, \t, ^X)
+// so a capture always stays on one row. With expandTabs, tabs advance to the
+// next 8-column stop instead.
+void PrintSanitizedColumns(const char *text, size_t len, int width, bool expandTabs) {
+  if (width <= 0)
+    return;
+  const unsigned char *s = (const unsigned char *)text;
+  if (len > (size_t)width * 4 + 16)
+    len = (size_t)width * 4 + 16;
+
+  int used = 0;
+  size_t pos = 0;
+  while (pos < len && used < width) {
+    size_t run = PrintablePrefixLength(s + pos, len - pos);
+    if (run > 0) {
+      int cols;
+      size_t n = Utf8FitColumns(text + pos, run, width - used, &cols);
+      fwrite(text + pos, 1, n, stdout);
+      used += cols;
+      pos += n;
+      if (n < run)
+        break;
+      continue;
+    }
+
+    unsigned char c = s[pos];
+    if (c == '\t' && expandTabs) {
+      int stop = 8 - used % 8;
+      if (stop > width - used)
+        stop = width - used;
+      printf("%*s", stop, "");
+      used += stop;
+      pos++;
+      continue;
+    }
+    char esc[3] = {'^', (char)(c == 0x7F ? '?' : c + '@'), '\0'};
+    if (c == '\n' || c == '\t' || c == '\r') {
+      esc[0] = '\\';
+      esc[1] = (c == '\n') ? 'n' : (c == '\t') ? 't' : 'r';
+    }
+    if (used + 2 > width)
+      break;
+    fputs(esc, stdout);
+    used += 2;
+    pos++;
+  }
+  printf("%*s", width - used, "");
+}
+
+void FormatBytes(char *buf, size_t size, size_t bytes) {
+  if (bytes >= 10 * 1024 * 1024)
+    snprintf(buf, size, "%.1f MB", bytes / (1024.0 * 1024.0));
+  else if (bytes >= 10 * 1024)
+    snprintf(buf, size, "%.1f KB", bytes / 1024.0);
+  else
+    snprintf(buf, size, "%zu B", bytes);
+}
 
 void GetTerminalSize() {
   struct winsize w;
@@ -116,22 +1122,58 @@ void DrawTUIHeader() {
   char line1[512];
   snprintf(line1, sizeof(line1), " autocopy v%s | Started: %s (CTRL-C to stop, CTRL-ENTER to copy)",
            APP_VERSION, szStartTime);
-  printf("%-*s", terminalWidth, line1);
+  PrintColumns(line1, terminalWidth);
   printf("\033[0m");
 
   printf("\033[2;1H");
   printf("\033[42m\033[97m");
-  printf("%-*s", terminalWidth, szArgsInfo);
+  PrintColumns(szArgsInfo, terminalWidth);
   printf("\033[0m");
 
   printf("\033[3;1H");
   printf("\033[42m\033[97m");
   double avg = (nTotalTexts > 0) ? (double)nTotalChars / nTotalTexts : 0.0;
   char line3[512];
-  snprintf(line3, sizeof(line3),
-           " Copied: %d | Total Chars: %lld | Avg Len: %.2f",
-           nTotalTexts, nTotalChars, avg);
-  printf("%-*s", terminalWidth, line3);
+  int len3 = snprintf(line3, sizeof(line3),
+                      " Copied: %d | Total Chars: %lld | Avg Len: %.2f",
+                      nTotalTexts, nTotalChars, avg);
+  if (len3 > 0 && len3 < (int)sizeof(line3)) {
+    char resident[32];
+    FormatBytes(resident, sizeof(resident), tuiResidentBytes);
+    len3 += snprintf(line3 + len3, sizeof(line3) - len3, " | Mem: %s", resident);
+    if (tuiMaxMemory > 0 && len3 < (int)sizeof(line3)) {
+      char budget[32];
+      FormatBytes(budget, sizeof(budget), tuiMaxMemory);
+      len3 += snprintf(line3 + len3, sizeof(line3) - len3, " / %s", budget);
+    }
+    if (tuiEvictedCount > 0 && len3 < (int)sizeof(line3)) {
+      len3 += snprintf(line3 + len3, sizeof(line3) - len3, ", %lu evicted", tuiEvictedCount);
+    }
+  }
+  if (tuiPackedCount > 0 && len3 > 0 && len3 < (int)sizeof(line3)) {
+    len3 += snprintf(line3 + len3, sizeof(line3) - len3, " (%zu packed, ratio %.2f)",
+                     tuiPackedCount, (double)tuiPackedRawBytes / (double)tuiPackedBytes);
+  }
+  if (sessionRestoredCount > 0 && len3 > 0 && len3 < (int)sizeof(line3)) {
+    len3 += snprintf(line3 + len3, sizeof(line3) - len3, " | Restored %d in %.1f ms",
+                     sessionRestoredCount, sessionRestoreMs);
+  }
+  if (postJobCount > 0 && postPendingBytes > 0 && len3 > 0 && len3 < (int)sizeof(line3)) {
+    char pending[32];
+    FormatBytes(pending, sizeof(pending), postPendingBytes);
+    len3 += snprintf(line3 + len3, sizeof(line3) - len3, " | Processing: %d (%s)", postJobCount, pending);
+  }
+  if (tuiMarkedCount > 0 && len3 > 0 && len3 < (int)sizeof(line3)) {
+    len3 += snprintf(line3 + len3, sizeof(line3) - len3, " | Marked: %d", tuiMarkedCount);
+  }
+  if (tuiCopyLeftOut > 0 && len3 > 0 && len3 < (int)sizeof(line3)) {
+    len3 += snprintf(line3 + len3, sizeof(line3) - len3, " | Copied %d; %d left marked (limit %d)",
+                     MAX_COPY_GATHER, tuiCopyLeftOut, MAX_COPY_GATHER);
+  }
+  if (tuiJumpNumber > 0 && len3 > 0 && len3 < (int)sizeof(line3)) {
+    snprintf(line3 + len3, sizeof(line3) - len3, " | Jump to: %d_", tuiJumpNumber);
+  }
+  PrintColumns(line3, terminalWidth);
   printf("\033[0m");
 
   printf("\033[?25l");
@@ -139,452 +1181,6872 @@ void DrawTUIHeader() {
   fflush(stdout);
 }
 
-void RedrawTUILogs() {
-  GetTerminalSize();
+// LZ4 block format codec for large history entries. Blocks are compatible
+// with LZ4_decompress_safe(); the compressor is a single-pass greedy matcher.
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
 
-  int logAreaHeight = terminalHeight - 3;
-  int startLine = tuiScrollOffset;
+size_t Lz4CompressBound(size_t size) {
+  return size + size / 255 + 16;
+}
 
-  if (startLine < 0) startLine = 0;
-  if (startLine > tuiLogCount - logAreaHeight) startLine = tuiLogCount - logAreaHeight;
-  if (startLine < 0) startLine = 0;
+static uint32_t Lz4Read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
 
-  tuiScrollOffset = startLine;
+static unsigned char *Lz4WriteLength(unsigned char *op, size_t len) {
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = (unsigned char)len;
+  return op;
+}
 
-  for (int i = 0; i < logAreaHeight; i++) {
-    printf("\033[%d;1H", 4 + i);
-    printf("\033[K");
-    int logIndex = startLine + i;
-    if (logIndex < tuiLogCount && tuiLogBuffer[logIndex]) {
-      char logLine[1024];
-      snprintf(logLine, sizeof(logLine), "[%d]: %s", logIndex + 1, tuiLogBuffer[logIndex]);
-      if (logIndex == tuiSelectedLine) {
-        printf("\033[47m\033[30m");
-        printf("%-*.*s", terminalWidth, terminalWidth, logLine);
-        printf("\033[0m");
-      } else {
-        printf("%-*.*s", terminalWidth, terminalWidth, logLine);
+// Returns the compressed size, or 0 if dst is too small.
+size_t Lz4Compress(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstCap) {
+  uint32_t table[1 << LZ4_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  const unsigned char *ip = src;
+  const unsigned char *anchor = src;
+  const unsigned char *end = src + srcSize;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + dstCap;
+
+  if (srcSize > LZ4_MF_LIMIT) {
+    const unsigned char *mfLimit = end - LZ4_MF_LIMIT;
+    const unsigned char *matchLimit = end - LZ4_LAST_LITERALS;
+    while (ip < mfLimit) {
+      uint32_t seq = Lz4Read32(ip);
+      uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+      const unsigned char *ref = src + table[h];
+      table[h] = (uint32_t)(ip - src);
+      if (ref >= ip || ip - ref > 65535 || Lz4Read32(ref) != seq) {
+        // Skip faster through data that keeps missing.
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      const unsigned char *mp = ip + LZ4_MIN_MATCH;
+      const unsigned char *rp = ref + LZ4_MIN_MATCH;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      while (mp + 8 <= matchLimit) {
+        uint64_t a, b;
+        memcpy(&a, mp, 8);
+        memcpy(&b, rp, 8);
+        if (a != b) {
+          mp += __builtin_ctzll(a ^ b) >> 3;
+          goto matched;
+        }
+        mp += 8;
+        rp += 8;
+      }
+#endif
+      while (mp < matchLimit && *mp == *rp) {
+        mp++;
+        rp++;
       }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    matched:
+#endif
+      if (mp > matchLimit)
+        mp = matchLimit;
+
+      size_t litLen = (size_t)(ip - anchor);
+      size_t matchLen = (size_t)(mp - ip) - LZ4_MIN_MATCH;
+      if ((size_t)(oend - op) < 1 + litLen + litLen / 255 + 1 + 2 + matchLen / 255 + 1)
+        return 0;
+
+      unsigned char *token = op++;
+      *token = (unsigned char)((litLen >= 15 ? 15 : litLen) << 4);
+      if (litLen >= 15)
+        op = Lz4WriteLength(op, litLen - 15);
+      memcpy(op, anchor, litLen);
+      op += litLen;
+      uint16_t offset = (uint16_t)(ip - ref);
+      *op++ = (unsigned char)(offset & 0xFF);
+      *op++ = (unsigned char)(offset >> 8);
+      *token |= (unsigned char)(matchLen >= 15 ? 15 : matchLen);
+      if (matchLen >= 15)
+        op = Lz4WriteLength(op, matchLen - 15);
+
+      ip = mp;
+      anchor = ip;
     }
   }
 
-  fflush(stdout);
+  size_t litLen = (size_t)(end - anchor);
+  if ((size_t)(oend - op) < 1 + litLen + litLen / 255 + 1)
+    return 0;
+  *op++ = (unsigned char)((litLen >= 15 ? 15 : litLen) << 4);
+  if (litLen >= 15)
+    op = Lz4WriteLength(op, litLen - 15);
+  memcpy(op, anchor, litLen);
+  op += litLen;
+  return (size_t)(op - dst);
 }
 
-void AddTUILogMessage(const char *text) {
-  char truncatedText[10000];
-  snprintf(truncatedText, sizeof(truncatedText), "%.*s", tuiLineSizeLimit, text);
+// Decodes an LZ4 block, stopping once dstCap bytes are produced so a prefix
+// can be decoded cheaply. Returns the bytes written, or -1 if corrupt.
+long Lz4Decompress(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstCap) {
+  const unsigned char *ip = src;
+  const unsigned char *iend = src + srcSize;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + dstCap;
 
-  if (tuiLogCount < tuiMaxLogLines) {
-    tuiLogBuffer[tuiLogCount] = strdup(truncatedText);
-    tuiLogCount++;
-  } else {
-    free(tuiLogBuffer[0]);
-    for (int i = 0; i < tuiMaxLogLines - 1; i++) {
-      tuiLogBuffer[i] = tuiLogBuffer[i + 1];
+  while (ip < iend && op < oend) {
+    unsigned token = *ip++;
+    size_t litLen = token >> 4;
+    if (litLen == 15) {
+      unsigned char b;
+      do {
+        if (ip >= iend)
+          return -1;
+        b = *ip++;
+        litLen += b;
+      } while (b == 255);
+    }
+    if (litLen > (size_t)(iend - ip))
+      return -1;
+    size_t n = (litLen < (size_t)(oend - op)) ? litLen : (size_t)(oend - op);
+    memcpy(op, ip, n);
+    op += n;
+    ip += litLen;
+    if (ip >= iend || op >= oend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst))
+      return -1;
+    size_t matchLen = token & 15;
+    if (matchLen == 15) {
+      unsigned char b;
+      do {
+        if (ip >= iend)
+          return -1;
+        b = *ip++;
+        matchLen += b;
+      } while (b == 255);
+    }
+    matchLen += LZ4_MIN_MATCH;
+
+    n = (matchLen < (size_t)(oend - op)) ? matchLen : (size_t)(oend - op);
+    const unsigned char *ref = op - offset;
+    if (offset >= 8) {
+      // Each 8-byte chunk reads at least 8 bytes behind what it writes.
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8)
+        memcpy(op + i, ref + i, 8);
+      for (; i < n; i++)
+        op[i] = ref[i];
+    } else {
+      for (size_t i = 0; i < n; i++)
+        op[i] = ref[i];
+    }
+    op += n;
+  }
+  return (long)(op - dst);
+}
+
+void TouchTUIEntry(TUIEntry *entry) {
+  entry->lastUse = ++tuiUseClock;
+}
+
+// Heap bytes held by an entry (text or packed block, plus its line index).
+size_t TUIEntryBytes(const TUIEntry *entry) {
+  size_t bytes = entry->packed ? entry->packedSize : (entry->text ? entry->length + 1 : 0);
+  return bytes + entry->lineCount * sizeof(uint32_t);
+}
+
+// Stores text in entry, LZ4-packed when it is large and actually shrinks.
+// Takes ownership of text.
+void StoreTUIEntry(TUIEntry *entry, char *text, size_t len) {
+  memset(entry, 0, sizeof(*entry));
+  entry->text = text;
+  entry->length = len;
+
+  if (tuiCompressMin > 0 && len >= tuiCompressMin) {
+    unsigned char *packed = malloc(Lz4CompressBound(len));
+    size_t packedSize = packed ? Lz4Compress((unsigned char *)text, len, packed, Lz4CompressBound(len)) : 0;
+    if (packedSize > 0 && packedSize < len - len / 8) {
+      unsigned char *shrunk = realloc(packed, packedSize);
+      entry->packed = shrunk ? shrunk : packed;
+      entry->packedSize = packedSize;
+      entry->text = NULL;
+      free(text);
+      tuiPackedCount++;
+      tuiPackedRawBytes += len;
+      tuiPackedBytes += packedSize;
+    } else {
+      free(packed);
+    }
+  }
+  tuiResidentBytes += TUIEntryBytes(entry);
+}
+
+void FreeTUIEntry(TUIEntry *entry) {
+  tuiResidentBytes -= TUIEntryBytes(entry);
+  if (entry->packed) {
+    tuiPackedCount--;
+    tuiPackedRawBytes -= entry->length;
+    tuiPackedBytes -= entry->packedSize;
+    for (int i = 0; i < TUI_UNPACK_CACHE_SLOTS; i++) {
+      if (tuiUnpackCache[i].packed == entry->packed) {
+        tuiResidentBytes -= tuiUnpackCache[i].length + 1;
+        free(tuiUnpackCache[i].text);
+        memset(&tuiUnpackCache[i], 0, sizeof(tuiUnpackCache[i]));
+      }
+    }
+  }
+  if (!(entry->flags & TUI_ENTRY_MAPPED)) {
+    free(entry->text);
+    free(entry->packed);
+  }
+  free(entry->lineIndex);
+  memset(entry, 0, sizeof(*entry));
+}
+
+// Full text of an entry. Packed entries are decoded into a small LRU cache;
+// the pointer stays valid until a few other packed entries are opened.
+const char *TUIEntryText(TUIEntry *entry) {
+  if (!entry->packed)
+    return entry->text;
+
+  TUIUnpackSlot *victim = &tuiUnpackCache[0];
+  for (int i = 0; i < TUI_UNPACK_CACHE_SLOTS; i++) {
+    TUIUnpackSlot *slot = &tuiUnpackCache[i];
+    if (slot->packed == entry->packed) {
+      slot->lastUse = ++tuiUnpackClock;
+      return slot->text;
+    }
+    if (slot->lastUse < victim->lastUse)
+      victim = slot;
+  }
+
+  char *text = malloc(entry->length + 1);
+  if (!text)
+    return NULL;
+  if (Lz4Decompress(entry->packed, entry->packedSize, (unsigned char *)text, entry->length) != (long)entry->length) {
+    free(text);
+    return NULL;
+  }
+  text[entry->length] = '\0';
+
+  if (victim->text) {
+    tuiResidentBytes -= victim->length + 1;
+    free(victim->text);
+  }
+  victim->packed = entry->packed;
+  victim->text = text;
+  victim->length = entry->length;
+  victim->lastUse = ++tuiUnpackClock;
+  tuiResidentBytes += entry->length + 1;
+  return text;
+}
+
+// At least the first maxLen bytes of an entry, for a one-line list row.
+// Packed entries only have that prefix decoded.
+const char *TUIEntryPreview(TUIEntry *entry, size_t maxLen, size_t *len) {
+  if (!entry->packed) {
+    *len = entry->length;
+    return entry->text;
+  }
+  for (int i = 0; i < TUI_UNPACK_CACHE_SLOTS; i++) {
+    if (tuiUnpackCache[i].packed == entry->packed) {
+      *len = entry->length;
+      return tuiUnpackCache[i].text;
+    }
+  }
+
+  static char preview[4096];
+  if (maxLen > sizeof(preview))
+    maxLen = sizeof(preview);
+  if (maxLen > entry->length)
+    maxLen = entry->length;
+  long n = Lz4Decompress(entry->packed, entry->packedSize, (unsigned char *)preview, maxLen);
+  *len = (n > 0) ? (size_t)n : 0;
+  return preview;
+}
+
+// Builds the line-start table on first view; later views reuse it, so
+// scrolling costs only the visible lines.
+bool EnsureLineIndex(TUIEntry *entry) {
+  if (entry->lineIndex)
+    return true;
+
+  const char *text = TUIEntryText(entry);
+  if (!text)
+    return false;
+  const char *end = text + entry->length;
+  size_t count = 1;
+  for (const char *p = text; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+    count++;
+  }
+  // A trailing newline does not start another line.
+  if (entry->length > 0 && end[-1] == '\n')
+    count--;
+
+  entry->lineIndex = malloc(count * sizeof(uint32_t));
+  if (!entry->lineIndex)
+    return false;
+  entry->lineIndex[0] = 0;
+  size_t line = 1;
+  for (const char *p = text; line < count && (p = memchr(p, '\n', end - p)) != NULL; p++) {
+    entry->lineIndex[line++] = (uint32_t)(p + 1 - text);
+  }
+  entry->lineCount = count;
+  tuiResidentBytes += count * sizeof(uint32_t);
+  return true;
+}
+
+// Returns the bytes of line n of the entry's text without its terminator.
+const char *GetEntryLine(const TUIEntry *entry, const char *text, size_t n, size_t *len) {
+  size_t start = entry->lineIndex[n];
+  size_t end = (n + 1 < entry->lineCount) ? entry->lineIndex[n + 1] - 1 : entry->length;
+  if (end > start && text[end - 1] == '\n')
+    end--;
+  if (end > start && text[end - 1] == '\r')
+    end--;
+  *len = end - start;
+  return text + start;
+}
+
+void OpenTUIDetail(int index) {
+  if (index < 0 || index >= tuiLogCount)
+    return;
+  if (!EnsureLineIndex(&tuiLogBuffer[index]))
+    return;
+  TouchTUIEntry(&tuiLogBuffer[index]);
+  tuiDetailEntry = index;
+  tuiDetailTop = 0;
+  bTuiDetailOpen = true;
+  tuiNeedRedraw = true;
+}
+
+void CloseTUIDetail() {
+  bTuiDetailOpen = false;
+  tuiDetailEntry = -1;
+  tuiNeedRedraw = true;
+}
+
+void ScrollTUIDetail(long delta) {
+  const TUIEntry *entry = &tuiLogBuffer[tuiDetailEntry];
+  long page = terminalHeight - 4;
+  if (page < 1) page = 1;
+  long maxTop = (long)entry->lineCount - page;
+  if (maxTop < 0) maxTop = 0;
+
+  long top = (long)tuiDetailTop + delta;
+  if (top > maxTop) top = maxTop;
+  if (top < 0) top = 0;
+  tuiDetailTop = (size_t)top;
+  tuiNeedRedraw = true;
+}
+
+void RedrawTUIDetail() {
+  TUIEntry *entry = &tuiLogBuffer[tuiDetailEntry];
+  const char *entryText = TUIEntryText(entry);
+  int bodyHeight = terminalHeight - 4;
+
+  char title[160];
+  snprintf(title, sizeof(title), " Entry [%d] | Lines %zu-%zu of %zu | %zu bytes | Esc/q to close",
+           tuiDetailEntry + 1, entry->lineCount ? tuiDetailTop + 1 : 0,
+           (tuiDetailTop + bodyHeight < entry->lineCount) ? tuiDetailTop + bodyHeight : entry->lineCount,
+           entry->lineCount, entry->length);
+  printf("\033[4;1H");
+  printf("\033[47m\033[30m");
+  PrintColumns(title, terminalWidth);
+  printf("\033[0m");
+
+  for (int i = 0; i < bodyHeight; i++) {
+    printf("\033[%d;1H", 5 + i);
+    printf("\033[K");
+    size_t line = tuiDetailTop + (size_t)i;
+    if (entryText && line < entry->lineCount) {
+      size_t len;
+      const char *text = GetEntryLine(entry, entryText, line, &len);
+      PrintSanitizedColumns(text, len, terminalWidth, true);
     }
-    tuiLogBuffer[tuiMaxLogLines - 1] = strdup(truncatedText);
   }
 
-  int logAreaHeight = terminalHeight - 3;
-  if (tuiLogCount > logAreaHeight) {
-    tuiScrollOffset = tuiLogCount - logAreaHeight;
+  fflush(stdout);
+}
+
+// Removes entry index from the list, keeping selection, scroll position and
+// the detail pane on the same entries.
+void RemoveTUIEntry(int index) {
+  AUTOCOPY_PROBE2(history_evict, tuiLogBuffer[index].id, tuiLogBuffer[index].length);
+  SessionAppendUpdate(SESSION_REC_EVICT, &tuiLogBuffer[index]);
+  if (tuiLogBuffer[index].flags & TUI_ENTRY_MARKED)
+    tuiMarkedCount--;
+  FreeTUIEntry(&tuiLogBuffer[index]);
+  memmove(&tuiLogBuffer[index], &tuiLogBuffer[index + 1], (tuiLogCount - index - 1) * sizeof(TUIEntry));
+  tuiLogCount--;
+  memset(&tuiLogBuffer[tuiLogCount], 0, sizeof(TUIEntry));
+  tuiEvictedCount++;
+
+  if (tuiSelectedLine > index || tuiSelectedLine >= tuiLogCount)
+    tuiSelectedLine--;
+  if (tuiScrollOffset > index)
+    tuiScrollOffset--;
+  if (bTuiDetailOpen) {
+    if (tuiDetailEntry == index)
+      CloseTUIDetail();
+    else if (tuiDetailEntry > index)
+      tuiDetailEntry--;
+  }
+}
+
+// Least recently viewed/copied entry that may be evicted, or -1.
+int FindEvictableTUIEntry() {
+  int victim = -1;
+  for (int i = 0; i < tuiLogCount; i++) {
+    const TUIEntry *entry = &tuiLogBuffer[i];
+    if (entry->flags & TUI_ENTRY_KEPT)
+      continue;
+    if (bTuiDetailOpen && i == tuiDetailEntry)
+      continue;
+    if (victim < 0 || entry->lastUse < tuiLogBuffer[victim].lastUse)
+      victim = i;
+  }
+  return victim;
+}
+
+// Brings the history back under --logbuffer and --maxmem. Derived data
+// (decoded copies, line indexes) is dropped before any entry is evicted.
+void EnforceHistoryBudget() {
+  const unsigned char *detailPacked = bTuiDetailOpen ? tuiLogBuffer[tuiDetailEntry].packed : NULL;
+
+  if (tuiMaxMemory > 0 && tuiResidentBytes > tuiMaxMemory) {
+    for (int i = 0; i < TUI_UNPACK_CACHE_SLOTS && tuiResidentBytes > tuiMaxMemory; i++) {
+      TUIUnpackSlot *slot = &tuiUnpackCache[i];
+      if (slot->text && slot->packed != detailPacked) {
+        tuiResidentBytes -= slot->length + 1;
+        free(slot->text);
+        memset(slot, 0, sizeof(*slot));
+      }
+    }
+    for (int i = 0; i < tuiLogCount && tuiResidentBytes > tuiMaxMemory; i++) {
+      TUIEntry *entry = &tuiLogBuffer[i];
+      if (entry->lineIndex && !(bTuiDetailOpen && i == tuiDetailEntry)) {
+        tuiResidentBytes -= entry->lineCount * sizeof(uint32_t);
+        free(entry->lineIndex);
+        entry->lineIndex = NULL;
+        entry->lineCount = 0;
+      }
+    }
+  }
+
+  while (tuiLogCount > tuiMaxLogLines ||
+         (tuiMaxMemory > 0 && tuiResidentBytes > tuiMaxMemory)) {
+    int victim = FindEvictableTUIEntry();
+    if (victim < 0)
+      break;
+    RemoveTUIEntry(victim);
+  }
+}
+
+void ToggleTUIPin(int index) {
+  if (index < 0 || index >= tuiLogCount)
+    return;
+  TUIEntry *entry = &tuiLogBuffer[index];
+  if (entry->flags & TUI_ENTRY_KEPT) {
+    entry->flags &= ~TUI_ENTRY_KEPT;
+    SessionAppendUpdate(SESSION_REC_FLAGS, entry);
+    EnforceHistoryBudget();
+  } else {
+    entry->flags |= TUI_ENTRY_PINNED;
+    SessionAppendUpdate(SESSION_REC_FLAGS, entry);
+  }
+  tuiNeedRedraw = true;
+}
+
+// Hands an entry's text, or the blob it names, to the clipboard owner.
+bool CopyTUIEntryToClipboard(TUIEntry *entry) {
+  const char *text = TUIEntryText(entry);
+  if (!text)
+    return false;
+  char mime[64], path[MAX_PATH];
+  if ((entry->flags & TUI_ENTRY_BLOB) && ParseBlobPlaceholder(text, mime, sizeof(mime), path, sizeof(path)))
+    CopyBlobToClipboard(mime, path);
+  else
+    CopyToClipboard(text);
+  return true;
+}
+
+// Index of the entry with capture id, or -1 once it was evicted. Entries
+// are kept in capture order.
+int FindTUIEntryById(unsigned long long id) {
+  int low = 0, high = tuiLogCount - 1;
+  while (low <= high) {
+    int mid = low + (high - low) / 2;
+    if (tuiLogBuffer[mid].id == id)
+      return mid;
+    if (tuiLogBuffer[mid].id < id)
+      low = mid + 1;
+    else
+      high = mid - 1;
+  }
+  return -1;
+}
+
+// Space: adds the entry to the multi-selection or takes it out.
+void ToggleTUIMark(int index) {
+  if (index < 0 || index >= tuiLogCount)
+    return;
+  TUIEntry *entry = &tuiLogBuffer[index];
+  entry->flags ^= TUI_ENTRY_MARKED;
+  tuiMarkedCount += (entry->flags & TUI_ENTRY_MARKED) ? 1 : -1;
+  tuiNeedRedraw = true;
+}
+
+void ClearTUIMarks() {
+  for (int i = 0; i < tuiLogCount && tuiMarkedCount > 0; i++) {
+    if (tuiLogBuffer[i].flags & TUI_ENTRY_MARKED) {
+      tuiLogBuffer[i].flags &= ~TUI_ENTRY_MARKED;
+      tuiMarkedCount--;
+    }
+  }
+  tuiNeedRedraw = true;
+}
+
+// Shift+Up/Down: moves the selection and marks every entry it passes.
+void ExtendTUIMarks(int delta) {
+  if (tuiSelectedLine < 0) {
+    TUIMoveSelection(delta);
+    return;
+  }
+  int from = tuiSelectedLine;
+  TUIMoveSelection(delta);
+  int low = from < tuiSelectedLine ? from : tuiSelectedLine;
+  int high = from < tuiSelectedLine ? tuiSelectedLine : from;
+  for (int i = low; i <= high; i++) {
+    if (!(tuiLogBuffer[i].flags & TUI_ENTRY_MARKED)) {
+      tuiLogBuffer[i].flags |= TUI_ENTRY_MARKED;
+      tuiMarkedCount++;
+    }
+  }
+}
+
+// Ctrl+Enter with entries marked: puts them on the clipboard oldest first,
+// joined by --separator, without building the combined text. They are kept
+// out of eviction like a single re-copy, so the references stay valid. Past
+// MAX_COPY_GATHER, the newer marks stay set and the header says so.
+void RecopyTUIMarks() {
+  unsigned long long ids[MAX_COPY_GATHER];
+  int count = 0;
+  for (int i = 0; i < tuiLogCount && count < MAX_COPY_GATHER; i++) {
+    TUIEntry *entry = &tuiLogBuffer[i];
+    if (!(entry->flags & TUI_ENTRY_MARKED))
+      continue;
+    entry->flags &= ~TUI_ENTRY_MARKED;
+    tuiMarkedCount--;
+    ids[count++] = entry->id;
+    if (!(entry->flags & TUI_ENTRY_RECOPIED)) {
+      entry->flags |= TUI_ENTRY_RECOPIED;
+      SessionAppendUpdate(SESSION_REC_FLAGS, entry);
+    }
+    TouchTUIEntry(entry);
+  }
+  CopyEntriesToClipboard(ids, count);
+  tuiCopyLeftOut = tuiMarkedCount;
+  tuiNeedRedraw = true;
+}
+
+// Ctrl+Enter: re-copies an entry and keeps it out of eviction.
+void RecopyTUIEntry(int index) {
+  if (index < 0 || index >= tuiLogCount)
+    return;
+  TUIEntry *entry = &tuiLogBuffer[index];
+  if (!CopyTUIEntryToClipboard(entry))
+    return;
+  if (!(entry->flags & TUI_ENTRY_RECOPIED)) {
+    entry->flags |= TUI_ENTRY_RECOPIED;
+    SessionAppendUpdate(SESSION_REC_FLAGS, entry);
+  }
+  TouchTUIEntry(entry);
+  tuiNeedRedraw = true;
+}
+
+size_t ParseByteSize(const char *arg) {
+  char *end;
+  unsigned long long value = strtoull(arg, &end, 10);
+  switch (*end) {
+  case 'k': case 'K': value <<= 10; break;
+  case 'm': case 'M': value <<= 20; break;
+  case 'g': case 'G': value <<= 30; break;
+  }
+  return (size_t)value;
+}
+
+void RedrawTUILogs() {
+  GetTerminalSize();
+
+  if (bTuiDetailOpen) {
+    RedrawTUIDetail();
+    return;
+  }
+
+  int logAreaHeight = terminalHeight - 3;
+  int startLine = tuiScrollOffset;
+
+  if (startLine < 0) startLine = 0;
+  if (startLine > tuiLogCount - logAreaHeight) startLine = tuiLogCount - logAreaHeight;
+  if (startLine < 0) startLine = 0;
+
+  tuiScrollOffset = startLine;
+
+  for (int i = 0; i < logAreaHeight; i++) {
+    printf("\033[%d;1H", 4 + i);
+    printf("\033[K");
+    int logIndex = startLine + i;
+    if (logIndex < tuiLogCount) {
+      char prefix[32];
+      unsigned flags = tuiLogBuffer[logIndex].flags;
+      char mark = (flags & TUI_ENTRY_MARKED) ? '+' : (flags & TUI_ENTRY_KEPT) ? '*' : ':';
+      int prefixLen = snprintf(prefix, sizeof(prefix), "[%d]%c ", logIndex + 1, mark);
+      if (prefixLen > terminalWidth) prefixLen = terminalWidth;
+      if (logIndex == tuiSelectedLine) {
+        printf("\033[47m\033[30m");
+      }
+      fwrite(prefix, 1, prefixLen, stdout);
+      size_t previewLen;
+      const char *preview = TUIEntryPreview(&tuiLogBuffer[logIndex],
+                                            (size_t)terminalWidth * 4 + 16, &previewLen);
+      PrintSanitizedColumns(preview, previewLen, terminalWidth - prefixLen, false);
+      if (logIndex == tuiSelectedLine) {
+        printf("\033[0m");
+      }
+    }
+  }
+
+  fflush(stdout);
+}
+
+void AddTUILogMessage(const char *text, unsigned entryFlags) {
+  // Never cut a stored line in the middle of a UTF-8 sequence.
+  size_t len = Utf8Boundary(text, strnlen(text, (size_t)tuiLineSizeLimit));
+  char *truncatedText = strndup(text, len);
+  if (!truncatedText)
+    return;
+
+  if (tuiLogCount == MAX_TUI_LINES) {
+    // Every slot holds a kept entry; the oldest one has to go.
+    RemoveTUIEntry(0);
+  }
+  TUIEntry *entry = &tuiLogBuffer[tuiLogCount];
+  StoreTUIEntry(entry, truncatedText, len);
+  entry->flags |= entryFlags;
+  entry->id = nCaptureId;
+  entry->timestamp_us = NowMicros();
+  TouchTUIEntry(entry);
+  SessionAppendEntry(entry);
+  tuiLogCount++;
+  AUTOCOPY_PROBE2(history_insert, entry->id, len);
+  EnforceHistoryBudget();
+
+  int logAreaHeight = terminalHeight - 3;
+  if (tuiLogCount > logAreaHeight) {
+    tuiScrollOffset = tuiLogCount - logAreaHeight;
+  }
+
+  tuiSelectedLine = tuiLogCount - 1;
+
+  DrawTUIHeader();
+  RedrawTUILogs();
+}
+
+// Session snapshot: an append-only file of fixed-header records. On startup
+// it is mmap'd and entries point straight into the mapping; only record
+// headers are walked, payloads are not copied or decoded.
+uint32_t Crc32c(uint32_t crc, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  crc = ~crc;
+#if defined(__SSE4_2__)
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc = (uint32_t)_mm_crc32_u64(crc, v);
+  }
+  for (; len > 0; len--)
+    crc = _mm_crc32_u8(crc, *p++);
+#else
+  static uint32_t table[256];
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+      table[i] = c;
+    }
+  }
+  for (; len > 0; len--)
+    crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+#endif
+  return ~crc;
+}
+
+static uint32_t SessionHeaderCrc(const SessionRecord *rec) {
+  return Crc32c(0, rec, offsetof(SessionRecord, headerCrc));
+}
+
+static size_t SessionRecordSize(const SessionRecord *rec) {
+  return (sizeof(SessionRecord) + rec->payloadSize + 7) & ~(size_t)7;
+}
+
+static bool SessionAppend(SessionRecord *rec, const void *payload) {
+  if (sessionFd < 0)
+    return true;
+
+  static const unsigned char zeros[8] = {0};
+  rec->magic = SESSION_REC_MAGIC;
+  rec->payloadCrc = Crc32c(0, payload, rec->payloadSize);
+  rec->headerCrc = SessionHeaderCrc(rec);
+  size_t padding = SessionRecordSize(rec) - sizeof(SessionRecord) - rec->payloadSize;
+
+  struct iovec iov[3] = {
+    {rec, sizeof(SessionRecord)},
+    {(void *)payload, rec->payloadSize},
+    {(void *)zeros, padding},
+  };
+  ssize_t expected = (ssize_t)(sizeof(SessionRecord) + rec->payloadSize + padding);
+  if (writev(sessionFd, iov, 3) != expected) {
+    // Stop writing rather than leave a gap; the torn tail is cut on next start.
+    close(sessionFd);
+    sessionFd = -1;
+    return false;
+  }
+  return true;
+}
+
+void SessionAppendEntry(const TUIEntry *entry) {
+  SessionRecord rec = {0};
+  rec.type = SESSION_REC_ENTRY;
+  rec.entryFlags = (uint16_t)(entry->flags & TUI_ENTRY_PERSISTED);
+  rec.id = entry->id;
+  rec.timestamp_us = entry->timestamp_us;
+  rec.length = entry->length;
+  if (entry->packed) {
+    rec.encoding = SESSION_ENCODING_LZ4;
+    rec.payloadSize = entry->packedSize;
+    SessionAppend(&rec, entry->packed);
+  } else {
+    // Stored with its NUL so the mapped text can be used as a C string.
+    rec.encoding = SESSION_ENCODING_RAW;
+    rec.payloadSize = entry->length + 1;
+    SessionAppend(&rec, entry->text);
+  }
+}
+
+void SessionAppendUpdate(unsigned type, const TUIEntry *entry) {
+  SessionRecord rec = {0};
+  rec.type = (uint8_t)type;
+  rec.entryFlags = (uint16_t)(entry->flags & TUI_ENTRY_PERSISTED);
+  rec.id = entry->id;
+  SessionAppend(&rec, NULL);
+}
+
+// Validates the record at offset; payload checksums are only verified for
+// records written after the last clean shutdown.
+static const SessionRecord *SessionRecordAt(const unsigned char *map, size_t size, size_t offset,
+                                            bool verifyPayload) {
+  if (size - offset < sizeof(SessionRecord))
+    return NULL;
+  const SessionRecord *rec = (const SessionRecord *)(map + offset);
+  if (rec->magic != SESSION_REC_MAGIC || rec->headerCrc != SessionHeaderCrc(rec))
+    return NULL;
+  if (rec->payloadSize > size - offset - sizeof(SessionRecord) ||
+      SessionRecordSize(rec) > size - offset)
+    return NULL;
+  if (verifyPayload && rec->payloadCrc != Crc32c(0, rec + 1, rec->payloadSize))
+    return NULL;
+  return rec;
+}
+
+static int CompareSessionSlots(const void *a, const void *b) {
+  uint64_t x = ((const SessionSlot *)a)->rec->id;
+  uint64_t y = ((const SessionSlot *)b)->rec->id;
+  return (x > y) - (x < y);
+}
+
+// Collects the live entry records (oldest first) with their current flags.
+// *validEnd is set to the end of the last intact record. Returns false if
+// the live list could not be allocated; the scan then stopped early and
+// *validEnd says nothing about the file.
+static bool SessionScan(const unsigned char *map, size_t size, SessionSlot **liveOut, size_t *countOut,
+                        size_t *validEnd, size_t *liveBytes, uint64_t *maxId) {
+  // Records up to the last sync marker were fsync'd; the rest need payload checks.
+  size_t syncedEnd = sizeof(SessionFileHeader);
+  size_t offset = sizeof(SessionFileHeader);
+  const SessionRecord *rec;
+  while ((rec = SessionRecordAt(map, size, offset, false)) != NULL) {
+    offset += SessionRecordSize(rec);
+    if (rec->type == SESSION_REC_SYNC)
+      syncedEnd = offset;
+  }
+
+  size_t capacity = 1024, count = 0;
+  SessionSlot *live = malloc(capacity * sizeof(*live));
+  if (!live)
+    return false;
+  offset = sizeof(SessionFileHeader);
+  while ((rec = SessionRecordAt(map, size, offset, offset >= syncedEnd)) != NULL) {
+    offset += SessionRecordSize(rec);
+    if (rec->type == SESSION_REC_ENTRY) {
+      if (rec->id > *maxId)
+        *maxId = rec->id;
+      if (count == capacity) {
+        SessionSlot *grown = realloc(live, 2 * capacity * sizeof(*live));
+        if (!grown) {
+          free(live);
+          return false;
+        }
+        live = grown;
+        capacity *= 2;
+      }
+      live[count].rec = rec;
+      live[count].flags = rec->entryFlags;
+      count++;
+    } else if (rec->type == SESSION_REC_EVICT || rec->type == SESSION_REC_FLAGS) {
+      // Entry ids only grow, so the live list is sorted by id.
+      SessionSlot key = {rec, 0};
+      SessionSlot *hit = bsearch(&key, live, count, sizeof(*live), CompareSessionSlots);
+      if (hit && rec->type == SESSION_REC_EVICT) {
+        memmove(hit, hit + 1, (size_t)(live + count - hit - 1) * sizeof(*live));
+        count--;
+      } else if (hit) {
+        hit->flags = rec->entryFlags;
+      }
+    }
+  }
+
+  *liveBytes = 0;
+  for (size_t i = 0; i < count; i++)
+    *liveBytes += SessionRecordSize(live[i].rec);
+  *validEnd = offset;
+  *liveOut = live;
+  *countOut = count;
+  return true;
+}
+
+// Rewrites only the live records to a temporary file and renames it over
+// the snapshot, so a crash leaves either the old or the new file.
+static bool SessionCompact(const char *path, const SessionSlot *live, size_t count) {
+  char tmpPath[MAX_PATH + 8];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return false;
+
+  SessionFileHeader header = {SESSION_FILE_MAGIC, SESSION_VERSION, 0};
+  bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+  for (size_t i = 0; ok && i < count; i++) {
+    SessionRecord rec = *live[i].rec;
+    rec.entryFlags = live[i].flags;
+    rec.headerCrc = SessionHeaderCrc(&rec);
+    size_t size = SessionRecordSize(&rec);
+    struct iovec iov[2] = {
+      {&rec, sizeof(rec)},
+      {(void *)(live[i].rec + 1), size - sizeof(rec)},
+    };
+    ok = writev(fd, iov, 2) == (ssize_t)size;
+  }
+  SessionRecord sync = {0};
+  sync.magic = SESSION_REC_MAGIC;
+  sync.type = SESSION_REC_SYNC;
+  sync.payloadCrc = Crc32c(0, NULL, 0);
+  sync.headerCrc = SessionHeaderCrc(&sync);
+  ok = ok && write(fd, &sync, sizeof(sync)) == (ssize_t)sizeof(sync);
+  ok = ok && fdatasync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tmpPath, path) != 0) {
+    unlink(tmpPath);
+    return false;
+  }
+  return true;
+}
+
+// Maps the snapshot and attaches its entries, then opens it for appending.
+// Must run before the first capture is added.
+bool SessionOpen(const char *path) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      fprintf(stderr, "Error: Could not open session file %s: %s\n", path, strerror(errno));
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+
+    SessionFileHeader header = {SESSION_FILE_MAGIC, SESSION_VERSION, 0};
+    size_t size = (size_t)st.st_size;
+    unsigned char *map = NULL;
+    if (size >= sizeof(SessionFileHeader)) {
+      map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED || memcmp(map, &header, sizeof(header)) != 0) {
+        fprintf(stderr, "Error: %s is not an autocopy session file\n", path);
+        if (map != MAP_FAILED)
+          munmap(map, size);
+        close(fd);
+        return false;
+      }
+    } else if (ftruncate(fd, 0) != 0 || write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+      close(fd);
+      return false;
+    }
+
+    SessionSlot *live = NULL;
+    size_t count = 0, validEnd = sizeof(SessionFileHeader), liveBytes = 0;
+    uint64_t maxId = 0;
+    // Out of memory is not a torn tail: leave the file alone.
+    if (map && !SessionScan(map, size, &live, &count, &validEnd, &liveBytes, &maxId)) {
+      fprintf(stderr, "Error: Not enough memory to read session file %s\n", path);
+      munmap(map, size);
+      close(fd);
+      return false;
+    }
+
+    // Mostly evicted records: rewrite once and attach the compacted file.
+    if (attempt == 0 && map && validEnd > 1024 * 1024 && liveBytes < (validEnd - sizeof(SessionFileHeader)) / 2 &&
+        SessionCompact(path, live, count)) {
+      free(live);
+      munmap(map, size);
+      close(fd);
+      continue;
+    }
+
+    // Cut a torn tail left by a crash before appending after it.
+    if (validEnd < size && ftruncate(fd, (off_t)validEnd) != 0) {
+      free(live);
+      munmap(map, size);  // a tail to cut means the file was mapped
+      close(fd);
+      return false;
+    }
+    lseek(fd, 0, SEEK_END);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND);
+
+    size_t first = (count > (size_t)tuiMaxLogLines) ? count - tuiMaxLogLines : 0;
+    for (size_t i = first; i < count; i++) {
+      const SessionRecord *rec = live[i].rec;
+      TUIEntry *entry = &tuiLogBuffer[tuiLogCount++];
+      memset(entry, 0, sizeof(*entry));
+      entry->id = rec->id;
+      entry->timestamp_us = rec->timestamp_us;
+      entry->length = rec->length;
+      entry->flags = (live[i].flags & TUI_ENTRY_PERSISTED) | TUI_ENTRY_MAPPED;
+      if (rec->encoding == SESSION_ENCODING_LZ4) {
+        entry->packed = (unsigned char *)(rec + 1);
+        entry->packedSize = rec->payloadSize;
+        tuiPackedCount++;
+        tuiPackedRawBytes += entry->length;
+        tuiPackedBytes += entry->packedSize;
+      } else {
+        entry->text = (char *)(rec + 1);
+      }
+      TouchTUIEntry(entry);
+      tuiResidentBytes += TUIEntryBytes(entry);
+    }
+    // Ids keep growing across restarts, also past evicted entries.
+    if (maxId > nCaptureId)
+      nCaptureId = maxId;
+
+    // Live records beyond --logbuffer are dropped from the snapshot too.
+    sessionFd = fd;
+    for (size_t i = 0; i < first; i++) {
+      SessionRecord rec = {0};
+      rec.type = SESSION_REC_EVICT;
+      rec.id = live[i].rec->id;
+      SessionAppend(&rec, NULL);
+    }
+    free(live);
+
+    sessionMap = map;
+    sessionMapSize = size;
+    sessionRestoredCount = tuiLogCount;
+    tuiSelectedLine = tuiLogCount - 1;
+    EnforceHistoryBudget();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sessionRestoreMs = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    return true;
+  }
+  return false;
+}
+
+// Marks everything written so far as durable so the next start can skip
+// payload checksums.
+void SessionClose() {
+  if (sessionFd < 0)
+    return;
+  if (fdatasync(sessionFd) == 0) {
+    SessionRecord rec = {0};
+    rec.type = SESSION_REC_SYNC;
+    if (SessionAppend(&rec, NULL))
+      fdatasync(sessionFd);
+  }
+  if (sessionFd >= 0)
+    close(sessionFd);
+  sessionFd = -1;
+}
+
+bool TUIInputInit() {
+  struct termios newt;
+  if (tcgetattr(STDIN_FILENO, &g_original_termios) != 0)
+    return false;
+  g_termios_saved = true;
+  newt = g_original_termios;
+  newt.c_lflag &= ~(ICANON | ECHO);
+  newt.c_cc[VMIN] = 1;
+  newt.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+
+  // stdin stays blocking: on a terminal it shares its file status flags with
+  // stdout and stderr, which O_NONBLOCK would make fail redraws with EAGAIN.
+  // HandleTUIInput reads once per readiness event, which never blocks.
+  g_original_stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+
+  // Mouse button reporting in SGR encoding, for the scroll wheel.
+  printf("\033[?1000h\033[?1006h");
+  fflush(stdout);
+  return true;
+}
+
+// Moves the selection to index (clamped) and scrolls it into view.
+void TUISelect(int index) {
+  if (tuiLogCount == 0)
+    return;
+  if (index < 0) index = 0;
+  if (index > tuiLogCount - 1) index = tuiLogCount - 1;
+
+  int logAreaHeight = terminalHeight - 3;
+  tuiSelectedLine = index;
+  if (tuiSelectedLine < tuiScrollOffset) {
+    tuiScrollOffset = tuiSelectedLine;
+  } else if (tuiSelectedLine >= tuiScrollOffset + logAreaHeight) {
+    tuiScrollOffset = tuiSelectedLine - logAreaHeight + 1;
+  }
+  tuiNeedRedraw = true;
+}
+
+void TUIMoveSelection(int delta) {
+  if (tuiSelectedLine < 0) {
+    // Nothing selected yet: moving up starts from the newest entry.
+    TUISelect(delta < 0 ? tuiLogCount - 1 : 0);
+  } else {
+    TUISelect(tuiSelectedLine + delta);
+  }
+}
+
+// Any key dismisses the multi-copy limit note.
+static void DismissTUINote() {
+  if (tuiCopyLeftOut > 0) {
+    tuiCopyLeftOut = 0;
+    tuiNeedRedraw = true;
+  }
+}
+
+void ApplyTUIKey(TUIKey key) {
+  int page = terminalHeight - 3;
+  if (page < 1) page = 1;
+  if (key != TUI_KEY_NONE)
+    DismissTUINote();
+
+  if (bTuiDetailOpen) {
+    switch (key) {
+    case TUI_KEY_UP:
+    case TUI_KEY_SHIFT_UP:   ScrollTUIDetail(-1); break;
+    case TUI_KEY_DOWN:
+    case TUI_KEY_SHIFT_DOWN: ScrollTUIDetail(1); break;
+    case TUI_KEY_PGUP:       ScrollTUIDetail(-(page - 1)); break;
+    case TUI_KEY_PGDN:       ScrollTUIDetail(page - 1); break;
+    case TUI_KEY_HOME:       ScrollTUIDetail(LONG_MIN / 2); break;
+    case TUI_KEY_END:        ScrollTUIDetail(LONG_MAX / 2); break;
+    case TUI_KEY_WHEEL_UP:   ScrollTUIDetail(-TUI_WHEEL_STEP); break;
+    case TUI_KEY_WHEEL_DOWN: ScrollTUIDetail(TUI_WHEEL_STEP); break;
+    case TUI_KEY_ESC:        CloseTUIDetail(); break;
+    default: break;
+    }
+    return;
+  }
+
+  if (key != TUI_KEY_ESC && key != TUI_KEY_NONE && tuiJumpNumber > 0) {
+    tuiJumpNumber = 0;
+    tuiNeedRedraw = true;
+  }
+
+  switch (key) {
+  case TUI_KEY_UP:         TUIMoveSelection(-1); break;
+  case TUI_KEY_DOWN:       TUIMoveSelection(1); break;
+  case TUI_KEY_PGUP:       TUIMoveSelection(-page); break;
+  case TUI_KEY_PGDN:       TUIMoveSelection(page); break;
+  case TUI_KEY_HOME:       TUISelect(0); break;
+  case TUI_KEY_END:        TUISelect(tuiLogCount - 1); break;
+  case TUI_KEY_WHEEL_UP:   TUIMoveSelection(-TUI_WHEEL_STEP); break;
+  case TUI_KEY_WHEEL_DOWN: TUIMoveSelection(TUI_WHEEL_STEP); break;
+  case TUI_KEY_SHIFT_UP:   ExtendTUIMarks(-1); break;
+  case TUI_KEY_SHIFT_DOWN: ExtendTUIMarks(1); break;
+  case TUI_KEY_ESC:
+    if (tuiJumpNumber > 0) {
+      tuiJumpNumber = 0;
+      tuiNeedRedraw = true;
+    } else if (tuiMarkedCount > 0) {
+      ClearTUIMarks();
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void ApplyTUIChar(unsigned char ch) {
+  bool ctrlEnter = (ch == 10 || ch == 13) && bCtrlKeyPressed;
+  DismissTUINote();
+
+  if (bTuiDetailOpen) {
+    if (ctrlEnter) {
+      RecopyTUIEntry(tuiDetailEntry);
+    } else if (ch == 10 || ch == 13 || ch == 'q' || ch == 'Q') {
+      CloseTUIDetail();
+    } else if (ch == 'p' || ch == 'P') {
+      ToggleTUIPin(tuiDetailEntry);
+    } else if (ch == 'u' || ch == 'U') {
+      ScrollTUIDetail(-1);
+    } else if (ch == 'd' || ch == 'D') {
+      ScrollTUIDetail(1);
+    }
+    return;
+  }
+
+  if (ch >= '0' && ch <= '9') {
+    // Digits build an entry number; Enter jumps to it.
+    if (tuiJumpNumber < 100000000) {
+      tuiJumpNumber = tuiJumpNumber * 10 + (ch - '0');
+      tuiNeedRedraw = true;
+    }
+  } else if (ch == 127 || ch == 8) {
+    tuiJumpNumber /= 10;
+    tuiNeedRedraw = true;
+  } else if (ch == 10 || ch == 13) {
+    if (tuiJumpNumber > 0) {
+      TUISelect(tuiJumpNumber - 1);
+      tuiJumpNumber = 0;
+      tuiNeedRedraw = true;
+    } else if (tuiSelectedLine >= 0 && tuiSelectedLine < tuiLogCount) {
+      // Ctrl state is tracked from the XRecord key stream, no round trip needed.
+      if (ctrlEnter && tuiMarkedCount > 0) {
+        RecopyTUIMarks();
+      } else if (ctrlEnter) {
+        RecopyTUIEntry(tuiSelectedLine);
+      } else {
+        OpenTUIDetail(tuiSelectedLine);
+      }
+    }
+  } else if (ch == 'p' || ch == 'P') {
+    ToggleTUIPin(tuiSelectedLine);
+  } else if (ch == ' ') {
+    ToggleTUIMark(tuiSelectedLine);
+  } else if (ch == 'u' || ch == 'U') {
+    tuiScrollOffset--;
+    tuiNeedRedraw = true;
+  } else if (ch == 'd' || ch == 'D') {
+    tuiScrollOffset++;
+    tuiNeedRedraw = true;
+  }
+}
+
+// Parses one sequence starting at ESC. Returns the bytes consumed, or 0 if
+// the sequence is still incomplete.
+size_t ParseEscapeSequence(const unsigned char *buf, size_t len, TUIKey *key) {
+  *key = TUI_KEY_NONE;
+  if (len < 2)
+    return 0;
+
+  if (buf[1] == 'O') {
+    // SS3, sent for arrows/Home/End in application cursor mode
+    if (len < 3)
+      return 0;
+    switch (buf[2]) {
+    case 'A': *key = TUI_KEY_UP; break;
+    case 'B': *key = TUI_KEY_DOWN; break;
+    case 'H': *key = TUI_KEY_HOME; break;
+    case 'F': *key = TUI_KEY_END; break;
+    }
+    return 3;
+  }
+  if (buf[1] != '[') {
+    // ESC followed by a plain key (Alt+key or a fast bare ESC)
+    *key = TUI_KEY_ESC;
+    return 1;
+  }
+
+  size_t i = 2;
+  bool sgrMouse = (i < len && buf[i] == '<');
+  if (sgrMouse)
+    i++;
+
+  int params[4] = {0};
+  int nparams = 0;
+  for (; i < len; i++) {
+    unsigned char c = buf[i];
+    if (c >= '0' && c <= '9') {
+      if (nparams == 0)
+        nparams = 1;
+      if (nparams <= 4 && params[nparams - 1] < 100000)
+        params[nparams - 1] = params[nparams - 1] * 10 + (c - '0');
+    } else if (c == ';') {
+      nparams = (nparams == 0) ? 2 : nparams + 1;
+    } else if (c >= 0x40 && c <= 0x7E) {
+      break;
+    } else if (c < 0x20 || c > 0x7E) {
+      // Malformed: drop what we have and resume at this byte.
+      return i;
+    }
+  }
+  if (i >= len)
+    return 0;
+
+  unsigned char final = buf[i];
+  if (sgrMouse) {
+    // ESC [ < b ; x ; y M, wheel buttons are 64/65 plus modifier bits.
+    int button = params[0] & ~(4 | 8 | 16);
+    if (final == 'M' && button == 64)
+      *key = TUI_KEY_WHEEL_UP;
+    else if (final == 'M' && button == 65)
+      *key = TUI_KEY_WHEEL_DOWN;
+  } else {
+    // ESC [ 1 ; m A: modifier m - 1 has bit 0 set for Shift.
+    bool shift = nparams >= 2 && ((params[1] - 1) & 1);
+    switch (final) {
+    case 'A': *key = shift ? TUI_KEY_SHIFT_UP : TUI_KEY_UP; break;
+    case 'B': *key = shift ? TUI_KEY_SHIFT_DOWN : TUI_KEY_DOWN; break;
+    case 'H': *key = TUI_KEY_HOME; break;
+    case 'F': *key = TUI_KEY_END; break;
+    case '~':
+      switch (params[0]) {
+      case 1: case 7: *key = TUI_KEY_HOME; break;
+      case 4: case 8: *key = TUI_KEY_END; break;
+      case 5: *key = TUI_KEY_PGUP; break;
+      case 6: *key = TUI_KEY_PGDN; break;
+      }
+      break;
+    }
+  }
+  return i + 1;
+}
+
+// Applies every complete key in buf and returns the bytes consumed. An
+// incomplete trailing escape sequence is left for the next read unless
+// flush is set (ESC timeout), in which case its ESC is taken as bare.
+size_t ProcessTUIInput(const unsigned char *buf, size_t len, bool flush) {
+  size_t pos = 0;
+  while (pos < len) {
+    if (buf[pos] != 27) {
+      ApplyTUIChar(buf[pos]);
+      pos++;
+      continue;
+    }
+
+    TUIKey key;
+    size_t used = ParseEscapeSequence(buf + pos, len - pos, &key);
+    if (used == 0) {
+      if (!flush && len - pos < TUI_INPUT_PENDING_MAX)
+        break;
+      key = TUI_KEY_ESC;
+      used = 1;
+    }
+    ApplyTUIKey(key);
+    pos += used;
+  }
+  return pos;
+}
+
+void HandleTUIInput(LoopSource *src, uint32_t events) {
+  ssize_t n = read(src->fd, tuiInputPending + tuiInputPendingLen,
+                   sizeof(tuiInputPending) - tuiInputPendingLen);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    // stdin closed: stop watching it instead of spinning on EOF.
+    LoopRemove(src);
+    return;
+  }
+  if (n < 0)
+    return;
+  tuiInputPendingLen += (size_t)n;
+
+  // Everything read so far is applied as one batch with a single redraw.
+  size_t used = ProcessTUIInput(tuiInputPending, tuiInputPendingLen, false);
+  memmove(tuiInputPending, tuiInputPending + used, tuiInputPendingLen - used);
+  tuiInputPendingLen -= used;
+  ArmTimer(srcEscTimer.fd, tuiInputPendingLen ? TUI_ESC_TIMEOUT_MS : 0);
+
+  if (tuiNeedRedraw) {
+    tuiNeedRedraw = false;
+    DrawTUIHeader();
+    RedrawTUILogs();
+  }
+}
+
+void HandleEscTimer(LoopSource *src, uint32_t events) {
+  uint64_t expirations;
+  if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+
+  ProcessTUIInput(tuiInputPending, tuiInputPendingLen, true);
+  tuiInputPendingLen = 0;
+
+  if (tuiNeedRedraw) {
+    tuiNeedRedraw = false;
+    DrawTUIHeader();
+    RedrawTUILogs();
+  }
+}
+
+
+void WriteToLog(const char *text) {
+  if (szLogFile[0] != '\0')
+    WriteToLogFile(szLogFile, "", text);
+}
+
+// Appends one timestamped line; tag goes between the timestamp and the text.
+// Safe to call from several threads. Uses a plain O_APPEND descriptor and
+// one writev, so nothing is allocated and rotated logs are picked up.
+void WriteToLogFile(const char *path, const char *tag, const char *text) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (fd >= 0) {
+    time_t now = time(NULL);
+    struct tm tmNow, *t = localtime_r(&now, &tmNow);
+    char stamp[128];
+    int stampLen = snprintf(stamp, sizeof(stamp), "[%04d-%02d-%02d %02d:%02d:%02d] %s",
+                            t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                            t->tm_hour, t->tm_min, t->tm_sec, tag);
+    if (stampLen >= (int)sizeof(stamp))
+      stampLen = sizeof(stamp) - 1;
+    struct iovec iov[3] = {{stamp, (size_t)stampLen}, {(void *)text, strlen(text)}, {"\n", 1}};
+    size_t total = iov[0].iov_len + iov[1].iov_len + 1;
+    bool ok = writev(fd, iov, 3) == (ssize_t)total;
+    ok = (close(fd) == 0) && ok;
+    MetricAdd(ok ? &metrics.logWrites : &metrics.logFailures, 1);
+    AUTOCOPY_PROBE2(log_write, total, ok);
+  } else {
+    MetricAdd(&metrics.logFailures, 1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  unsigned long micros = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000 +
+                                         (end.tv_nsec - start.tv_nsec) / 1000);
+  MetricAdd(&metrics.logWriteMicros, micros);
+  atomic_store_explicit(&metrics.logLastMicros, micros, memory_order_relaxed);
+}
+
+int64_t NowMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Chrome trace-event output (--trace-out). Each thread appends complete
+// ("X") events to its own buffer without locking; a full buffer is written
+// out by its owner, and the rest are written at exit.
+uint64_t TraceNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+uint64_t TraceBegin() {
+  return bTraceEnabled ? TraceNow() : 0;
+}
+
+static void TraceFlushBuffer(TraceBuffer *buf) {
+  size_t count = atomic_load_explicit(&buf->count, memory_order_acquire);
+  pthread_mutex_lock(&traceFileMutex);
+  if (traceFile) {
+    if (!buf->named) {
+      fprintf(traceFile, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                         "\"args\":{\"name\":\"%s\"}},\n",
+              (int)getpid(), (int)buf->tid, buf->tid == getpid() ? "event loop" : "worker");
+      buf->named = true;
+    }
+    for (size_t i = 0; i < count; i++) {
+      const TraceEvent *ev = &buf->events[i];
+      fprintf(traceFile, "{\"name\":\"%s\",\"cat\":\"capture\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                         "\"pid\":%d,\"tid\":%d",
+              ev->name, (unsigned long long)ev->start, (unsigned long long)ev->duration,
+              (int)getpid(), (int)buf->tid);
+      if (ev->captureId)
+        fprintf(traceFile, ",\"args\":{\"capture\":%llu}", ev->captureId);
+      fputs("},\n", traceFile);
+    }
+  }
+  pthread_mutex_unlock(&traceFileMutex);
+  atomic_store_explicit(&buf->count, 0, memory_order_release);
+}
+
+// Records a span from start (a TraceBegin value) to now. captureId ties the
+// span to a trigger; 0 leaves it unattributed.
+void TraceSpan(const char *name, uint64_t start, unsigned long long captureId) {
+  if (!bTraceEnabled || start == 0)
+    return;
+  uint64_t end = TraceNow();
+
+  TraceBuffer *buf = traceLocal;
+  if (!buf) {
+    buf = calloc(1, sizeof(TraceBuffer));
+    if (!buf)
+      return;
+    buf->tid = (pid_t)syscall(SYS_gettid);
+    buf->next = atomic_load_explicit(&traceBuffers, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&traceBuffers, &buf->next, buf,
+                                                  memory_order_release, memory_order_relaxed))
+      ;
+    traceLocal = buf;
+  }
+
+  size_t index = atomic_load_explicit(&buf->count, memory_order_relaxed);
+  if (index == TRACE_BUFFER_EVENTS) {
+    TraceFlushBuffer(buf);
+    index = 0;
+  }
+  TraceEvent *ev = &buf->events[index];
+  ev->name = name;
+  ev->start = start;
+  ev->duration = end - start;
+  ev->captureId = captureId;
+  atomic_store_explicit(&buf->count, index + 1, memory_order_release);
+}
+
+bool TraceOpen(const char *path) {
+  traceFile = fopen(path, "w");
+  if (!traceFile) {
+    fprintf(stderr, "Error: Could not open trace file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  // The JSON array format tolerates a missing "]", so a crash still leaves a
+  // loadable trace of everything flushed so far.
+  fputs("[\n", traceFile);
+  bTraceEnabled = true;
+  return true;
+}
+
+// Call once the other threads have stopped tracing.
+void TraceClose() {
+  if (!traceFile)
+    return;
+  bTraceEnabled = false;
+  TraceBuffer *buf = atomic_load_explicit(&traceBuffers, memory_order_acquire);
+  while (buf) {
+    TraceBuffer *next = buf->next;
+    TraceFlushBuffer(buf);
+    free(buf);
+    buf = next;
+  }
+  atomic_store_explicit(&traceBuffers, NULL, memory_order_relaxed);
+  traceLocal = NULL;
+  fprintf(traceFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"autocopy\"}}\n]\n",
+          (int)getpid());
+  fclose(traceFile);
+  traceFile = NULL;
+}
+
+static long FutexCall(_Atomic uint32_t *addr, int op, uint32_t val,
+                      const struct timespec *timeout) {
+  return syscall(SYS_futex, (uint32_t *)addr, op, val, timeout, NULL, 0);
+}
+
+bool RingCreate(const char *path, size_t sizeKB) {
+  size_t capacity = sizeKB * 1024;
+  if (capacity < 4096)
+    capacity = 4096;
+  capacity &= ~(size_t)7;
+  size_t total = RING_DATA_OFFSET + capacity;
+
+  ringFd = memfd_create("autocopy-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (ringFd < 0) {
+    fprintf(stderr, "Error: memfd_create failed: %s\n", strerror(errno));
+    return false;
+  }
+  if (ftruncate(ringFd, (off_t)total) != 0) {
+    fprintf(stderr, "Error: Could not size capture ring: %s\n", strerror(errno));
+    close(ringFd);
+    ringFd = -1;
+    return false;
+  }
+  void *mem = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, ringFd, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not map capture ring: %s\n", strerror(errno));
+    close(ringFd);
+    ringFd = -1;
+    return false;
+  }
+  // Subscribers must not be able to resize the ring under the writer.
+  fcntl(ringFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+  // The ring is read-only to subscribers, so the count of those asleep on
+  // seq lives in a page of its own that they can write.
+  ringWaitersFd = memfd_create("autocopy-ring-waiters", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  void *waiters = MAP_FAILED;
+  if (ringWaitersFd >= 0 && ftruncate(ringWaitersFd, RING_WAITERS_SIZE) == 0)
+    waiters = mmap(NULL, RING_WAITERS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ringWaitersFd, 0);
+  if (waiters == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not create capture ring waiters: %s\n", strerror(errno));
+    if (ringWaitersFd >= 0)
+      close(ringWaitersFd);
+    ringWaitersFd = -1;
+    munmap(mem, total);
+    close(ringFd);
+    ringFd = -1;
+    return false;
+  }
+  fcntl(ringWaitersFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+  ringWaiters = waiters;
+
+  ringHeader = (RingHeader *)mem;
+  ringData = (unsigned char *)mem + RING_DATA_OFFSET;
+  ringHeader->magic = RING_MAGIC;
+  ringHeader->version = RING_VERSION;
+  ringHeader->capacity = capacity;
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  ringListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path);
+  mode_t oldMask = umask(0077);
+  int rc = (ringListenFd >= 0) ? bind(ringListenFd, (struct sockaddr *)&addr, sizeof(addr)) : -1;
+  umask(oldMask);
+  if (rc != 0 || listen(ringListenFd, 8) != 0) {
+    fprintf(stderr, "Error: Could not listen on %s: %s\n", path, strerror(errno));
+    if (ringListenFd >= 0)
+      close(ringListenFd);
+    ringListenFd = -1;
+    return false;
+  }
+  return true;
+}
+
+// Single writer. Readers never block us: a record is reserved, written and
+// committed; readers that fall more than one lap behind see reserve move past
+// their position and resynchronise from tail.
+void RingPublish(unsigned long long id, const char *text, size_t len) {
+  if (!ringHeader)
+    return;
+
+  uint64_t capacity = ringHeader->capacity;
+  uint64_t maxPayload = capacity / 4 - sizeof(RingRecord);
+  uint64_t stored = len;
+  uint32_t flags = 0;
+  if (stored > maxPayload) {
+    stored = maxPayload;
+    flags |= RING_REC_TRUNCATED;
+  }
+  uint64_t size = (sizeof(RingRecord) + stored + 7) & ~(uint64_t)7;
+
+  uint64_t pos = ringWritePos;
+  uint64_t offset = pos % capacity;
+  uint64_t padSize = (offset + size > capacity) ? capacity - offset : 0;
+  uint64_t end = pos + padSize + size;
+
+  // Drop the oldest records that the new one is about to overwrite.
+  uint64_t tail = atomic_load_explicit(&ringHeader->tail, memory_order_relaxed);
+  while (end - tail > capacity) {
+    const RingRecord *old = (const RingRecord *)(ringData + tail % capacity);
+    tail += old->size;
+  }
+  atomic_store_explicit(&ringHeader->tail, tail, memory_order_relaxed);
+  atomic_store_explicit(&ringHeader->reserve, end, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  if (padSize) {
+    RingRecord *pad = (RingRecord *)(ringData + offset);
+    pad->size = (uint32_t)padSize;
+    pad->flags = RING_REC_PAD;
+    offset = 0;
+  }
+
+  RingRecord *rec = (RingRecord *)(ringData + offset);
+  rec->size = (uint32_t)size;
+  rec->flags = flags;
+  rec->seq = ++ringWriteSeq;
+  rec->id = id;
+  rec->timestamp_us = NowMicros();
+  rec->length = len;
+  rec->stored = stored;
+  memcpy(rec + 1, text, stored);
+
+  ringWritePos = end;
+  atomic_store_explicit(&ringHeader->commit, end, memory_order_release);
+  // Pairs with the subscriber's increment of ringWaiters before FUTEX_WAIT:
+  // either we see it, or the subscriber's wait sees the new seq.
+  atomic_fetch_add_explicit(&ringHeader->seq, 1, memory_order_seq_cst);
+  if (atomic_load_explicit(ringWaiters, memory_order_seq_cst) != 0)
+    FutexCall(&ringHeader->seq, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// Hands every connecting subscriber a read-only descriptor for the ring and
+// one for the waiter count.
+void HandleRingAccept(LoopSource *src, uint32_t events) {
+  char procPath[64];
+  snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", ringFd);
+
+  int client;
+  while ((client = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+    int roFd = open(procPath, O_RDONLY | O_CLOEXEC);
+    if (roFd >= 0) {
+      char tag[4] = {'A', 'C', 'R', 'G'};
+      struct iovec iov = {tag, sizeof(tag)};
+      int fds[2] = {roFd, ringWaitersFd};
+      char control[CMSG_SPACE(sizeof(fds))] = {0};
+      struct msghdr msg = {0};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+      memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+      if (sendmsg(client, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(tag))
+        MetricAdd(&metrics.ringSubscribers, 1);
+      close(roFd);
+    }
+    close(client);
+  }
+}
+
+// Reference subscriber: attaches to a running instance and prints captures.
+int RunSubscriber(const char *path) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Error: Could not connect to %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  char tag[4];
+  struct iovec iov = {tag, sizeof(tag)};
+  int fds[2] = {-1, -1};
+  char control[CMSG_SPACE(sizeof(fds))] = {0};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == sizeof(tag) && memcmp(tag, "ACRG", 4) == 0) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      size_t n = cmsg->cmsg_len - CMSG_LEN(0);
+      memcpy(fds, CMSG_DATA(cmsg), n < sizeof(fds) ? n : sizeof(fds));
+    }
+  }
+  close(sock);
+
+  int fd = fds[0];
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < RING_DATA_OFFSET) {
+    fprintf(stderr, "Error: Did not receive a capture ring from %s\n", path);
+    return 1;
+  }
+  void *mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not map capture ring: %s\n", strerror(errno));
+    return 1;
+  }
+  RingHeader *hdr = (RingHeader *)mem;
+  const unsigned char *data = (const unsigned char *)mem + RING_DATA_OFFSET;
+  if (hdr->magic != RING_MAGIC || hdr->version != RING_VERSION || fds[1] < 0 ||
+      RING_DATA_OFFSET + hdr->capacity > (uint64_t)st.st_size) {
+    fprintf(stderr, "Error: Incompatible capture ring\n");
+    return 1;
+  }
+  _Atomic uint32_t *waiters = mmap(NULL, RING_WAITERS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[1], 0);
+  close(fds[1]);
+  if (waiters == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not map capture ring: %s\n", strerror(errno));
+    return 1;
+  }
+
+  uint64_t capacity = hdr->capacity;
+  char *payload = malloc(capacity);
+  if (!payload)
+    return 1;
+
+  // Start with new captures only.
+  uint64_t pos = atomic_load_explicit(&hdr->commit, memory_order_acquire);
+  uint64_t expectSeq = 0;
+  while (1) {
+    uint32_t seq = atomic_load_explicit(&hdr->seq, memory_order_acquire);
+    uint64_t commit = atomic_load_explicit(&hdr->commit, memory_order_acquire);
+    if (pos == commit) {
+      // The writer only wakes when someone has counted themselves in.
+      struct timespec timeout = {1, 0};
+      atomic_fetch_add_explicit(waiters, 1, memory_order_seq_cst);
+      FutexCall(&hdr->seq, FUTEX_WAIT, seq, &timeout);
+      atomic_fetch_sub_explicit(waiters, 1, memory_order_seq_cst);
+      continue;
+    }
+
+    RingRecord rec = {0};
+    uint64_t offset = pos % capacity;
+    uint64_t room = capacity - offset;  // records never wrap; the writer pads instead
+    memcpy(&rec, data + offset, (room < sizeof(rec)) ? 8 : sizeof(rec));
+    // A torn or lapped header can claim any length: copy only what fits
+    // before the end of the mapping, and resynchronise below otherwise.
+    bool fits = (rec.flags & RING_REC_PAD) ||
+                (room >= sizeof(rec) && rec.stored <= room - sizeof(rec));
+    if (!(rec.flags & RING_REC_PAD) && fits)
+      memcpy(payload, data + offset + sizeof(rec), rec.stored);
+    atomic_thread_fence(memory_order_acquire);
+
+    uint64_t reserve = atomic_load_explicit(&hdr->reserve, memory_order_relaxed);
+    if (reserve - pos > capacity || !fits || rec.size == 0 || rec.size % 8 != 0) {
+      // Lapped by the writer while reading: resynchronise.
+      pos = atomic_load_explicit(&hdr->tail, memory_order_acquire);
+      fprintf(stderr, "Warning: subscriber overrun, resynchronising\n");
+      continue;
+    }
+    pos += rec.size;
+    if (rec.flags & RING_REC_PAD)
+      continue;
+
+    if (expectSeq && rec.seq > expectSeq)
+      fprintf(stderr, "Warning: subscriber overrun, %llu capture(s) lost\n",
+              (unsigned long long)(rec.seq - expectSeq));
+    expectSeq = rec.seq + 1;
+
+    printf("[Capture %llu @ %lld.%06lld, %llu bytes%s]: %.*s\n",
+           (unsigned long long)rec.id,
+           (long long)(rec.timestamp_us / 1000000), (long long)(rec.timestamp_us % 1000000),
+           (unsigned long long)rec.length,
+           (rec.flags & RING_REC_TRUNCATED) ? ", truncated" : "",
+           (int)rec.stored, payload);
+    fflush(stdout);
+  }
+  return 0;
+}
+
+// --metrics takes a socket path (anything with a '/') or [host:]port, with
+// host defaulting to 127.0.0.1.
+bool MetricsCreate(const char *spec) {
+  if (strchr(spec, '/')) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, spec, sizeof(addr.sun_path) - 1);
+    metricsListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    unlink(spec);
+    mode_t oldMask = umask(0077);
+    int rc = (metricsListenFd >= 0) ? bind(metricsListenFd, (struct sockaddr *)&addr, sizeof(addr)) : -1;
+    umask(oldMask);
+    if (rc != 0 || listen(metricsListenFd, 8) != 0) {
+      fprintf(stderr, "Error: Could not listen on %s: %s\n", spec, strerror(errno));
+      if (metricsListenFd >= 0)
+        close(metricsListenFd);
+      metricsListenFd = -1;
+      return false;
+    }
+    bMetricsUnixSocket = true;
+    return true;
+  }
+
+  char host[64] = "127.0.0.1";
+  const char *port = spec;
+  const char *colon = strrchr(spec, ':');
+  if (colon) {
+    size_t len = (size_t)(colon - spec);
+    if (len > 0 && len < sizeof(host)) {
+      memcpy(host, spec, len);
+      host[len] = '\0';
+    }
+    port = colon + 1;
+  }
+  int portNumber = atoi(port);
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)portNumber);
+  if (portNumber <= 0 || portNumber > 65535 ||
+      inet_pton(AF_INET, strcmp(host, "localhost") == 0 ? "127.0.0.1" : host, &addr.sin_addr) != 1) {
+    fprintf(stderr, "Error: Invalid metrics address %s (expected [host:]port or a socket path)\n", spec);
+    return false;
+  }
+  metricsListenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  int one = 1;
+  if (metricsListenFd >= 0)
+    setsockopt(metricsListenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (metricsListenFd < 0 || bind(metricsListenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(metricsListenFd, 8) != 0) {
+    fprintf(stderr, "Error: Could not listen on %s: %s\n", spec, strerror(errno));
+    if (metricsListenFd >= 0)
+      close(metricsListenFd);
+    metricsListenFd = -1;
+    return false;
+  }
+  return true;
+}
+
+static int AppendMetric(char *buf, size_t size, int len, const char *name, const char *type,
+                        const char *help, double value) {
+  if (len < 0 || (size_t)len >= size)
+    return len;
+  return len + snprintf(buf + len, size - len, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n",
+                        name, help, name, type, name, value);
+}
+
+// Renders the Prometheus text exposition. Counters are read with relaxed
+// loads; gauges come from loop-thread state, which is where we run.
+int FormatMetrics(char *buf, size_t size) {
+  int len = 0;
+  len = AppendMetric(buf, size, len, "autocopy_triggers_total", "counter",
+                     "Click sequences that started a capture.", MetricGet(&metrics.triggers));
+  len = AppendMetric(buf, size, len, "autocopy_triggers_coalesced_total", "counter",
+                     "Triggers folded into a capture already in progress.", MetricGet(&metrics.coalesced));
+  len = AppendMetric(buf, size, len, "autocopy_injections_total", "counter",
+                     "Synthetic Ctrl+C key sequences sent.", MetricGet(&metrics.injections));
+  len = AppendMetric(buf, size, len, "autocopy_captures_total", "counter",
+                     "Clipboard texts captured.", MetricGet(&metrics.captures));
+  len = AppendMetric(buf, size, len, "autocopy_capture_bytes_total", "counter",
+                     "Bytes of captured clipboard text.", MetricGet(&metrics.captureBytes));
+  len = AppendMetric(buf, size, len, "autocopy_fetch_failures_total", "counter",
+                     "Clipboard fetches with no owner or no usable text.", MetricGet(&metrics.fetchFailures));
+  len = AppendMetric(buf, size, len, "autocopy_fetch_timeouts_total", "counter",
+                     "Clipboard fetches the owner never answered.", MetricGet(&metrics.fetchTimeouts));
+  len = AppendMetric(buf, size, len, "autocopy_capture_in_progress", "gauge",
+                     "1 while a capture is between trigger and fetch result.", captureState != CAPTURE_IDLE);
+  len = AppendMetric(buf, size, len, "autocopy_capture_queue_depth", "gauge",
+                     "Captures queued behind the one in progress.", capturePending);
+  len = AppendMetric(buf, size, len, "autocopy_owner_requests_total", "counter",
+                     "Selection requests served as clipboard owner.", MetricGet(&metrics.ownerRequests));
+  len = AppendMetric(buf, size, len, "autocopy_owner_refused_total", "counter",
+                     "Selection requests refused as clipboard owner.", MetricGet(&metrics.ownerRefused));
+  len = AppendMetric(buf, size, len, "autocopy_owner_bytes_total", "counter",
+                     "Bytes handed out as clipboard owner.", MetricGet(&metrics.ownerBytes));
+  len = AppendMetric(buf, size, len, "autocopy_log_writes_total", "counter",
+                     "Captures appended to the --log file.", MetricGet(&metrics.logWrites));
+  len = AppendMetric(buf, size, len, "autocopy_log_write_failures_total", "counter",
+                     "Captures that could not be appended to the --log file.", MetricGet(&metrics.logFailures));
+  len = AppendMetric(buf, size, len, "autocopy_log_write_seconds_total", "counter",
+                     "Time spent appending to the --log file.", MetricGet(&metrics.logWriteMicros) / 1e6);
+  len = AppendMetric(buf, size, len, "autocopy_log_write_lag_seconds", "gauge",
+                     "Duration of the most recent --log append.", MetricGet(&metrics.logLastMicros) / 1e6);
+  len = AppendMetric(buf, size, len, "autocopy_filter_dropped_total", "counter",
+                     "Captures dropped by a --filter rule.", MetricGet(&metrics.filterDropped));
+  len = AppendMetric(buf, size, len, "autocopy_filter_redacted_total", "counter",
+                     "Captures redacted or hashed by --filter rules.", MetricGet(&metrics.filterRedacted));
+  len = AppendMetric(buf, size, len, "autocopy_filter_seconds_total", "counter",
+                     "Time spent running --filter rules.", MetricGet(&metrics.filterMicros) / 1e6);
+  len = AppendMetric(buf, size, len, "autocopy_ring_subscribers_total", "counter",
+                     "Subscribers handed the broadcast ring.", MetricGet(&metrics.ringSubscribers));
+  len = AppendMetric(buf, size, len, "autocopy_daemon_sessions", "gauge",
+                     "Displays attached with --displays or --display-dir.", daemonSessionCount);
+  len = AppendMetric(buf, size, len, "autocopy_history_entries", "gauge",
+                     "Entries in the TUI history.", tuiLogCount);
+  len = AppendMetric(buf, size, len, "autocopy_history_resident_bytes", "gauge",
+                     "Memory held by the TUI history.", (double)tuiResidentBytes);
+  len = AppendMetric(buf, size, len, "autocopy_history_packed_entries", "gauge",
+                     "History entries held LZ4-compressed.", (double)tuiPackedCount);
+  len = AppendMetric(buf, size, len, "autocopy_history_evictions_total", "counter",
+                     "History entries evicted for --logbuffer or --maxmem.", tuiEvictedCount);
+  len = AppendMetric(buf, size, len, "autocopy_startup_seconds", "gauge",
+                     "Time from process start until capture was armed.", MetricGet(&metrics.startupMicros) / 1e6);
+  len = AppendMetric(buf, size, len, "autocopy_pool_misses_total", "counter",
+                     "Captures that fell back to the heap because every --pool buffer was in use.", MetricGet(&metrics.poolMisses));
+  len = AppendMetric(buf, size, len, "autocopy_offloaded_captures_total", "counter",
+                     "Captures post-processed on the --workers pool.", MetricGet(&metrics.offloaded));
+  len = AppendMetric(buf, size, len, "autocopy_offload_seconds_total", "counter",
+                     "Worker time spent post-processing offloaded captures.", MetricGet(&metrics.offloadMicros) / 1e6);
+  len = AppendMetric(buf, size, len, "autocopy_offload_pending", "gauge",
+                     "Captures waiting to be published in order.", postJobCount);
+  len = AppendMetric(buf, size, len, "autocopy_hook_records_total", "counter",
+                     "Captures an --on-capture helper answered with ok.", MetricGet(&metrics.hookRecords));
+  len = AppendMetric(buf, size, len, "autocopy_hook_failures_total", "counter",
+                     "--on-capture records answered with an error, and helpers that timed out or exited.",
+                     MetricGet(&metrics.hookFailures));
+  len = AppendMetric(buf, size, len, "autocopy_hook_dropped_total", "counter",
+                     "Captures not handed to --on-capture because every helper was full or had failed.",
+                     MetricGet(&metrics.hookDropped));
+  len = AppendMetric(buf, size, len, "autocopy_output_records_total", "counter",
+                     "Records written to the --output stream.", MetricGet(&metrics.outputRecords));
+  len = AppendMetric(buf, size, len, "autocopy_output_dropped_total", "counter",
+                     "Records dropped because the --output consumer lagged (--output-full drop).",
+                     MetricGet(&metrics.outputDropped));
+  len = AppendMetric(buf, size, len, "autocopy_output_buffered_bytes", "gauge",
+                     "Bytes of --output records not yet taken by the consumer.", (double)(outputEnd - outputStart));
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  len = AppendMetric(buf, size, len, "autocopy_peak_rss_bytes", "gauge",
+                     "Peak resident set size of the process.", (double)usage.ru_maxrss * 1024);
+#if defined(AUTOCOPY_COUNT_MALLOC)
+  len = AppendMetric(buf, size, len, "autocopy_malloc_calls_total", "counter",
+                     "Heap allocations made by the process (debug builds only).", (double)atomic_load(&mallocCalls));
+#endif
+  return len;
+}
+
+void CloseMetricsClient(MetricsClient *client) {
+  int fd = client->src.fd;
+  LoopRemove(&client->src);
+  close(fd);
+  client->length = 0;
+}
+
+// Reads the request until the blank line (or EOF for bare socket clients),
+// then answers with one response and closes.
+void HandleMetricsClient(LoopSource *src, uint32_t events) {
+  MetricsClient *client = (MetricsClient *)src;
+  ssize_t n;
+  bool eof = false;
+  while ((n = read(src->fd, client->request + client->length,
+                   sizeof(client->request) - 1 - client->length)) > 0) {
+    client->length += (size_t)n;
+    if (client->length == sizeof(client->request) - 1)
+      break;
+  }
+  if (n == 0 || (events & (EPOLLHUP | EPOLLERR)))
+    eof = true;
+  else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    CloseMetricsClient(client);
+    return;
+  }
+  client->request[client->length] = '\0';
+  if (!eof && !strstr(client->request, "\r\n\r\n") && !strstr(client->request, "\n\n") &&
+      client->length < sizeof(client->request) - 1)
+    return;
+
+  MetricAdd(&metrics.scrapes, 1);
+  static char body[8192];
+  int bodyLen = FormatMetrics(body, sizeof(body));
+  if (bodyLen < 0 || (size_t)bodyLen >= sizeof(body))
+    bodyLen = (int)strlen(body);
+
+  char header[160];
+  bool isGet = strncmp(client->request, "GET ", 4) == 0;
+  bool found = !isGet || strncmp(client->request, "GET /metrics", 12) == 0 ||
+               strncmp(client->request, "GET / ", 6) == 0;
+  int headerLen = snprintf(header, sizeof(header),
+                           "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %d\r\nConnection: close\r\n\r\n",
+                           found ? "200 OK" : "404 Not Found", found ? bodyLen : 0);
+  struct iovec iov[2] = {{header, (size_t)headerLen}, {body, found ? (size_t)bodyLen : 0}};
+  // Responses fit in the socket buffer; a client that does not drain it is dropped.
+  ssize_t written = writev(src->fd, iov, 2);
+  (void)written;
+  CloseMetricsClient(client);
+}
+
+void HandleMetricsAccept(LoopSource *src, uint32_t events) {
+  int fd;
+  while ((fd = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+    MetricsClient *client = NULL;
+    for (int i = 0; i < MAX_METRICS_CLIENTS && !client; i++) {
+      if (metricsClients[i].src.fd < 0)
+        client = &metricsClients[i];
+    }
+    if (!client) {
+      close(fd);
+      continue;
+    }
+    client->length = 0;
+    if (!LoopAdd(&client->src, fd, HandleMetricsClient, NULL)) {
+      client->src.fd = -1;
+      close(fd);
+    }
+  }
+}
+
+// Types Ctrl+key into whatever has the focus.
+void InjectCtrlKey(Display *display, KeySym key) {
+  // Get keycodes
+  KeyCode control = XKeysymToKeycode(display, XK_Control_L);
+  KeyCode c = XKeysymToKeycode(display, key);
+
+  // Press Ctrl
+  XTestFakeKeyEvent(display, control, True, CurrentTime);
+  // Press the key
+  XTestFakeKeyEvent(display, c, True, CurrentTime);
+  // Release the key
+  XTestFakeKeyEvent(display, c, False, CurrentTime);
+  // Release Ctrl
+  XTestFakeKeyEvent(display, control, False, CurrentTime);
+
+  XFlush(display);
+  MetricAdd(&metrics.injections, 1);
+  AUTOCOPY_PROBE1(inject, key);
+}
+
+void InjectCtrlC(Display *display) {
+  InjectCtrlKey(display, XK_c);
+}
+
+void send_ctrl_c() {
+  if (ctrl_display)
+    InjectCtrlC(ctrl_display);
+}
+
+bool ClipboardFetchInit() {
+  if (!fetchDisplay)
+    fetchDisplay = XOpenDisplay(NULL);
+  if (!fetchDisplay)
+    return false;
+
+  fetchWindow = XCreateSimpleWindow(fetchDisplay, DefaultRootWindow(fetchDisplay), 0, 0, 1, 1, 0, 0, 0);
+  XSelectInput(fetchDisplay, fetchWindow, PropertyChangeMask);
+
+  // All atoms in one round trip.
+  char *names[8 + 2 * MAX_EXTRA_TARGETS] = {"CLIPBOARD", "UTF8_STRING", "STRING", "PRIMARY",
+                                            "MULTIPLE", "ATOM_PAIR", "INCR", "AUTOCOPY_MULTIPLE"};
+  char propertyNames[MAX_EXTRA_TARGETS][32];
+  int count = 8;
+  for (int i = 0; i < extraTargetCount; i++) {
+    snprintf(propertyNames[i], sizeof(propertyNames[i]), "AUTOCOPY_TARGET_%d", i);
+    names[count++] = extraTargets[i].mime;
+    names[count++] = propertyNames[i];
+  }
+  Atom atoms[8 + 2 * MAX_EXTRA_TARGETS];
+  XInternAtoms(fetchDisplay, names, count, False, atoms);
+  fetchClipboardAtom = atoms[0];
+  fetchUtf8Atom = atoms[1];
+  fetchStringAtom = atoms[2];
+  fetchPrimaryAtom = atoms[3];
+  fetchMultipleAtom = atoms[4];
+  fetchAtomPairAtom = atoms[5];
+  fetchIncrAtom = atoms[6];
+  fetchPairsProperty = atoms[7];
+  for (int i = 0; i < extraTargetCount; i++) {
+    extraTargets[i].target = atoms[8 + 2 * i];
+    extraTargets[i].property = atoms[9 + 2 * i];
+  }
+  return true;
+}
+
+// SHA-256, used to name captured blobs by content.
+static const uint32_t sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define SHA_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void Sha256Block(Sha256 *ctx, const unsigned char *block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+           (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = SHA_ROR(w[i - 15], 7) ^ SHA_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = SHA_ROR(w[i - 2], 17) ^ SHA_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+  uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (SHA_ROR(e, 6) ^ SHA_ROR(e, 11) ^ SHA_ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+                  sha256K[i] + w[i];
+    uint32_t t2 = (SHA_ROR(a, 2) ^ SHA_ROR(a, 13) ^ SHA_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+  ctx->state[4] += e;
+  ctx->state[5] += f;
+  ctx->state[6] += g;
+  ctx->state[7] += h;
+}
+
+void Sha256Init(Sha256 *ctx) {
+  static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx->state, init, sizeof(init));
+  ctx->length = 0;
+}
+
+void Sha256Update(Sha256 *ctx, const unsigned char *data, size_t len) {
+  size_t used = (size_t)(ctx->length % 64);
+  ctx->length += len;
+  if (used) {
+    size_t take = 64 - used < len ? 64 - used : len;
+    memcpy(ctx->buffer + used, data, take);
+    data += take;
+    len -= take;
+    if (used + take < 64)
+      return;
+    Sha256Block(ctx, ctx->buffer);
+  }
+  for (; len >= 64; data += 64, len -= 64)
+    Sha256Block(ctx, data);
+  memcpy(ctx->buffer, data, len);
+}
+
+void Sha256HexDigest(Sha256 *ctx, char hex[65]) {
+  uint64_t bits = ctx->length * 8;
+  unsigned char pad[72] = {0x80};
+  size_t used = (size_t)(ctx->length % 64);
+  size_t padLen = (used < 56 ? 56 : 120) - used;
+  for (int i = 0; i < 8; i++)
+    pad[padLen + i] = (unsigned char)(bits >> (56 - 8 * i));
+  Sha256Update(ctx, pad, padLen + 8);
+  for (int i = 0; i < 8; i++)
+    snprintf(hex + i * 8, 9, "%08x", ctx->state[i]);
+}
+
+// Maps a --targets item to a MIME type ("html", "png" or a literal type).
+bool AddExtraTarget(const char *name) {
+  static const struct {
+    const char *alias;
+    const char *mime;
+    const char *extension;
+  } known[] = {{"html", "text/html", "html"}, {"png", "image/png", "png"},
+               {"jpeg", "image/jpeg", "jpg"}, {"rtf", "text/rtf", "rtf"}};
+  if (extraTargetCount == MAX_EXTRA_TARGETS)
+    return false;
+  ExtraTarget *t = &extraTargets[extraTargetCount];
+  memset(t, 0, sizeof(*t));
+  t->fd = -1;
+  t->extension = "bin";
+  for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+    if (strcmp(name, known[i].alias) == 0 || strcmp(name, known[i].mime) == 0) {
+      name = known[i].mime;
+      t->extension = known[i].extension;
+    }
+  }
+  if (!strchr(name, '/') || strlen(name) >= sizeof(t->mime))
+    return false;
+  strcpy(t->mime, name);
+  extraTargetCount++;
+  return true;
+}
+
+// mkdir -p
+bool MakeDirectories(const char *path) {
+  char buf[MAX_PATH];
+  snprintf(buf, sizeof(buf), "%s", path);
+  for (char *p = buf + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(buf, 0700) != 0 && errno != EEXIST)
+        return false;
+      *p = '/';
+    }
+  }
+  return mkdir(buf, 0700) == 0 || errno == EEXIST;
+}
+
+// Longest name added to the blob directory: "/<sha256>.<ext>" (extensions are
+// at most 4 bytes), which also covers "/.incoming-XXXXXX".
+#define BLOB_NAME_MAX (1 + 64 + 1 + 4)
+
+bool BlobDirInit() {
+  if (szBlobDir[0] == '\0') {
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache && cache[0])
+      snprintf(szBlobDir, sizeof(szBlobDir), "%s/autocopy/blobs", cache);
+    else if (home)
+      snprintf(szBlobDir, sizeof(szBlobDir), "%s/.cache/autocopy/blobs", home);
+    else
+      return false;
+  }
+  if (strlen(szBlobDir) + BLOB_NAME_MAX >= sizeof(szBlobDir)) {
+    fprintf(stderr, "Error: Blob directory path is too long: %s\n", szBlobDir);
+    return false;
+  }
+  if (!MakeDirectories(szBlobDir)) {
+    fprintf(stderr, "Error: Could not create blob directory %s: %s\n", szBlobDir, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static bool BlobBegin(ExtraTarget *t) {
+  int n = snprintf(t->path, sizeof(t->path), "%s/.incoming-XXXXXX", szBlobDir);
+  if (n < 0 || (size_t)n >= sizeof(t->path))
+    return false;
+  t->fd = mkostemp(t->path, O_CLOEXEC);
+  if (t->fd < 0)
+    return false;
+  Sha256Init(&t->sha);
+  t->size = 0;
+  t->incremental = false;
+  t->done = false;
+  return true;
+}
+
+static void BlobAbort(ExtraTarget *t) {
+  if (t->fd >= 0) {
+    close(t->fd);
+    unlink(t->path);
+    t->fd = -1;
+  }
+  t->incremental = false;
+}
+
+// Renames the finished file to <sha256>.<ext>; identical content captured
+// earlier is reused.
+static void BlobFinish(ExtraTarget *t) {
+  close(t->fd);
+  t->fd = -1;
+  t->incremental = false;
+  if (t->size == 0) {
+    unlink(t->path);
+    return;
+  }
+  char hex[65], final[MAX_PATH];
+  Sha256HexDigest(&t->sha, hex);
+  int n = snprintf(final, sizeof(final), "%s/%s.%s", szBlobDir, hex, t->extension);
+  if (n < 0 || (size_t)n >= sizeof(final)) {
+    unlink(t->path);
+    return;
+  }
+  if (access(final, F_OK) == 0)
+    unlink(t->path);
+  else if (rename(t->path, final) != 0) {
+    unlink(t->path);
+    return;
+  }
+  strcpy(t->path, final);
+  t->done = true;
+}
+
+// Appends a property to the blob in BLOB_SLICE_LONGS slices, so a large
+// value is never held in memory at once. The property is deleted once read,
+// which for INCR also asks the owner for the next chunk. Returns the bytes
+// appended, or -1 if the value was not 8-bit data or could not be written.
+static long long StreamPropertyToBlob(ExtraTarget *t, bool *isIncr) {
+  long long total = 0;
+  long offset = 0;
+  for (;;) {
+    Atom type;
+    int format;
+    unsigned long nitems, bytesAfter;
+    unsigned char *data = NULL;
+    if (XGetWindowProperty(fetchDisplay, fetchWindow, t->property, offset, BLOB_SLICE_LONGS, True,
+                           AnyPropertyType, &type, &format, &nitems, &bytesAfter, &data) != Success)
+      return -1;
+    if (type == fetchIncrAtom) {
+      if (data)
+        XFree(data);
+      if (isIncr)
+        *isIncr = true;
+      return 0;
+    }
+    bool ok = (type == None || format == 8);
+    if (ok && nitems > 0) {
+      ok = write(t->fd, data, nitems) == (ssize_t)nitems;
+      Sha256Update(&t->sha, data, nitems);
+      t->size += nitems;
+      total += (long long)nitems;
+      offset += (long)(nitems / 4);
+    }
+    if (data)
+      XFree(data);
+    if (!ok)
+      return -1;
+    if (bytesAfter == 0)
+      return total;
+  }
+}
+
+// Asks for UTF8_STRING plus every --targets type in one MULTIPLE request.
+bool StartMultipleFetch(Atom selection) {
+  Atom pairs[2 * (MAX_EXTRA_TARGETS + 1)];
+  int n = 0;
+  pairs[n++] = fetchUtf8Atom;
+  pairs[n++] = fetchUtf8Atom;
+  for (int i = 0; i < extraTargetCount; i++) {
+    pairs[n++] = extraTargets[i].target;
+    pairs[n++] = extraTargets[i].property;
+    extraTargets[i].done = false;
+  }
+  XChangeProperty(fetchDisplay, fetchWindow, fetchPairsProperty, fetchAtomPairAtom, 32,
+                  PropModeReplace, (unsigned char *)pairs, n);
+  XConvertSelection(fetchDisplay, selection, fetchMultipleAtom, fetchPairsProperty, fetchWindow, CurrentTime);
+  XFlush(fetchDisplay);
+  fetchSelection = selection;
+  fetchUsingMultiple = true;
+  return true;
+}
+
+// Reads the MULTIPLE reply: the text is returned, blobs are streamed to disk
+// (or left to PropertyNotify if the owner uses INCR). An owner that refuses
+// MULTIPLE is asked again for plain UTF8_STRING.
+char *ReadMultipleFetchResult(XSelectionEvent *se, bool *retried) {
+  *retried = false;
+  fetchUsingMultiple = false;
+  if (se->property == None) {
+    XConvertSelection(fetchDisplay, fetchSelection, fetchUtf8Atom, fetchUtf8Atom, fetchWindow, CurrentTime);
+    XFlush(fetchDisplay);
+    *retried = true;
+    return NULL;
+  }
+
+  Atom type;
+  int format;
+  unsigned long nitems, bytesAfter;
+  unsigned char *prop = NULL;
+  if (XGetWindowProperty(fetchDisplay, fetchWindow, fetchPairsProperty, 0, 2 * (MAX_EXTRA_TARGETS + 1),
+                         True, AnyPropertyType, &type, &format, &nitems, &bytesAfter,
+                         &prop) != Success || !prop)
+    return NULL;
+
+  char *text = NULL;
+  Atom *pairs = (Atom *)prop;
+  for (unsigned long i = 0; i + 1 < nitems; i += 2) {
+    if (pairs[i + 1] == None)
+      continue;  // owner could not convert this target
+    if (pairs[i] == fetchUtf8Atom) {
+      XSelectionEvent textEvent = *se;
+      textEvent.property = pairs[i + 1];
+      text = ReadClipboardFetchResult(&textEvent);
+      continue;
+    }
+    for (int t = 0; t < extraTargetCount; t++) {
+      ExtraTarget *target = &extraTargets[t];
+      if (target->target != pairs[i] || !BlobBegin(target))
+        continue;
+      bool incr = false;
+      long long n = StreamPropertyToBlob(target, &incr);
+      if (n < 0)
+        BlobAbort(target);
+      else if (incr)
+        target->incremental = true;
+      else
+        BlobFinish(target);
+    }
+  }
+  XFree(prop);
+  return text;
+}
+
+bool BlobTransfersActive() {
+  for (int i = 0; i < extraTargetCount; i++) {
+    if (extraTargets[i].incremental)
+      return true;
+  }
+  return false;
+}
+
+// One INCR chunk arrived; a zero-length chunk completes the blob.
+void HandleBlobChunk(XPropertyEvent *ev) {
+  for (int i = 0; i < extraTargetCount; i++) {
+    ExtraTarget *t = &extraTargets[i];
+    if (!t->incremental || ev->atom != t->property)
+      continue;
+    long long n = StreamPropertyToBlob(t, NULL);
+    if (n < 0)
+      BlobAbort(t);
+    else if (n == 0)
+      BlobFinish(t);
+  }
+}
+
+void AbortBlobTransfers() {
+  for (int i = 0; i < extraTargetCount; i++)
+    BlobAbort(&extraTargets[i]);
+}
+
+// Takes the next completed blob as a typed placeholder entry:
+// "[image/png, 1.2 MB] /path/<sha256>.png". NULL once none are left.
+char *TakeBlobPlaceholder() {
+  for (int i = 0; i < extraTargetCount; i++) {
+    ExtraTarget *t = &extraTargets[i];
+    if (!t->done)
+      continue;
+    t->done = false;
+    char size[32];
+    FormatBytes(size, sizeof(size), (size_t)t->size);
+    size_t len = strlen(t->mime) + strlen(size) + strlen(t->path) + 8;
+    char *placeholder = malloc(len);
+    if (!placeholder)
+      continue;
+    snprintf(placeholder, len, "[%s, %s] %s", t->mime, size, t->path);
+    return placeholder;
+  }
+  return NULL;
+}
+
+void PrintCapturedBlobs() {
+  char *placeholder;
+  while ((placeholder = TakeBlobPlaceholder()))
+    PrintCapture(placeholder, TUI_ENTRY_BLOB);
+}
+
+bool ParseBlobPlaceholder(const char *text, char *mime, size_t mimeSize, char *path, size_t pathSize) {
+  const char *comma = strchr(text, ',');
+  const char *close = strstr(text, "] ");
+  if (text[0] != '[' || !comma || !close || comma > close || (size_t)(comma - text - 1) >= mimeSize)
+    return false;
+  memcpy(mime, text + 1, comma - text - 1);
+  mime[comma - text - 1] = '\0';
+  snprintf(path, pathSize, "%s", close + 2);
+  return true;
+}
+
+// Serves a captured blob again as clipboard owner, under its original type.
+void CopyBlobToClipboard(const char *mime, const char *path) {
+  pthread_mutex_lock(&clipboardMutex);
+  FreeCaptureText(copyClipboardText);
+  copyClipboardText = NULL;
+  copyGatherCount = 0;
+  snprintf(copyBlobMime, sizeof(copyBlobMime), "%s", mime);
+  snprintf(copyBlobPath, sizeof(copyBlobPath), "%s", path);
+  clipboardOwnPending = true;
+  pthread_mutex_unlock(&clipboardMutex);
+
+  LoopWakeup();
+}
+
+// --separator: \n, \t and \\ are unescaped; anything else is taken as is.
+bool ParseSeparator(const char *arg) {
+  size_t n = 0;
+  for (const char *p = arg; *p; p++) {
+    char c = *p;
+    if (c == '\\' && p[1]) {
+      p++;
+      if (*p == 'n')
+        c = '\n';
+      else if (*p == 't')
+        c = '\t';
+      else if (*p != '\\')
+        return false;
+    }
+    if (n >= sizeof(szCopySeparator) - 1)
+      return false;
+    szCopySeparator[n++] = c;
+  }
+  szCopySeparator[n] = '\0';
+  copySeparatorLength = n;
+  return true;
+}
+
+static OwnerTransfer *FreeOwnerTransfer() {
+  for (int i = 0; i < MAX_OWNER_TRANSFERS; i++) {
+    if (ownerTransfers[i].fd < 0 && !ownerTransfers[i].gatherIds)
+      return &ownerTransfers[i];
+  }
+  return NULL;
+}
+
+static int IgnoreXError(Display *display, XErrorEvent *event) {
+  return 0;
+}
+
+// Frees a transfer slot. A requestor that is still there stops sending us
+// PropertyNotify; it may be destroyed at any moment, so the BadWindow that
+// would bring is ignored.
+static void EndOwnerTransfer(OwnerTransfer *transfer, bool requestorGone) {
+  if (!requestorGone) {
+    XErrorHandler previous = XSetErrorHandler(IgnoreXError);
+    XSelectInput(clipboardDisplay, transfer->requestor, NoEventMask);
+    XSync(clipboardDisplay, False);
+    XSetErrorHandler(previous);
+  }
+  if (transfer->fd >= 0)
+    close(transfer->fd);
+  transfer->fd = -1;
+  free(transfer->gatherIds);
+  transfer->gatherIds = NULL;
+  transfer->requestor = None;
+}
+
+// Arms srcOwnerTimer for the earliest transfer deadline, or disarms it.
+static void ArmOwnerTimer() {
+  uint64_t earliest = 0;
+  for (int i = 0; i < MAX_OWNER_TRANSFERS; i++) {
+    OwnerTransfer *transfer = &ownerTransfers[i];
+    if ((transfer->fd >= 0 || transfer->gatherIds) && (!earliest || transfer->deadline < earliest))
+      earliest = transfer->deadline;
+  }
+  if (srcOwnerTimer.fd < 0)
+    return;
+  uint64_t now = TraceNow();
+  ArmTimer(srcOwnerTimer.fd, !earliest ? 0 : earliest > now ? (int)((earliest - now + 999) / 1000) : 1);
+}
+
+static void StartOwnerTransfer(OwnerTransfer *transfer, XSelectionRequestEvent *req, long total) {
+  transfer->requestor = req->requestor;
+  transfer->property = req->property;
+  transfer->deadline = TraceNow() + OWNER_TRANSFER_TIMEOUT_MS * 1000ull;
+  XSelectInput(clipboardDisplay, req->requestor, PropertyChangeMask | StructureNotifyMask);
+  XChangeProperty(clipboardDisplay, req->requestor, req->property, ownerIncrAtom, 32,
+                  PropModeReplace, (unsigned char *)&total, 1);
+  AUTOCOPY_PROBE2(owner_serve, req->requestor, total);  // INCR: chunks follow
+  ArmOwnerTimer();
+}
+
+// Drops transfers whose requestor has not taken a chunk in time.
+void HandleOwnerTimer(LoopSource *src, uint32_t events) {
+  uint64_t expirations;
+  if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+  uint64_t now = TraceNow();
+  for (int i = 0; i < MAX_OWNER_TRANSFERS; i++) {
+    OwnerTransfer *transfer = &ownerTransfers[i];
+    if ((transfer->fd >= 0 || transfer->gatherIds) && transfer->deadline <= now)
+      EndOwnerTransfer(transfer, false);
+  }
+  ArmOwnerTimer();
+}
+
+// Small blobs go in one property; larger ones are sent with INCR, one
+// OWNER_CHUNK_SIZE read from the file each time the requestor deletes the
+// property. Called with clipboardMutex held.
+static bool ServeBlob(XSelectionRequestEvent *req) {
+  int fd = open(copyBlobPath, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  if (st.st_size <= OWNER_CHUNK_SIZE) {
+    static unsigned char buf[OWNER_CHUNK_SIZE];
+    ssize_t n = pread(fd, buf, (size_t)st.st_size, 0);
+    close(fd);
+    if (n != st.st_size)
+      return false;
+    XChangeProperty(clipboardDisplay, req->requestor, req->property, copyBlobAtom, 8,
+                    PropModeReplace, buf, (int)n);
+    MetricAdd(&metrics.ownerBytes, (unsigned long)n);
+    AUTOCOPY_PROBE2(owner_serve, req->requestor, n);
+    return true;
+  }
+
+  OwnerTransfer *transfer = FreeOwnerTransfer();
+  if (!transfer) {
+    close(fd);
+    return false;
+  }
+  transfer->fd = fd;
+  transfer->type = copyBlobAtom;
+  transfer->offset = 0;
+  StartOwnerTransfer(transfer, req, (long)st.st_size);
+  return true;
+}
+
+// Writes gathered entries from cursor on until limit bytes have gone out.
+// Without stage, the pieces go straight from the history into the property,
+// the first replacing it and the rest appended; that is only safe before
+// SelectionNotify, when nobody is reading yet. With stage (limit bytes), they
+// are copied there instead, so an INCR chunk can go out in one Replace.
+// Entries no longer in the history are skipped. Returns the bytes written.
+static size_t WriteGatherPieces(Window requestor, Atom property, const unsigned long long *ids, int count,
+                                GatherCursor *cursor, size_t limit, unsigned char *stage) {
+  int mode = PropModeReplace;
+  size_t written = 0;
+  while (cursor->next < count && written < limit) {
+    int index = FindTUIEntryById(ids[cursor->next]);
+    const char *text = index >= 0 ? TUIEntryText(&tuiLogBuffer[index]) : NULL;
+    size_t length = text ? tuiLogBuffer[index].length : 0;
+    if (cursor->offset >= length) {
+      cursor->next++;  // done, or gone
+      cursor->offset = 0;
+      cursor->separated = false;
+      continue;
+    }
+    if (cursor->offset == 0 && cursor->started && !cursor->separated && copySeparatorLength > 0) {
+      if (written + copySeparatorLength > limit)
+        break;
+      if (stage)
+        memcpy(stage + written, szCopySeparator, copySeparatorLength);
+      else
+        XChangeProperty(clipboardDisplay, requestor, property, ownerStringAtom, 8, mode,
+                        (const unsigned char *)szCopySeparator, (int)copySeparatorLength);
+      written += copySeparatorLength;
+      mode = PropModeAppend;
+      cursor->separated = true;
+      continue;
+    }
+    size_t n = length - cursor->offset;
+    if (n > limit - written)
+      n = limit - written;
+    if (stage)
+      memcpy(stage + written, text + cursor->offset, n);
+    else
+      XChangeProperty(clipboardDisplay, requestor, property, ownerStringAtom, 8, mode,
+                      (const unsigned char *)text + cursor->offset, (int)n);
+    written += n;
+    mode = PropModeAppend;
+    cursor->offset += n;
+    cursor->started = true;
+  }
+  return written;
+}
+
+// Answers with the gathered entries. Up to OWNER_CHUNK_SIZE goes in one
+// property; more is sent with INCR, a chunk of entries per PropertyDelete,
+// from a copy of the ids so a newer copy does not change it midway. Runs on
+// the loop thread, which also owns the history. Called with clipboardMutex
+// held.
+static bool ServeGather(XSelectionRequestEvent *req) {
+  size_t total = 0;
+  int present = 0;
+  for (int i = 0; i < copyGatherCount; i++) {
+    int index = FindTUIEntryById(copyGatherIds[i]);
+    if (index < 0)
+      continue;
+    total += (present++ ? copySeparatorLength : 0) + tuiLogBuffer[index].length;
+  }
+  if (present == 0)
+    return false;  // every entry is gone
+
+  if (total <= OWNER_CHUNK_SIZE) {
+    GatherCursor cursor = {0};
+    size_t n = WriteGatherPieces(req->requestor, req->property, copyGatherIds, copyGatherCount, &cursor, SIZE_MAX, NULL);
+    if (n == 0)
+      return false;
+    MetricAdd(&metrics.ownerBytes, n);
+    AUTOCOPY_PROBE2(owner_serve, req->requestor, n);
+    return true;
+  }
+
+  OwnerTransfer *transfer = FreeOwnerTransfer();
+  unsigned long long *ids = transfer ? malloc(sizeof(ids[0]) * (size_t)copyGatherCount) : NULL;
+  if (!ids)
+    return false;
+  memcpy(ids, copyGatherIds, sizeof(ids[0]) * (size_t)copyGatherCount);
+  transfer->gatherIds = ids;
+  transfer->gatherCount = copyGatherCount;
+  transfer->gather = (GatherCursor){0};
+  transfer->type = ownerStringAtom;
+  StartOwnerTransfer(transfer, req, (long)total);
+  return true;
+}
+
+// The requestor deleted the property: send the next chunk with a single
+// Replace (the requestor reads on every PropertyNewValue), or a zero-length
+// property once everything has gone out.
+static void ContinueOwnerTransfer(XPropertyEvent *ev) {
+  static unsigned char buf[OWNER_CHUNK_SIZE];
+  for (int i = 0; i < MAX_OWNER_TRANSFERS; i++) {
+    OwnerTransfer *transfer = &ownerTransfers[i];
+    if ((transfer->fd < 0 && !transfer->gatherIds) || transfer->requestor != ev->window ||
+        transfer->property != ev->atom)
+      continue;
+    ssize_t n;
+    if (transfer->gatherIds) {
+      n = (ssize_t)WriteGatherPieces(transfer->requestor, transfer->property, transfer->gatherIds,
+                                     transfer->gatherCount, &transfer->gather, sizeof(buf), buf);
+    } else {
+      n = pread(transfer->fd, buf, sizeof(buf), transfer->offset);
+      if (n < 0)
+        n = 0;
+      transfer->offset += n;
+    }
+    XChangeProperty(clipboardDisplay, transfer->requestor, transfer->property, transfer->type, 8,
+                    PropModeReplace, buf, (int)n);
+    MetricAdd(&metrics.ownerBytes, (unsigned long)n);
+    transfer->deadline = TraceNow() + OWNER_TRANSFER_TIMEOUT_MS * 1000ull;
+    if (n == 0)
+      EndOwnerTransfer(transfer, false);
+    XFlush(clipboardDisplay);
+  }
+  ArmOwnerTimer();
+}
+
+// The requestor went away mid-transfer: nobody will delete the property again.
+static void DropOwnerTransfers(Window requestor) {
+  for (int i = 0; i < MAX_OWNER_TRANSFERS; i++) {
+    OwnerTransfer *transfer = &ownerTransfers[i];
+    if ((transfer->fd >= 0 || transfer->gatherIds) && transfer->requestor == requestor)
+      EndOwnerTransfer(transfer, true);
+  }
+  ArmOwnerTimer();
+}
+
+// Asks the CLIPBOARD owner for UTF8_STRING; the answer arrives as SelectionNotify.
+bool StartSelectionFetch(Atom selection) {
+  if (!fetchDisplay)
+    return false;
+
+  Window owner = XGetSelectionOwner(fetchDisplay, selection);
+  if (owner == None)
+    return false;
+  fetchOwner = owner;
+  AUTOCOPY_PROBE1(fetch_start, traceCaptureId);
+  if (extraTargetCount > 0)
+    return StartMultipleFetch(selection);
+
+  XConvertSelection(fetchDisplay, selection, fetchUtf8Atom, fetchUtf8Atom, fetchWindow, CurrentTime);
+  XFlush(fetchDisplay);
+  return true;
+}
+
+bool StartClipboardFetch() {
+  return StartSelectionFetch(fetchClipboardAtom);
+}
+
+bool MonitorInit() {
+  int errorBase;
+  if (!XFixesQueryExtension(fetchDisplay, &fixesEventBase, &errorBase)) {
+    fprintf(stderr, "Error: The X server does not support XFixes, needed for --monitor.\n");
+    return false;
+  }
+  Window root = DefaultRootWindow(fetchDisplay);
+  XFixesSelectSelectionInput(fetchDisplay, root, fetchClipboardAtom, XFixesSetSelectionOwnerNotifyMask);
+  if (bMonitorPrimary)
+    XFixesSelectSelectionInput(fetchDisplay, root, fetchPrimaryAtom, XFixesSetSelectionOwnerNotifyMask);
+  XSync(fetchDisplay, False);  // selected once this returns, for NotifyReady
+  return true;
+}
+
+static uint64_t HashText(const char *text) {
+  uint64_t hash = 1469598103934665603ull;
+  for (const unsigned char *p = (const unsigned char *)text; *p; p++)
+    hash = (hash ^ *p) * 1099511628211ull;
+  return hash;
+}
+
+// A new owner took a watched selection. Fetching waits until notifications
+// stop for MONITOR_DEBOUNCE_MS, so owners that re-assert ownership in bursts
+// cost one fetch, but never longer than MONITOR_DEBOUNCE_MAX_MS.
+void OnSelectionOwnerChanged(XFixesSelectionNotifyEvent *ev) {
+  if (ev->owner == None || ev->owner == clipboardWindow)
+    return;  // cleared, or our own Ctrl+Enter copy
+  monitorPending |= (ev->selection == fetchPrimaryAtom) ? MONITOR_PRIMARY : MONITOR_CLIPBOARD;
+
+  if (captureState == CAPTURE_DEBOUNCE) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long waited = (now.tv_sec - monitorDebounceStart.tv_sec) * 1000 +
+                  (now.tv_nsec - monitorDebounceStart.tv_nsec) / 1000000;
+    if (waited + MONITOR_DEBOUNCE_MS <= MONITOR_DEBOUNCE_MAX_MS)
+      ArmTimer(srcCaptureTimer.fd, MONITOR_DEBOUNCE_MS);
+    MetricAdd(&metrics.coalesced, 1);
+    return;
+  }
+  OnCaptureTrigger();
+}
+
+#if defined(AUTOCOPY_COUNT_MALLOC)
+// Debug builds (-DAUTOCOPY_COUNT_MALLOC) count every allocation in the
+// process, Xlib's included, by wrapping glibc's allocator entry points.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  atomic_fetch_add_explicit(&mallocCalls, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  atomic_fetch_add_explicit(&mallocCalls, 1, memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  atomic_fetch_add_explicit(&mallocCalls, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+bool CapturePoolInit(int count) {
+  if (count > MAX_CAPTURE_POOL)
+    count = MAX_CAPTURE_POOL;
+  capturePool = mmap(NULL, (size_t)count * CAPTURE_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (capturePool == MAP_FAILED) {
+    capturePool = NULL;
+    fprintf(stderr, "Error: Could not reserve the capture pool: %s\n", strerror(errno));
+    return false;
+  }
+  capturePoolSize = count;
+  atomic_store(&capturePoolFree, count == 64 ? ~0UL : (1UL << count) - 1);
+  return true;
+}
+
+// A pool buffer when one is free and large enough, otherwise the heap.
+char *CaptureBufferAlloc(size_t size) {
+  if (capturePool && size <= CAPTURE_BUFFER_SIZE) {
+    unsigned long bits = atomic_load(&capturePoolFree);
+    while (bits) {
+      int slot = __builtin_ctzl(bits);
+      if (atomic_compare_exchange_weak(&capturePoolFree, &bits, bits & ~(1UL << slot)))
+        return capturePool + (size_t)slot * CAPTURE_BUFFER_SIZE;
+    }
+    MetricAdd(&metrics.poolMisses, 1);
+  }
+  return malloc(size);
+}
+
+// Releases capture text from CaptureBufferAlloc, ReadSelectionText or strdup.
+void FreeCaptureText(char *text) {
+  if (capturePool && text >= capturePool && text < capturePool + (size_t)capturePoolSize * CAPTURE_BUFFER_SIZE) {
+    size_t slot = (size_t)(text - capturePool) / CAPTURE_BUFFER_SIZE;
+    atomic_fetch_or(&capturePoolFree, 1UL << slot);
+  } else {
+    free(text);
+  }
+}
+
+// GetProperty straight into buf (at most size - 1 bytes of 8-bit data), for
+// --pool: XGetWindowProperty would malloc the value. Returns the length, or
+// -1 when there is no 8-bit value. GetReq and SyncHandle need it named dpy.
+static long ReadPropertyInto(Display *dpy, Window window, Atom property, char *buf, size_t size) {
+  xGetPropertyReply reply;
+  xGetPropertyReq *req;
+  long length = -1;
+
+  LockDisplay(dpy);
+  GetReq(GetProperty, req);
+  req->window = window;
+  req->property = property;
+  req->type = AnyPropertyType;
+  req->delete = False;
+  req->longOffset = 0;
+  req->longLength = (CARD32)((size - 1) / 4);
+  if (_XReply(dpy, (xReply *)&reply, 0, xFalse)) {
+    if (reply.propertyType != None && reply.format == 8 && reply.nItems < size) {
+      _XReadPad(dpy, buf, (long)reply.nItems);
+      buf[reply.nItems] = '\0';
+      length = (long)reply.nItems;
+    } else if (reply.length) {
+      _XEatDataWords(dpy, reply.length);
+    }
+  }
+  UnlockDisplay(dpy);
+  SyncHandle();
+  return length;
+}
+
+// Reads and deletes the text a selection owner stored on window.
+char *ReadSelectionText(Display *display, Window window, Atom property) {
+  char *result = NULL;
+  if (property == None)
+    return NULL;
+
+  if (capturePool) {
+    result = CaptureBufferAlloc(CAPTURE_BUFFER_SIZE);
+    if (result && ReadPropertyInto(display, window, property, result, CAPTURE_BUFFER_SIZE) <= 0) {
+      FreeCaptureText(result);
+      result = NULL;
+    }
+    XDeleteProperty(display, window, property);
+    return result;
+  }
+
+  Atom type;
+  int format;
+  unsigned long nitems, bytes_after;
+  unsigned char *prop;
+
+  if (XGetWindowProperty(display, window, property,
+                         0, (1024 * 1024) / 4, False, AnyPropertyType,
+                         &type, &format, &nitems, &bytes_after, &prop) == Success) {
+    if (prop && nitems > 0 && format == 8)  // STRING, UTF8_STRING and friends
+      result = strdup((char *)prop);
+    if (prop)
+      XFree(prop);
+    XDeleteProperty(display, window, property);
+  }
+  return result;
+}
+
+char *ReadClipboardFetchResult(XSelectionEvent *se) {
+  return ReadSelectionText(fetchDisplay, fetchWindow, se->property);
+}
+
+// Blocking variant for callers outside the event loop: waits on the
+// connection's fd instead of sleeping between polls.
+char *GetClipboardText() {
+  if (!StartClipboardFetch())
+    return NULL;
+
+  struct pollfd pfd = {ConnectionNumber(fetchDisplay), POLLIN, 0};
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int remaining = FETCH_TIMEOUT_MS;
+
+  while (remaining > 0) {
+    XEvent event;
+    while (XPending(fetchDisplay)) {
+      XNextEvent(fetchDisplay, &event);
+      if (event.type == SelectionNotify)
+        return ReadClipboardFetchResult(&event.xselection);
+    }
+    poll(&pfd, 1, remaining);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining = FETCH_TIMEOUT_MS - (int)((now.tv_sec - start.tv_sec) * 1000 +
+                                         (now.tv_nsec - start.tv_nsec) / 1000000);
+  }
+  return NULL;
+}
+
+// Length of the leading run of bytes NormalizeText copies unchanged: anything
+// but CR, LF and non-ASCII.
+static size_t NormalizeRunLength(const unsigned char *s, size_t len) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)), v);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i cr16 = _mm_set1_epi8('\r'), lf16 = _mm_set1_epi8('\n');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr16), _mm_cmpeq_epi8(v, lf16)), v);
+    unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+#else
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, sizeof(word));
+    // High bit set, or a zero byte after XOR with CR/LF.
+    uint64_t cr = word ^ 0x0d0d0d0d0d0d0d0dULL, lf = word ^ 0x0a0a0a0a0a0a0a0aULL;
+    if ((word | ((cr - 0x0101010101010101ULL) & ~cr) | ((lf - 0x0101010101010101ULL) & ~lf)) &
+        0x8080808080808080ULL)
+      break;
+  }
+#endif
+  while (i < len && s[i] != '\r' && s[i] != '\n' && s[i] < 0x80)
+    i++;
+  return i;
+}
+
+// Bytes a UTF-8 sequence at s is replaced by under NORMALIZE_SPACES: 1 for a
+// space, 0 to drop it, -1 to keep it. *seqLen gets its length.
+static int NormalizeSpaceSequence(const unsigned char *s, size_t len, size_t *seqLen) {
+  if (len >= 2 && s[0] == 0xC2 && (s[1] == 0xA0 || s[1] == 0xAD)) {
+    *seqLen = 2;
+    return s[1] == 0xA0 ? 1 : 0;  // NBSP, soft hyphen
+  }
+  if (len >= 3 && s[0] == 0xE2 && s[1] == 0x80) {
+    *seqLen = 3;
+    if (s[2] <= 0x8A || s[2] == 0xAF)
+      return 1;  // U+2000..U+200A, narrow NBSP
+    if (s[2] >= 0x8B && s[2] <= 0x8D)
+      return 0;  // zero-width space, non-joiner, joiner
+  }
+  if (len >= 3 && ((s[0] == 0xE2 && s[1] == 0x81 && s[2] == 0x9F) || (s[0] == 0xE3 && s[1] == 0x80 && s[2] == 0x80))) {
+    *seqLen = 3;
+    return 1;  // medium math space, ideographic space
+  }
+  if (len >= 3 && s[0] == 0xEF && s[1] == 0xBB && s[2] == 0xBF) {
+    *seqLen = 3;
+    return 0;  // BOM / zero-width no-break space
+  }
+  *seqLen = 1;
+  return -1;
+}
+
+// Whether a line starting at s continues the previous one for
+// NORMALIZE_UNWRAP: not blank, not indented, not a list item or quote.
+static bool ContinuesParagraph(const unsigned char *s, size_t len) {
+  if (len == 0 || s[0] == '\n' || s[0] == '\r' || s[0] == ' ' || s[0] == '\t')
+    return false;
+  if (strchr("-*>#|", s[0]) || (len >= 3 && s[0] == 0xE2 && s[1] == 0x80 && s[2] == 0xA2))
+    return false;  // bullets, quotes, headings, tables
+  size_t digits = 0;
+  while (digits < len && s[digits] >= '0' && s[digits] <= '9')
+    digits++;
+  return !(digits > 0 && digits < len && (s[digits] == '.' || s[digits] == ')'));
+}
+
+// Rewrites text in place according to normalizeFlags and returns whether
+// anything changed. The output is never longer than the input, so nothing
+// is allocated; unchanged runs are skipped 16/32 bytes at a time.
+bool NormalizeText(char *text, size_t len) {
+  unsigned char *s = (unsigned char *)text;
+  size_t r = 0, w = 0, lineStart = 0;
+  bool replaced = false;
+
+  if (normalizeFlags & NORMALIZE_TRIM) {
+    // Drop leading blank lines, keeping the first line's indentation.
+    for (size_t i = 0; i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n'); i++) {
+      if (s[i] == '\n')
+        r = i + 1;
+    }
+  }
+
+  while (r < len) {
+    size_t run = NormalizeRunLength(s + r, len - r);
+    if (w != r)
+      memmove(s + w, s + r, run);
+    w += run;
+    r += run;
+    if (r >= len)
+      break;
+
+    unsigned char c = s[r];
+    if (c == '\r' && (normalizeFlags & NORMALIZE_EOL)) {
+      if (r + 1 < len && s[r + 1] == '\n') {
+        r++;  // the LF is handled next
+        continue;
+      }
+      c = '\n';
+      replaced = true;
+    }
+    if (c == '\n') {
+      if (normalizeFlags & (NORMALIZE_TRIM | NORMALIZE_UNWRAP)) {
+        while (w > 0 && (s[w - 1] == ' ' || s[w - 1] == '\t'))
+          w--;
+      }
+      r++;
+      // Indented lines (code, verse) keep their breaks on both sides.
+      if ((normalizeFlags & NORMALIZE_UNWRAP) && w > lineStart && s[lineStart] != ' ' &&
+          s[lineStart] != '\t' && ContinuesParagraph(s + r, len - r)) {
+        s[w++] = ' ';
+        replaced = true;
+      } else {
+        s[w++] = '\n';
+        lineStart = w;
+      }
+      continue;
+    }
+    if (c >= 0x80 && (normalizeFlags & NORMALIZE_SPACES)) {
+      size_t seqLen;
+      int replacement = NormalizeSpaceSequence(s + r, len - r, &seqLen);
+      if (replacement >= 0) {
+        if (replacement)
+          s[w++] = ' ';
+        r += seqLen;
+        continue;
+      }
+    }
+    s[w++] = s[r++];
+  }
+
+  if (normalizeFlags & NORMALIZE_TRIM) {
+    while (w > 0 && (s[w - 1] == ' ' || s[w - 1] == '\t' || s[w - 1] == '\n' || s[w - 1] == '\r'))
+      w--;
+  }
+  s[w] = '\0';
+  return replaced || w != len;
+}
+
+// Parses a --normalize list such as "trim,eol,unwrap" or "all".
+bool ParseNormalizeList(const char *list) {
+  char buf[128];
+  strncpy(buf, list, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  for (char *item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+    if (strcmp(item, "trim") == 0)
+      normalizeFlags |= NORMALIZE_TRIM;
+    else if (strcmp(item, "eol") == 0)
+      normalizeFlags |= NORMALIZE_EOL;
+    else if (strcmp(item, "spaces") == 0)
+      normalizeFlags |= NORMALIZE_SPACES;
+    else if (strcmp(item, "unwrap") == 0)
+      normalizeFlags |= NORMALIZE_UNWRAP;
+    else if (strcmp(item, "all") == 0)
+      normalizeFlags |= NORMALIZE_TRIM | NORMALIZE_EOL | NORMALIZE_SPACES | NORMALIZE_UNWRAP;
+    else
+      return false;
+  }
+  return true;
+}
+
+// Ends the fetch: publishes the text and any blobs that completed.
+void DeliverFetchResult(char *text) {
+#if defined(AUTOCOPY_COUNT_MALLOC)
+  unsigned long mallocStart = captureMallocStart;  // FinishCapture may start the next one
+#endif
+  bool blobs = false;
+  for (int i = 0; i < extraTargetCount; i++)
+    blobs |= extraTargets[i].done;
+  if (!text && !blobs)
+    MetricAdd(&metrics.fetchFailures, 1);
+  size_t length = text ? strlen(text) : 0;
+  AUTOCOPY_PROBE2(fetch_end, traceCaptureId, length);
+  if ((text || blobs) && PostJobQueue(text, length)) {
+    FinishCapture();
+    PostPublishReady();
+    return;
+  }
+  bool normalized = false;
+  if (normalizeFlags && text) {
+    uint64_t start = TraceBegin();
+    normalized = NormalizeText(text, length);
+    TraceSpan("normalize", start, traceCaptureId);
+  }
+  if (bMonitor && text) {
+    // Owners often re-assert ownership of unchanged content.
+    uint64_t hash = HashText(text);
+    if (hash == monitorLastHash[monitorFetching]) {
+      FreeCaptureText(text);
+      text = NULL;
+      for (int i = 0; i < extraTargetCount; i++)
+        extraTargets[i].done = false;
+    }
+    monitorLastHash[monitorFetching] = hash;
+  }
+  // Paste targets get the cleaned text too. Only for CLIPBOARD: re-owning
+  // it for a PRIMARY capture would overwrite an unrelated copy.
+  if (bNormalizeCopy && normalized && text && fetchSelection == fetchClipboardAtom)
+    CopyToClipboard(text);
+  Window owner = fetchOwner;
+  FinishCapture();
+  publishWindow = owner;
+  PrintClipboardText(text);
+  PrintCapturedBlobs();
+#if defined(AUTOCOPY_COUNT_MALLOC)
+  // With --pool, a warmed-up capture must not touch the heap. The TUI
+  // history keeps its own copies, so it is exempt.
+  unsigned long allocations = atomic_load(&mallocCalls) - mallocStart;
+  if (capturePool && !bTUI && nCaptureId > POOL_WARMUP_CAPTURES && allocations > 0) {
+    fprintf(stderr, "autocopy: capture %llu made %lu heap allocations with --pool\n", nCaptureId, allocations);
+    abort();
+  }
+#endif
+}
+
+void HandleFetchEvents(LoopSource *src, uint32_t events) {
+  XEvent event;
+  while (XPending(fetchDisplay)) {
+    XNextEvent(fetchDisplay, &event);
+    if (event.type == SelectionNotify && captureState == CAPTURE_FETCHING && !BlobTransfersActive()) {
+      TraceSpan("selection_wait", traceStepStart, traceCaptureId);
+      uint64_t readStart = TraceBegin();
+      char *text;
+      if (fetchUsingMultiple) {
+        bool retried;
+        text = ReadMultipleFetchResult(&event.xselection, &retried);
+        if (retried) {
+          traceStepStart = TraceBegin();
+          ArmTimer(srcCaptureTimer.fd, FETCH_TIMEOUT_MS);
+          continue;
+        }
+      } else {
+        text = ReadClipboardFetchResult(&event.xselection);
+      }
+      TraceSpan("property_read", readStart, traceCaptureId);
+      if (BlobTransfersActive()) {
+        fetchPendingText = text;
+        traceStepStart = TraceBegin();
+        ArmTimer(srcCaptureTimer.fd, FETCH_TIMEOUT_MS);
+        continue;
+      }
+      DeliverFetchResult(text);
+    } else if (event.type == PropertyNotify && event.xproperty.state == PropertyNewValue &&
+               captureState == CAPTURE_FETCHING && BlobTransfersActive()) {
+      HandleBlobChunk(&event.xproperty);
+      if (BlobTransfersActive()) {
+        // Each chunk pushes the deadline out; only a stalled owner times out.
+        ArmTimer(srcCaptureTimer.fd, FETCH_TIMEOUT_MS);
+        continue;
+      }
+      TraceSpan("blob_stream", traceStepStart, traceCaptureId);
+      char *text = fetchPendingText;
+      fetchPendingText = NULL;
+      DeliverFetchResult(text);
+    } else if (bMonitor && event.type == fixesEventBase + XFixesSelectionNotify) {
+      OnSelectionOwnerChanged((XFixesSelectionNotifyEvent *)&event);
+    }
+  }
+}
+
+// Takes CLIPBOARD ownership for text set by CopyToClipboard. Called from any
+// thread; the X side runs on the loop thread.
+void CopyToClipboard(const char *text) {
+  if (!text)
+    return;
+
+  size_t len = strlen(text);
+  char *copy = CaptureBufferAlloc(len + 1);
+  if (copy)
+    memcpy(copy, text, len + 1);
+  pthread_mutex_lock(&clipboardMutex);
+  FreeCaptureText(copyClipboardText);
+  copyClipboardText = copy;
+  copyBlobPath[0] = '\0';
+  copyGatherCount = 0;
+  clipboardOwnPending = true;
+  pthread_mutex_unlock(&clipboardMutex);
+
+  LoopWakeup();
+}
+
+// Takes CLIPBOARD ownership for history entries by capture id. Only the ids
+// are stored; requests are served from the entries (ServeGather). Callers
+// pass at most MAX_COPY_GATHER ids; RecopyTUIMarks reports any it left out.
+void CopyEntriesToClipboard(const unsigned long long *ids, int count) {
+  if (count <= 0)
+    return;
+  if (count > MAX_COPY_GATHER)
+    count = MAX_COPY_GATHER;
+  pthread_mutex_lock(&clipboardMutex);
+  FreeCaptureText(copyClipboardText);
+  copyClipboardText = NULL;
+  copyBlobPath[0] = '\0';
+  memcpy(copyGatherIds, ids, (size_t)count * sizeof(ids[0]));
+  copyGatherCount = count;
+  clipboardOwnPending = true;
+  pthread_mutex_unlock(&clipboardMutex);
+
+  LoopWakeup();
+}
+
+bool ClipboardOwnerInit() {
+  if (!clipboardDisplay)
+    clipboardDisplay = XOpenDisplay(NULL);
+  if (!clipboardDisplay)
+    return false;
+
+  clipboardWindow = XCreateSimpleWindow(clipboardDisplay, DefaultRootWindow(clipboardDisplay),
+                                        0, 0, 10, 10, 0, 0, 0);
+  XSelectInput(clipboardDisplay, clipboardWindow, PropertyChangeMask);
+
+  // One round trip for the atoms; its reply also means the window exists.
+  char *names[] = {"UTF8_STRING", "STRING", "TARGETS", "ATOM", "CLIPBOARD", "INCR"};
+  Atom atoms[6];
+  XInternAtoms(clipboardDisplay, names, 6, False, atoms);
+  ownerUtf8Atom = atoms[0];
+  ownerStringAtom = atoms[1];
+  ownerTargetsAtom = atoms[2];
+  ownerAtomAtom = atoms[3];
+  ownerClipboardAtom = atoms[4];
+  ownerIncrAtom = atoms[5];
+  return true;
+}
+
+void ClaimClipboardOwnership() {
+  pthread_mutex_lock(&clipboardMutex);
+  bool pending = clipboardOwnPending;
+  clipboardOwnPending = false;
+  char mime[sizeof(copyBlobMime)] = {0};
+  if (copyBlobPath[0] != '\0')
+    memcpy(mime, copyBlobMime, sizeof(mime));
+  pthread_mutex_unlock(&clipboardMutex);
+
+  if (!pending || !clipboardDisplay)
+    return;
+  if (mime[0] != '\0')
+    copyBlobAtom = XInternAtom(clipboardDisplay, mime, False);
+
+  XSetSelectionOwner(clipboardDisplay, ownerClipboardAtom, clipboardWindow, CurrentTime);
+  XFlush(clipboardDisplay);
+}
+
+void HandleOwnerEvents(LoopSource *src, uint32_t events) {
+  XEvent event;
+  while (XPending(clipboardDisplay)) {
+    XNextEvent(clipboardDisplay, &event);
+    if (event.type == PropertyNotify && event.xproperty.state == PropertyDelete) {
+      ContinueOwnerTransfer(&event.xproperty);
+      continue;
+    }
+    if (event.type == DestroyNotify) {
+      DropOwnerTransfers(event.xdestroywindow.window);
+      continue;
+    }
+    if (event.type != SelectionRequest)
+      continue;
+
+    XSelectionRequestEvent *req = (XSelectionRequestEvent *)&event;
+    XEvent response;
+    response.xselection.type = SelectionNotify;
+    response.xselection.requestor = req->requestor;
+    response.xselection.selection = req->selection;
+    response.xselection.target = req->target;
+    response.xselection.time = req->time;
+
+    pthread_mutex_lock(&clipboardMutex);
+    bool blob = copyBlobPath[0] != '\0';
+    if (req->target == ownerTargetsAtom) {
+      Atom supported_targets[] = {ownerUtf8Atom, ownerStringAtom};
+      if (blob)
+        supported_targets[0] = copyBlobAtom;
+      XChangeProperty(clipboardDisplay, req->requestor, req->property,
+                      ownerAtomAtom, 32, PropModeReplace,
+                      (unsigned char *)supported_targets, blob ? 1 : 2);
+      response.xselection.property = req->property;
+      MetricAdd(&metrics.ownerRequests, 1);
+    } else if (blob && req->target == copyBlobAtom) {
+      bool served = ServeBlob(req);
+      response.xselection.property = served ? req->property : None;
+      MetricAdd(served ? &metrics.ownerRequests : &metrics.ownerRefused, 1);
+    } else if ((req->target == ownerUtf8Atom || req->target == ownerStringAtom) && copyGatherCount > 0) {
+      bool served = ServeGather(req);
+      response.xselection.property = served ? req->property : None;
+      MetricAdd(served ? &metrics.ownerRequests : &metrics.ownerRefused, 1);
+    } else if (req->target == ownerUtf8Atom || req->target == ownerStringAtom) {
+      if (copyClipboardText) {
+        size_t len = strlen(copyClipboardText);
+        XChangeProperty(clipboardDisplay, req->requestor, req->property,
+                        ownerStringAtom, 8, PropModeReplace,
+                        (unsigned char *)copyClipboardText, len);
+        response.xselection.property = req->property;
+        MetricAdd(&metrics.ownerRequests, 1);
+        MetricAdd(&metrics.ownerBytes, len);
+        AUTOCOPY_PROBE2(owner_serve, req->requestor, len);
+      } else {
+        response.xselection.property = None;
+        MetricAdd(&metrics.ownerRefused, 1);
+      }
+    } else {
+      response.xselection.property = None;
+      MetricAdd(&metrics.ownerRefused, 1);
+    }
+    pthread_mutex_unlock(&clipboardMutex);
+
+    XSendEvent(clipboardDisplay, req->requestor, False, 0, &response);
+    XFlush(clipboardDisplay);
+  }
+}
+
+// Capture filters (--filter). Regex rules are compiled once into DFAs over
+// byte classes; a literal the pattern cannot match without lets most rules
+// skip a capture after one SIMD scan.
+typedef struct {
+  const char *p;
+  const char *error;
+  bool icase;
+  RegexNode *nodes;
+  int nodeCount, nodeCapacity;
+  uint8_t (*sets)[32];
+  int setCount, setCapacity;
+} RegexParser;
+
+// Both return -1 with rp->error set when out of memory.
+static int RegexNewNode(RegexParser *rp, int type, int a, int b) {
+  if (rp->nodeCount == rp->nodeCapacity) {
+    int capacity = rp->nodeCapacity ? rp->nodeCapacity * 2 : 64;
+    RegexNode *nodes = realloc(rp->nodes, sizeof(RegexNode) * capacity);
+    if (!nodes) {
+      rp->error = "out of memory";
+      return -1;
+    }
+    rp->nodes = nodes;
+    rp->nodeCapacity = capacity;
+  }
+  rp->nodes[rp->nodeCount] = (RegexNode){type, a, b};
+  return rp->nodeCount++;
+}
+
+static int RegexNewSet(RegexParser *rp) {
+  if (rp->setCount == rp->setCapacity) {
+    int capacity = rp->setCapacity ? rp->setCapacity * 2 : 32;
+    uint8_t(*sets)[32] = realloc(rp->sets, 32 * capacity);
+    if (!sets) {
+      rp->error = "out of memory";
+      return -1;
+    }
+    rp->sets = sets;
+    rp->setCapacity = capacity;
+  }
+  memset(rp->sets[rp->setCount], 0, 32);
+  return rp->setCount++;
+}
+
+static void SetAdd(uint8_t *set, int c, bool icase) {
+  set[c >> 3] |= (uint8_t)(1 << (c & 7));
+  if (icase && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+    c ^= 0x20;
+    set[c >> 3] |= (uint8_t)(1 << (c & 7));
+  }
+}
+
+static bool SetHas(const uint8_t *set, int c) {
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+// \d \w \s and their negations; returns false for other escapes.
+static bool AddClassEscape(uint8_t *set, char e) {
+  uint8_t tmp[32] = {0};
+  char lower = (char)(e | 0x20);
+  for (int c = 0; c < 256; c++) {
+    bool in = (lower == 'd') ? (c >= '0' && c <= '9')
+            : (lower == 'w') ? (c == '_' || (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'))
+            : (lower == 's') ? (c == ' ' || (c >= '\t' && c <= '\r'))
+            : false;
+    if (lower != 'd' && lower != 'w' && lower != 's')
+      return false;
+    if (in != (e != lower))
+      SetAdd(tmp, c, false);
+  }
+  for (int i = 0; i < 32; i++)
+    set[i] |= tmp[i];
+  return true;
+}
+
+static int ParseEscapedByte(RegexParser *rp) {
+  char e = *rp->p++;
+  switch (e) {
+  case 'n': return '\n';
+  case 't': return '\t';
+  case 'r': return '\r';
+  case 'x':
+    if (isxdigit((unsigned char)rp->p[0]) && isxdigit((unsigned char)rp->p[1])) {
+      char hex[3] = {rp->p[0], rp->p[1], 0};
+      rp->p += 2;
+      return (int)strtol(hex, NULL, 16);
+    }
+    rp->error = "bad \\x escape";
+    return 0;
+  case '\0':
+    rp->error = "trailing backslash";
+    return 0;
+  default:
+    if (isalnum((unsigned char)e)) {
+      rp->error = "unsupported escape";
+      return 0;
+    }
+    return (unsigned char)e;
+  }
+}
+
+static int RegexParseAlt(RegexParser *rp);
+
+static int RegexParseClass(RegexParser *rp) {
+  int set = RegexNewSet(rp);
+  if (set < 0)
+    return -1;
+  bool negate = (*rp->p == '^');
+  if (negate)
+    rp->p++;
+  bool first = true;
+  while (*rp->p && (*rp->p != ']' || first)) {
+    first = false;
+    int lo;
+    if (*rp->p == '\\') {
+      rp->p++;
+      if (AddClassEscape(rp->sets[set], *rp->p)) {
+        rp->p++;
+        continue;
+      }
+      lo = ParseEscapedByte(rp);
+    } else {
+      lo = (unsigned char)*rp->p++;
+    }
+    int hi = lo;
+    if (rp->p[0] == '-' && rp->p[1] && rp->p[1] != ']') {
+      rp->p++;
+      hi = (*rp->p == '\\') ? (rp->p++, ParseEscapedByte(rp)) : (unsigned char)*rp->p++;
+      if (hi < lo)
+        rp->error = "bad range";
+    }
+    for (int c = lo; c <= hi; c++)
+      SetAdd(rp->sets[set], c, rp->icase);
+  }
+  if (*rp->p != ']') {
+    rp->error = "missing ]";
+    return -1;
+  }
+  rp->p++;
+  if (negate) {
+    for (int i = 0; i < 32; i++)
+      rp->sets[set][i] = (uint8_t)~rp->sets[set][i];
+  }
+  return RegexNewNode(rp, RX_SET, set, 0);
+}
+
+static int RegexParseAtom(RegexParser *rp) {
+  char c = *rp->p++;
+  if (c == '(') {
+    if (rp->p[0] == '?' && rp->p[1] == ':')
+      rp->p += 2;
+    int inner = RegexParseAlt(rp);
+    if (inner < 0)
+      return -1;
+    if (*rp->p != ')') {
+      rp->error = "missing )";
+      return -1;
+    }
+    rp->p++;
+    return inner;
+  }
+  if (c == '[')
+    return RegexParseClass(rp);
+  if (c == '^' || c == '$') {
+    rp->error = "anchors are not supported";
+    return -1;
+  }
+  if (c == '*' || c == '+' || c == '?' || c == '{') {
+    rp->error = "nothing to repeat";
+    return -1;
+  }
+  int set = RegexNewSet(rp);
+  if (set < 0)
+    return -1;
+  if (c == '.') {
+    for (int b = 0; b < 256; b++) {
+      if (b != '\n')
+        SetAdd(rp->sets[set], b, false);
+    }
+  } else if (c == '\\') {
+    if (AddClassEscape(rp->sets[set], *rp->p))
+      rp->p++;
+    else
+      SetAdd(rp->sets[set], ParseEscapedByte(rp), rp->icase);
+  } else {
+    SetAdd(rp->sets[set], (unsigned char)c, rp->icase);
+  }
+  return RegexNewNode(rp, RX_SET, set, 0);
+}
+
+// x{n,m} becomes n copies of x followed by m-n optional copies. Nodes are
+// immutable, so the copies can share the subtree.
+static int RegexRepeat(RegexParser *rp, int atom, int min, int max) {
+  int node = -1;
+  for (int i = 0; i < min; i++)
+    node = (node < 0) ? atom : RegexNewNode(rp, RX_CAT, node, atom);
+  if (max < 0) {
+    int star = RegexNewNode(rp, RX_STAR, atom, 0);
+    node = (node < 0) ? star : RegexNewNode(rp, RX_CAT, node, star);
+  }
+  for (int i = min; i < max; i++) {
+    int quest = RegexNewNode(rp, RX_QUEST, atom, 0);
+    node = (node < 0) ? quest : RegexNewNode(rp, RX_CAT, node, quest);
+  }
+  return node < 0 ? RegexNewNode(rp, RX_EMPTY, 0, 0) : node;
+}
+
+static int RegexParseRepeat(RegexParser *rp) {
+  int atom = RegexParseAtom(rp);
+  while (atom >= 0 && !rp->error) {
+    char c = *rp->p;
+    if (c == '*' || c == '+' || c == '?') {
+      rp->p++;
+      atom = RegexNewNode(rp, c == '*' ? RX_STAR : c == '+' ? RX_PLUS : RX_QUEST, atom, 0);
+    } else if (c == '{') {
+      char *end;
+      long min = strtol(rp->p + 1, &end, 10), max = min;
+      if (end == rp->p + 1) {
+        rp->error = "bad {n,m}";
+        return -1;
+      }
+      if (*end == ',') {
+        max = (end[1] == '}') ? -1 : strtol(end + 1, &end, 10);
+        if (max == -1)
+          end++;
+      }
+      if (*end != '}' || min > FILTER_MAX_REPEAT || max > FILTER_MAX_REPEAT || (max >= 0 && max < min)) {
+        rp->error = "bad {n,m}";
+        return -1;
+      }
+      rp->p = end + 1;
+      atom = RegexRepeat(rp, atom, (int)min, (int)max);
+    } else {
+      break;
+    }
+    if (*rp->p == '?') {
+      rp->error = "lazy quantifiers are not supported";
+      return -1;
+    }
+  }
+  return atom;
+}
+
+static int RegexParseCat(RegexParser *rp) {
+  int node = -1;
+  while (*rp->p && *rp->p != '|' && *rp->p != ')' && !rp->error) {
+    int atom = RegexParseRepeat(rp);
+    if (atom < 0)
+      return -1;
+    node = (node < 0) ? atom : RegexNewNode(rp, RX_CAT, node, atom);
+  }
+  return node < 0 ? RegexNewNode(rp, RX_EMPTY, 0, 0) : node;
+}
+
+static int RegexParseAlt(RegexParser *rp) {
+  int node = RegexParseCat(rp);
+  while (node >= 0 && *rp->p == '|' && !rp->error) {
+    rp->p++;
+    int right = RegexParseCat(rp);
+    if (right < 0)
+      return -1;
+    node = RegexNewNode(rp, RX_ALT, node, right);
+  }
+  return node;
+}
+
+// Thompson construction. reverse builds the automaton for the mirrored
+// pattern, used to find where a match starts once its end is known.
+typedef struct {
+  int type;  // NFA_SET, NFA_SPLIT, NFA_EPS, NFA_MATCH
+  int set;
+  int out, out1;
+} NfaState;
+
+typedef struct {
+  NfaState *states;
+  int count, capacity;
+} Nfa;
+
+enum { NFA_SET, NFA_SPLIT, NFA_EPS, NFA_MATCH };
+
+// Returns -1 when out of memory.
+static int NfaAdd(Nfa *nfa, int type, int set, int out, int out1) {
+  if (nfa->count == nfa->capacity) {
+    int capacity = nfa->capacity ? nfa->capacity * 2 : 64;
+    NfaState *states = realloc(nfa->states, sizeof(NfaState) * capacity);
+    if (!states)
+      return -1;
+    nfa->states = states;
+    nfa->capacity = capacity;
+  }
+  nfa->states[nfa->count] = (NfaState){type, set, out, out1};
+  return nfa->count++;
+}
+
+// Returns the fragment's start, or -1 when out of memory; *end is an NFA_EPS
+// state whose out is unset.
+static int NfaBuild(Nfa *nfa, const RegexNode *nodes, int n, bool reverse, int *end) {
+  const RegexNode *node = &nodes[n];
+  int s1, e1, s2, e2, e;
+  switch (node->type) {
+  case RX_SET:
+    *end = NfaAdd(nfa, NFA_EPS, 0, -1, -1);
+    return *end < 0 ? -1 : NfaAdd(nfa, NFA_SET, node->a, *end, -1);
+  case RX_CAT:
+    s1 = NfaBuild(nfa, nodes, reverse ? node->b : node->a, reverse, &e1);
+    s2 = s1 < 0 ? -1 : NfaBuild(nfa, nodes, reverse ? node->a : node->b, reverse, &e2);
+    if (s2 < 0)
+      return -1;
+    nfa->states[e1].out = s2;
+    *end = e2;
+    return s1;
+  case RX_ALT:
+    s1 = NfaBuild(nfa, nodes, node->a, reverse, &e1);
+    s2 = s1 < 0 ? -1 : NfaBuild(nfa, nodes, node->b, reverse, &e2);
+    e = s2 < 0 ? -1 : NfaAdd(nfa, NFA_EPS, 0, -1, -1);
+    if (e < 0)
+      return -1;
+    nfa->states[e1].out = e;
+    nfa->states[e2].out = e;
+    *end = e;
+    return NfaAdd(nfa, NFA_SPLIT, 0, s1, s2);
+  case RX_STAR:
+  case RX_PLUS:
+  case RX_QUEST:
+    s1 = NfaBuild(nfa, nodes, node->a, reverse, &e1);
+    e = s1 < 0 ? -1 : NfaAdd(nfa, NFA_EPS, 0, -1, -1);
+    s2 = e < 0 ? -1 : NfaAdd(nfa, NFA_SPLIT, 0, s1, e);
+    if (s2 < 0)
+      return -1;
+    nfa->states[e1].out = (node->type == RX_QUEST) ? e : s2;
+    *end = e;
+    return (node->type == RX_PLUS) ? s1 : s2;
+  default:
+    *end = NfaAdd(nfa, NFA_EPS, 0, -1, -1);
+    return *end;
+  }
+}
+
+// Adds the epsilon closure of state to list (SET and MATCH states only).
+// stack has room for twice the NFA's states.
+static void NfaClosure(const Nfa *nfa, int state, int *list, int *count, int *mark, int generation,
+                       int *stack) {
+  int top = 0;
+  stack[top++] = state;
+  while (top > 0) {
+    int s = stack[--top];
+    if (s < 0 || mark[s] == generation)
+      continue;
+    mark[s] = generation;
+    const NfaState *st = &nfa->states[s];
+    if (st->type == NFA_SET || st->type == NFA_MATCH) {
+      list[(*count)++] = s;
+      continue;
+    }
+    if (st->type == NFA_SPLIT)
+      stack[top++] = st->out1;
+    stack[top++] = st->out;
+  }
+}
+
+// The whole pattern followed by NFA_MATCH; returns the start or -1.
+static int NfaBuildMatch(Nfa *nfa, const RegexNode *nodes, int root, bool reverse) {
+  int end;
+  int start = NfaBuild(nfa, nodes, root, reverse, &end);
+  int match = start < 0 ? -1 : NfaAdd(nfa, NFA_MATCH, 0, -1, -1);
+  if (match < 0)
+    return -1;
+  nfa->states[end].out = match;
+  return start;
+}
+
+static int CompareInts(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+static void DfaFree(Dfa *dfa) {
+  free(dfa->next);
+  free(dfa->accept);
+  dfa->next = NULL;
+  dfa->accept = NULL;
+  dfa->stateCount = 0;
+}
+
+// Subset construction. With unanchored set, the start closure is merged into
+// every state, which makes the DFA find matches beginning anywhere. Returns
+// NULL or an error; nothing stays allocated on failure.
+static const char *DfaBuild(Dfa *dfa, const Nfa *nfa, int start, const uint8_t (*sets)[32],
+                     const unsigned char *byteClass, int classCount, bool unanchored) {
+  int *mark = calloc(nfa->count, sizeof(int));
+  int generation = 0;
+  int **members = NULL;  // sorted NFA state list per DFA state
+  int *memberCount = NULL;
+  int capacity = 0;
+  int representative[256];
+  for (int c = 255; c >= 0; c--)
+    representative[byteClass[c]] = c;
+
+  dfa->classCount = classCount;
+  dfa->stateCount = 0;
+  dfa->next = NULL;
+  dfa->accept = NULL;
+
+  int *list = malloc(sizeof(int) * (nfa->count + 1));
+  int count = 0;
+  int *startList = malloc(sizeof(int) * (nfa->count + 1));
+  int startCount = 0;
+  int *stack = malloc(sizeof(int) * (nfa->count * 2 + 1));
+  const char *error = (mark && list && startList && stack) ? NULL : "out of memory";
+  if (!error) {
+    NfaClosure(nfa, start, startList, &startCount, mark, ++generation, stack);
+    qsort(startList, startCount, sizeof(int), CompareInts);
+  }
+
+  for (int d = -1; d < dfa->stateCount && !error; d++) {
+    for (int cls = 0; cls < (d < 0 ? 1 : classCount); cls++) {
+      count = 0;
+      generation++;
+      if (d < 0) {
+        memcpy(list, startList, sizeof(int) * startCount);
+        count = startCount;
+      } else {
+        for (int i = 0; i < memberCount[d]; i++) {
+          const NfaState *st = &nfa->states[members[d][i]];
+          if (st->type == NFA_SET && SetHas(sets[st->set], representative[cls]))
+            NfaClosure(nfa, st->out, list, &count, mark, generation, stack);
+        }
+        if (unanchored) {
+          for (int i = 0; i < startCount; i++) {
+            if (mark[startList[i]] != generation) {
+              mark[startList[i]] = generation;
+              list[count++] = startList[i];
+            }
+          }
+        }
+        qsort(list, count, sizeof(int), CompareInts);
+      }
+
+      int target = -1;
+      if (count > 0) {
+        for (int s = 0; s < dfa->stateCount; s++) {
+          if (memberCount[s] == count && memcmp(members[s], list, sizeof(int) * count) == 0) {
+            target = s;
+            break;
+          }
+        }
+        if (target < 0) {
+          if (dfa->stateCount == FILTER_MAX_DFA_STATES) {
+            error = "pattern too complex";
+            break;
+          }
+          if (dfa->stateCount == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            int **moreMembers = realloc(members, sizeof(int *) * capacity);
+            if (moreMembers)
+              members = moreMembers;
+            int *moreCounts = realloc(memberCount, sizeof(int) * capacity);
+            if (moreCounts)
+              memberCount = moreCounts;
+            int32_t *moreNext = realloc(dfa->next, sizeof(int32_t) * capacity * classCount);
+            if (moreNext)
+              dfa->next = moreNext;
+            unsigned char *moreAccept = realloc(dfa->accept, capacity);
+            if (moreAccept)
+              dfa->accept = moreAccept;
+            if (!moreMembers || !moreCounts || !moreNext || !moreAccept) {
+              error = "out of memory";
+              break;
+            }
+          }
+          int *stateMembers = malloc(sizeof(int) * (count ? count : 1));
+          if (!stateMembers) {
+            error = "out of memory";
+            break;
+          }
+          target = dfa->stateCount++;
+          members[target] = stateMembers;
+          memcpy(members[target], list, sizeof(int) * count);
+          memberCount[target] = count;
+          dfa->accept[target] = 0;
+          for (int i = 0; i < count; i++) {
+            if (nfa->states[list[i]].type == NFA_MATCH)
+              dfa->accept[target] = 1;
+          }
+        }
+      }
+      if (d >= 0)
+        dfa->next[d * classCount + cls] = (target < 0) ? -1 : target * classCount;
+    }
+  }
+
+  // Spread accept out to the premultiplied state numbers the matcher uses.
+  unsigned char *accept = !error ? calloc((size_t)(dfa->stateCount ? dfa->stateCount : 1) * classCount, 1) : NULL;
+  if (accept) {
+    for (int s = 0; s < dfa->stateCount; s++)
+      accept[s * classCount] = dfa->accept[s];
+  }
+  free(dfa->accept);
+  dfa->accept = accept;
+
+  for (int s = 0; s < dfa->stateCount; s++)
+    free(members[s]);
+  free(members);
+  free(memberCount);
+  free(list);
+  free(startList);
+  free(stack);
+  free(mark);
+  if (!accept) {
+    DfaFree(dfa);
+    return error ? error : "out of memory";
+  }
+  return NULL;
+}
+
+// Longest run of single-byte nodes on the pattern's top-level concatenation:
+// every match contains it.
+static void RegexRequiredLiteral(const RegexParser *rp, int root, char *out, size_t outSize, bool *fold) {
+  int stack[FILTER_MAX_REPEAT * 4 + 64], top = 0, order[FILTER_MAX_REPEAT * 4 + 64], count = 0;
+  stack[top++] = root;
+  while (top > 0 && count < (int)(sizeof(order) / sizeof(order[0]))) {
+    int n = stack[--top];
+    if (rp->nodes[n].type == RX_CAT && top + 2 <= (int)(sizeof(stack) / sizeof(stack[0]))) {
+      stack[top++] = rp->nodes[n].b;
+      stack[top++] = rp->nodes[n].a;
+    } else {
+      order[count++] = n;
+    }
+  }
+  size_t best = 0, run = 0;
+  char current[FILTER_MAX_LITERAL];
+  out[0] = '\0';
+  *fold = rp->icase;
+  for (int i = 0; i <= count; i++) {
+    int byte = -1;
+    if (i < count && rp->nodes[order[i]].type == RX_SET) {
+      const uint8_t *set = rp->sets[rp->nodes[order[i]].a];
+      for (int c = 0; c < 256; c++) {
+        if (!SetHas(set, c))
+          continue;
+        if (byte < 0) {
+          byte = c;
+        } else if (rp->icase && c == (byte | 0x20) && isupper(byte)) {
+          byte = c;  // (?i) letter pair: keep the lowercase byte
+        } else {
+          byte = 256;  // more than one byte
+          break;
+        }
+      }
+    }
+    if (byte >= 0 && byte < 256 && run + 1 < sizeof(current)) {
+      current[run++] = (char)byte;
+      continue;
+    }
+    if (run > best && run < outSize) {
+      memcpy(out, current, run);
+      out[run] = '\0';
+      best = run;
+    }
+    run = 0;
+  }
+}
+
+static const char *CompileRegexRule(FilterRule *rule, const char *pattern) {
+  RegexParser rp = {pattern, NULL, false, NULL, 0, 0, NULL, 0, 0};
+  if (strncmp(rp.p, "(?i)", 4) == 0) {
+    rp.icase = true;
+    rp.p += 4;
+  }
+  int root = RegexParseAlt(&rp);
+  if (!rp.error && *rp.p)
+    rp.error = "unbalanced )";
+  const char *error = rp.error;
+
+  if (!error) {
+    // Byte classes: bytes no set tells apart share one DFA column.
+    memset(rule->byteClass, 0, sizeof(rule->byteClass));
+    int classCount = 1;
+    for (int s = 0; s < rp.setCount; s++) {
+      int remap[512];
+      memset(remap, -1, sizeof(remap));
+      int next = 0;
+      for (int c = 0; c < 256; c++) {
+        int key = rule->byteClass[c] * 2 + (SetHas(rp.sets[s], c) ? 1 : 0);
+        if (remap[key] < 0)
+          remap[key] = next++;
+        rule->byteClass[c] = (unsigned char)remap[key];
+      }
+      classCount = next;
+    }
+
+    Nfa forward = {0}, backward = {0};
+    int fs = NfaBuildMatch(&forward, rp.nodes, root, false);
+    int bs = fs < 0 ? -1 : NfaBuildMatch(&backward, rp.nodes, root, true);
+
+    const uint8_t(*sets)[32] = (const uint8_t(*)[32])rp.sets;
+    if (bs < 0)
+      error = "out of memory";
+    if (!error)
+      error = DfaBuild(&rule->search, &forward, fs, sets, rule->byteClass, classCount, true);
+    if (!error)
+      error = DfaBuild(&rule->forward, &forward, fs, sets, rule->byteClass, classCount, false);
+    if (!error)
+      error = DfaBuild(&rule->reverse, &backward, bs, sets, rule->byteClass, classCount, false);
+    if (!error && rule->forward.accept[0])
+      error = "pattern matches empty text";
+    if (error) {
+      DfaFree(&rule->search);
+      DfaFree(&rule->forward);
+      DfaFree(&rule->reverse);
+    }
+    free(forward.states);
+    free(backward.states);
+
+    if (!error) {
+      char literal[FILTER_MAX_LITERAL];
+      RegexRequiredLiteral(&rp, root, literal, sizeof(literal), &rule->literalFold);
+      rule->literalLength = strlen(literal);
+      rule->literal = rule->literalLength ? strdup(literal) : NULL;
+    }
+  }
+  free(rp.nodes);
+  free(rp.sets);
+  return error;
+}
+
+// SIMD substring search: candidate positions are where both the first and
+// the last needle byte match, checked 32/16 bytes at a time. With fold, the
+// needle is lowercase and letters match either case.
+const char *FindLiteral(const char *hay, size_t len, const char *needle, size_t m, bool fold) {
+  if (m == 0 || m > len)
+    return m == 0 ? hay : NULL;
+  if (!fold && m == 1)
+    return memchr(hay, needle[0], len);
+  char firstMask = isalpha((unsigned char)needle[0]) && fold ? 0x20 : 0;
+  char lastMask = isalpha((unsigned char)needle[m - 1]) && fold ? 0x20 : 0;
+  (void)lastMask;  // unused without SSE2
+  size_t i = 0;
+#if defined(__AVX2__)
+  __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[m - 1]);
+  __m256i firstOr = _mm256_set1_epi8(firstMask), lastOr = _mm256_set1_epi8(lastMask);
+  for (; i + m - 1 + 32 <= len; i += 32) {
+    __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i)), firstOr);
+    __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i + m - 1)), lastOr);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (m <= 2 || (fold ? strncasecmp(hay + at + 1, needle + 1, m - 2) : memcmp(hay + at + 1, needle + 1, m - 2)) == 0)
+        return hay + at;
+      mask &= mask - 1;
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i first16 = _mm_set1_epi8(needle[0]), last16 = _mm_set1_epi8(needle[m - 1]);
+  __m128i firstOr16 = _mm_set1_epi8(firstMask), lastOr16 = _mm_set1_epi8(lastMask);
+  for (; i + m - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i)), firstOr16);
+    __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i + m - 1)), lastOr16);
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first16), _mm_cmpeq_epi8(b, last16)));
+    while (mask) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (m <= 2 || (fold ? strncasecmp(hay + at + 1, needle + 1, m - 2) : memcmp(hay + at + 1, needle + 1, m - 2)) == 0)
+        return hay + at;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  if (!fold)
+    return i < len ? memmem(hay + i, len - i, needle, m) : NULL;
+  for (; i + m <= len; i++) {
+    if (((hay[i] | firstMask) == needle[0]) && strncasecmp(hay + i, needle, m) == 0)
+      return hay + i;
+  }
+  return NULL;
+}
+
+// Parses one "<drop|redact|hash> <regex|literal|entropy> <argument>" line.
+static const char *ParseFilterRule(FilterRule *rule, char *line) {
+  char *action = strtok(line, " \t");
+  char *kind = strtok(NULL, " \t");
+  char *arg = strtok(NULL, "");
+  while (arg && (*arg == ' ' || *arg == '\t'))
+    arg++;
+  if (!action || !kind || !arg || !*arg)
+    return "expected: <drop|redact|hash> <regex|literal|entropy> <argument>";
+
+  memset(rule, 0, sizeof(*rule));
+  if (strcmp(action, "drop") == 0)
+    rule->action = FILTER_DROP;
+  else if (strcmp(action, "redact") == 0)
+    rule->action = FILTER_REDACT;
+  else if (strcmp(action, "hash") == 0)
+    rule->action = FILTER_HASH;
+  else
+    return "unknown action";
+
+  if (strcmp(kind, "regex") == 0) {
+    rule->kind = FILTER_REGEX;
+    return CompileRegexRule(rule, arg);
+  }
+  if (strcmp(kind, "literal") == 0) {
+    rule->kind = FILTER_LITERAL;
+    rule->literal = strdup(arg);
+    rule->literalLength = strlen(arg);
+    return rule->literal ? NULL : "out of memory";
+  }
+  if (strcmp(kind, "entropy") == 0) {
+    rule->kind = FILTER_ENTROPY;
+    rule->minLength = 20;
+    if (sscanf(arg, "%lf %d", &rule->minEntropy, &rule->minLength) < 1 || rule->minEntropy <= 0 ||
+        rule->minLength < 8)
+      return "expected: entropy <bits-per-char> [min-length >= 8]";
+    return NULL;
+  }
+  return "unknown rule type";
+}
+
+bool LoadFilterRules(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Error: Could not open filter file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  for (int c = 0; c < 256; c++) {
+    filterTokenBytes[c] = (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ||
+                    (c != 0 && strchr("+/=_-", c));
+  }
+  char line[1024];
+  int lineNumber = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f)) {
+    lineNumber++;
+    line[strcspn(line, "\r\n")] = '\0';
+    char *p = line;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '\0' || *p == '#')
+      continue;
+    FilterRule *rules = realloc(filterRules, sizeof(FilterRule) * (filterRuleCount + 1));
+    const char *error = "out of memory";
+    if (rules) {
+      filterRules = rules;
+      error = ParseFilterRule(&filterRules[filterRuleCount], p);
+    }
+    if (error) {
+      fprintf(stderr, "Error: %s:%d: %s\n", path, lineNumber, error);
+      ok = false;
+    } else {
+      filterRuleCount++;
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+// A span that cannot be recorded sets filterSpanLost, and the capture is
+// dropped rather than published with that part left in.
+static void AddFilterSpan(size_t start, size_t end, FilterAction action) {
+  if (filterSpanCount == filterSpanCapacity) {
+    int capacity = filterSpanCapacity ? filterSpanCapacity * 2 : 16;
+    FilterSpan *spans = realloc(filterSpans, sizeof(FilterSpan) * capacity);
+    if (!spans) {
+      filterSpanLost = true;
+      return;
+    }
+    filterSpans = spans;
+    filterSpanCapacity = capacity;
+  }
+  filterSpans[filterSpanCount++] = (FilterSpan){start, end, action};
+}
+
+// End of the longest match starting exactly at at, or 0 when none does
+// (matches are never empty, so a real end is always past at).
+static size_t RegexLongestFrom(const FilterRule *rule, const unsigned char *text, size_t len, size_t at) {
+  const unsigned char *cls = rule->byteClass;
+  size_t end = 0;
+  int32_t s = 0;
+  for (size_t i = at; i < len; i++) {
+    s = rule->forward.next[s + cls[text[i]]];
+    if (s < 0)
+      break;
+    if (rule->forward.accept[s])
+      end = i + 1;
+  }
+  return end;
+}
+
+// Finds all leftmost-longest, non-overlapping matches. The search DFA gives
+// the earliest end and the reverse DFA the leftmost start of a match ending
+// there. A match starting further left may still end later (abcd|bc on
+// "abcd"), so the positions before that start are tried with the anchored
+// forward DFA; the first that matches is the leftmost start, and its longest
+// end closes the span.
+static bool MatchRegexRule(const FilterRule *rule, const unsigned char *text, size_t len, bool firstOnly) {
+  const unsigned char *cls = rule->byteClass;
+  bool found = false;
+  size_t from = 0;
+  while (from < len) {
+    const int32_t *next = rule->search.next;
+    const unsigned char *accept = rule->search.accept;
+    int32_t s = 0;
+    size_t end = SIZE_MAX;
+    for (size_t i = from; i < len; i++) {
+      s = next[s + cls[text[i]]];
+      if (accept[s]) {
+        end = i + 1;
+        break;
+      }
+    }
+    if (end == SIZE_MAX)
+      break;
+    found = true;
+    if (firstOnly)
+      break;
+
+    size_t start = end;
+    s = 0;
+    for (size_t i = end; i > from; i--) {
+      s = rule->reverse.next[s + cls[text[i - 1]]];
+      if (s < 0)
+        break;
+      if (rule->reverse.accept[s])
+        start = i - 1;
+    }
+    size_t longest = 0;
+    for (size_t at = from; at < start && !longest; at++) {
+      if (rule->forward.next[cls[text[at]]] >= 0 && (longest = RegexLongestFrom(rule, text, len, at)))
+        start = at;
+    }
+    end = longest ? longest : RegexLongestFrom(rule, text, len, start);
+    AddFilterSpan(start, end, rule->action);
+    from = end;
+  }
+  return found;
+}
+
+
+// log2 without pulling in libm: integer part by halving, then one
+// fraction bit per squaring.
+static double Log2(double x) {
+  int exponent = 0;
+  while (x >= 2) {
+    x /= 2;
+    exponent++;
+  }
+  while (x < 1) {
+    x *= 2;
+    exponent--;
+  }
+  double result = exponent, bit = 0.5;
+  for (int i = 0; i < 24; i++, bit /= 2) {
+    x *= x;
+    if (x >= 2) {
+      x /= 2;
+      result += bit;
+    }
+  }
+  return result;
+}
+
+// Tokens (base64/hex/URL-safe runs) at least minLength long whose Shannon
+// entropy per byte reaches minEntropy look like keys and passwords.
+static bool MatchEntropyRule(const FilterRule *rule, const unsigned char *text, size_t len, bool firstOnly) {
+  bool found = false;
+  uint32_t counts[256];
+  size_t i = 0;
+  while (i < len) {
+    while (i < len && !filterTokenBytes[text[i]])
+      i++;
+    size_t start = i;
+    while (i < len && filterTokenBytes[text[i]])
+      i++;
+    size_t n = i - start;
+    if (n < (size_t)rule->minLength)
+      continue;
+    memset(counts, 0, sizeof(counts));
+    for (size_t k = start; k < i; k++)
+      counts[text[k]]++;
+    double entropy = 0;
+    for (int c = 0; c < 256; c++) {
+      if (counts[c]) {
+        double p = (double)counts[c] / n;
+        entropy -= p * Log2(p);
+      }
+    }
+    if (entropy >= rule->minEntropy) {
+      found = true;
+      if (firstOnly)
+        break;
+      AddFilterSpan(start, i, rule->action);
+    }
+  }
+  return found;
+}
+
+static bool MatchFilterRule(const FilterRule *rule, const char *text, size_t len, bool firstOnly) {
+  if (rule->kind == FILTER_ENTROPY)
+    return MatchEntropyRule(rule, (const unsigned char *)text, len, firstOnly);
+  // Literal rules, and the regex prefilter: no literal, no match.
+  const char *hit = rule->literal ? FindLiteral(text, len, rule->literal, rule->literalLength, rule->literalFold) : text;
+  if (!hit)
+    return false;
+  if (rule->kind == FILTER_REGEX)
+    return MatchRegexRule(rule, (const unsigned char *)text, len, firstOnly);
+  if (!firstOnly) {
+    while (hit) {
+      size_t at = (size_t)(hit - text);
+      AddFilterSpan(at, at + rule->literalLength, rule->action);
+      at += rule->literalLength;
+      hit = FindLiteral(text + at, len - at, rule->literal, rule->literalLength, false);
+    }
+  }
+  return true;
+}
+
+// Heapsort by start. glibc's qsort mallocs a merge buffer for large arrays,
+// which would put an allocation on every redacting capture.
+static void SiftFilterSpan(FilterSpan *spans, int root, int count) {
+  FilterSpan item = spans[root];
+  for (int child = 2 * root + 1; child < count; child = 2 * root + 1) {
+    if (child + 1 < count && spans[child + 1].start > spans[child].start)
+      child++;
+    if (spans[child].start <= item.start)
+      break;
+    spans[root] = spans[child];
+    root = child;
+  }
+  spans[root] = item;
+}
+
+static void SortFilterSpans(FilterSpan *spans, int count) {
+  for (int i = count / 2 - 1; i >= 0; i--)
+    SiftFilterSpan(spans, i, count);
+  for (int i = count - 1; i > 0; i--) {
+    FilterSpan top = spans[0];
+    spans[0] = spans[i];
+    spans[i] = top;
+    SiftFilterSpan(spans, 0, i);
+  }
+}
+
+// Matches rules first, first + step, ... against text, adding their spans to
+// the calling thread's list. Drop rules run first; returns true on a drop, or
+// when a span could not be recorded.
+static bool CollectFilterMatches(const char *text, size_t len, int first, int step) {
+  filterSpanLost = false;
+  for (int r = first; r < filterRuleCount; r += step) {
+    if (filterRules[r].action == FILTER_DROP && MatchFilterRule(&filterRules[r], text, len, true))
+      return true;
+  }
+  for (int r = first; r < filterRuleCount; r += step) {
+    if (filterRules[r].action != FILTER_DROP)
+      MatchFilterRule(&filterRules[r], text, len, false);
+  }
+  return filterSpanLost;
+}
+
+// Replaces the matched spans of text, which it takes ownership of. Sorts and
+// merges spans in place.
+static char *RedactFilterSpans(char *text, size_t len, FilterSpan *spans, int count) {
+  // Merge overlapping spans; redaction wins over hashing.
+  SortFilterSpans(spans, count);
+  int merged = 0;
+  for (int i = 0; i < count; i++) {
+    FilterSpan *last = merged ? &spans[merged - 1] : NULL;
+    if (last && spans[i].start < last->end) {
+      if (spans[i].end > last->end)
+        last->end = spans[i].end;
+      if (spans[i].action == FILTER_REDACT)
+        last->action = FILTER_REDACT;
+    } else {
+      spans[merged++] = spans[i];
+    }
+  }
+
+  size_t outLen = len;
+  for (int i = 0; i < merged; i++)
+    outLen += 32;  // "[sha256:0123456789abcdef]" or "[REDACTED]"
+  char *out = CaptureBufferAlloc(outLen + 1);
+  if (!out) {
+    FreeCaptureText(text);
+    return NULL;
+  }
+  size_t o = 0, at = 0;
+  for (int i = 0; i < merged; i++) {
+    memcpy(out + o, text + at, spans[i].start - at);
+    o += spans[i].start - at;
+    if (spans[i].action == FILTER_HASH) {
+      Sha256 sha;
+      char hex[65];
+      Sha256Init(&sha);
+      Sha256Update(&sha, (const unsigned char *)text + spans[i].start, spans[i].end - spans[i].start);
+      Sha256HexDigest(&sha, hex);
+      o += (size_t)sprintf(out + o, "[sha256:%.16s]", hex);
+    } else {
+      o += (size_t)sprintf(out + o, "[REDACTED]");
+    }
+    at = spans[i].end;
+  }
+  memcpy(out + o, text + at, len - at);
+  out[o + len - at] = '\0';
+  FreeCaptureText(text);
+  MetricAdd(&metrics.filterRedacted, 1);
+  return out;
+}
+
+static char *RunFilters(char *text) {
+  size_t len = strlen(text);
+  filterSpanCount = 0;
+  if (CollectFilterMatches(text, len, 0, 1)) {
+    MetricAdd(&metrics.filterDropped, 1);
+    FreeCaptureText(text);
+    return NULL;
+  }
+  if (filterSpanCount == 0)
+    return text;
+  return RedactFilterSpans(text, len, filterSpans, filterSpanCount);
+}
+
+// Runs the --filter rules over a capture. Takes ownership of text and returns
+// it, a redacted copy, or NULL when a drop rule matched.
+char *ApplyFilters(char *text) {
+  if (filterRuleCount == 0 || !text)
+    return text;
+  uint64_t start = TraceBegin();
+  int64_t startMicros = NowMicros();
+  text = RunFilters(text);
+  MetricAdd(&metrics.filterMicros, (unsigned long)(NowMicros() - startMicros));
+  TraceSpan("filter", start, traceFinishedCapture);
+  return text;
+}
+
+// Takes ownership of text.
+void PrintClipboardText(char *text) {
+  PrintCapture(text, 0);
+}
+
+void PrintCapture(char *text, unsigned entryFlags) {
+  if (!(entryFlags & TUI_ENTRY_BLOB))
+    text = ApplyFilters(text);
+  PublishCapture(text, entryFlags);
+}
+
+// Hands already filtered text to the ring, the log and the screen. Takes
+// ownership of text.
+void PublishCapture(char *text, unsigned entryFlags) {
+  if (text) {
+    size_t length = strlen(text);
+    nCaptureId++;
+    MetricAdd(&metrics.captures, 1);
+    MetricAdd(&metrics.captureBytes, length);
+    uint64_t start = TraceBegin();
+    RingPublish(nCaptureId, text, length);
+    TraceSpan("ring_publish", start, traceFinishedCapture);
+    if (szOnCapture[0] != '\0')
+      HookPublish(nCaptureId, text, length);
+    start = TraceBegin();
+    WriteToLog(text);
+    TraceSpan("log_write", start, traceFinishedCapture);
+
+    start = TraceBegin();
+    if (bTUI) {
+      nTotalTexts++;
+      nTotalChars += (long long)length;
+      AddTUILogMessage(text, entryFlags);
+    } else if (outputMode != OUTPUT_NONE) {
+      OutputCapture(nCaptureId, text, length, entryFlags);
+    } else if (bShowText && !bBatch) {
+      printf("[Clipboard]: %s\n", text);
+    }
+    TraceSpan("render", start, traceFinishedCapture);
+
+    FreeCaptureText(text);
+  }
+}
+
+// Counts a finished task against its group. The last one wakes PostWait and,
+// for a job, the loop thread: only after the count drops, so HandlePostDone
+// never sees the job still running. notify is read first because the loop
+// thread may reuse the job as soon as the count reaches 0. Called with
+// postMutex held.
+static void PostTaskDone(PostGroup *group) {
+  if (!group)
+    return;
+  bool notify = group->notify;
+  if (atomic_fetch_sub(&group->remaining, 1) != 1)
+    return;
+  pthread_cond_broadcast(&postCond);
+  if (notify) {
+    uint64_t one = 1;
+    if (write(postDoneFd, &one, sizeof(one)) < 0) {
+      // The counter only saturates; the loop still wakes.
+    }
+  }
+}
+
+// Queues a task for the post-processing pool, or runs it here when the queue
+// is full.
+static void PostSubmit(PostTask task) {
+  pthread_mutex_lock(&postMutex);
+  if (postTaskCount < POST_TASK_CAPACITY) {
+    postTasks[(postTaskHead + postTaskCount) % POST_TASK_CAPACITY] = task;
+    postTaskCount++;
+    pthread_cond_broadcast(&postCond);
+    pthread_mutex_unlock(&postMutex);
+    return;
+  }
+  pthread_mutex_unlock(&postMutex);
+  task.run(task.arg, task.index);
+  pthread_mutex_lock(&postMutex);
+  PostTaskDone(task.group);
+  pthread_mutex_unlock(&postMutex);
+}
+
+// Runs the oldest queued task, if any. Called with postMutex held, which is
+// dropped while the task runs.
+static bool PostRunOne() {
+  if (postTaskCount == 0)
+    return false;
+  PostTask task = postTasks[postTaskHead];
+  postTaskHead = (postTaskHead + 1) % POST_TASK_CAPACITY;
+  postTaskCount--;
+  pthread_mutex_unlock(&postMutex);
+  task.run(task.arg, task.index);
+  pthread_mutex_lock(&postMutex);
+  PostTaskDone(task.group);
+  return true;
+}
+
+// Waits for every task of group. Runs queued tasks meanwhile, so a job
+// waiting on its own subtasks never leaves the pool without a free worker.
+static void PostWait(PostGroup *group) {
+  pthread_mutex_lock(&postMutex);
+  while (atomic_load(&group->remaining) > 0) {
+    if (!PostRunOne())
+      pthread_cond_wait(&postCond, &postMutex);
+  }
+  pthread_mutex_unlock(&postMutex);
+}
+
+static void *PostWorkerMain(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&postMutex);
+  while (!postStopping || postTaskCount > 0) {
+    if (!PostRunOne())
+      pthread_cond_wait(&postCond, &postMutex);
+  }
+  pthread_mutex_unlock(&postMutex);
+  return NULL;
+}
+
+typedef struct {
+  const char *text;
+  size_t len;
+  int step;
+  atomic_bool dropped;
+  pthread_mutex_t lock;
+  FilterSpan *spans;  // every task's matches, merged by RedactFilterSpans
+  int count, capacity;
+} FilterFanout;
+
+static void FilterFanoutTask(void *arg, int index) {
+  FilterFanout *fanout = arg;
+  filterSpanCount = 0;
+  if (CollectFilterMatches(fanout->text, fanout->len, index, fanout->step)) {
+    atomic_store(&fanout->dropped, true);
+    return;
+  }
+  if (filterSpanCount == 0)
+    return;
+  pthread_mutex_lock(&fanout->lock);
+  if (fanout->count + filterSpanCount > fanout->capacity) {
+    int capacity = (fanout->count + filterSpanCount) * 2;
+    FilterSpan *spans = realloc(fanout->spans, (size_t)capacity * sizeof(FilterSpan));
+    if (!spans) {
+      // Leaving spans out would leak what they cover; drop the capture.
+      atomic_store(&fanout->dropped, true);
+      pthread_mutex_unlock(&fanout->lock);
+      return;
+    }
+    fanout->spans = spans;
+    fanout->capacity = capacity;
+  }
+  memcpy(fanout->spans + fanout->count, filterSpans, (size_t)filterSpanCount * sizeof(FilterSpan));
+  fanout->count += filterSpanCount;
+  pthread_mutex_unlock(&fanout->lock);
+}
+
+// RunFilters with the rules dealt out over the pool: the whole text goes
+// through every rule exactly once, so matches are the same as on one thread.
+static char *RunFiltersFanout(char *text, size_t len) {
+  int step = postThreadCount + 1;  // the calling worker takes a share too
+  if (step > filterRuleCount)
+    step = filterRuleCount;
+  if (step <= 1)
+    return RunFilters(text);
+
+  FilterFanout fanout = {.text = text, .len = len, .step = step};
+  pthread_mutex_init(&fanout.lock, NULL);
+  PostGroup group = {.notify = false};
+  atomic_init(&group.remaining, step - 1);
+  for (int i = 1; i < step; i++)
+    PostSubmit((PostTask){FilterFanoutTask, &fanout, i, &group});
+  FilterFanoutTask(&fanout, 0);
+  PostWait(&group);
+  pthread_mutex_destroy(&fanout.lock);
+
+  if (atomic_load(&fanout.dropped)) {
+    MetricAdd(&metrics.filterDropped, 1);
+    FreeCaptureText(text);
+    text = NULL;
+  } else if (fanout.count > 0) {
+    text = RedactFilterSpans(text, len, fanout.spans, fanout.count);
+  }
+  free(fanout.spans);
+  return text;
+}
+
+// The worker half of an offloaded capture: what DeliverFetchResult and
+// PrintCapture would do before publishing.
+static void PostJobRun(void *arg, int index) {
+  (void)index;
+  PostJob *job = arg;
+  int64_t startMicros = NowMicros();
+  size_t length = job->length;
+  bool normalized = normalizeFlags && NormalizeText(job->text, length);
+  if (normalized)
+    length = strlen(job->text);
+  if (bMonitor) {
+    job->hash = HashText(job->text);
+    job->hashed = true;
+  }
+  if (bNormalizeCopy && normalized && job->clipboard) {
+    job->clipboardCopy = CaptureBufferAlloc(length + 1);
+    if (job->clipboardCopy)
+      memcpy(job->clipboardCopy, job->text, length + 1);
+  }
+  if (filterRuleCount > 0) {
+    int64_t filterStart = NowMicros();
+    job->text = RunFiltersFanout(job->text, length);
+    MetricAdd(&metrics.filterMicros, (unsigned long)(NowMicros() - filterStart));
+  }
+  MetricAdd(&metrics.offloadMicros, (unsigned long)(NowMicros() - startMicros));
+}
+
+// Publishes jobs from the front of the FIFO until one is still running.
+void PostPublishReady() {
+  bool published = false;
+  while (postJobCount > 0) {
+    PostJob *job = &postJobs[postJobHead];
+    if (atomic_load(&job->group.remaining) > 0)
+      break;
+    char *text = job->text;
+    publishWindow = job->owner;
+    if (job->processed) {
+      postPendingBytes -= job->length;
+      if (job->hashed) {
+        if (job->hash == monitorLastHash[job->monitorSelection]) {
+          FreeCaptureText(text);
+          FreeCaptureText(job->clipboardCopy);
+          text = job->clipboardCopy = NULL;
+          for (int i = 0; i < job->blobCount; i++)
+            free(job->blobs[i]);
+          job->blobCount = 0;
+        }
+        monitorLastHash[job->monitorSelection] = job->hash;
+      }
+      if (job->clipboardCopy) {
+        CopyToClipboard(job->clipboardCopy);
+        FreeCaptureText(job->clipboardCopy);
+      }
+      PublishCapture(text, 0);
+    } else {
+      bool normalized = normalizeFlags && text && NormalizeText(text, job->length);
+      if (bMonitor && text) {
+        uint64_t hash = HashText(text);
+        if (hash == monitorLastHash[job->monitorSelection]) {
+          FreeCaptureText(text);
+          text = NULL;
+          for (int i = 0; i < job->blobCount; i++)
+            free(job->blobs[i]);
+          job->blobCount = 0;
+        }
+        monitorLastHash[job->monitorSelection] = hash;
+      }
+      if (bNormalizeCopy && normalized && text && job->clipboard)
+        CopyToClipboard(text);
+      PrintClipboardText(text);
+    }
+    for (int i = 0; i < job->blobCount; i++)
+      PrintCapture(job->blobs[i], TUI_ENTRY_BLOB);
+    memset(job, 0, sizeof(*job));
+    postJobHead = (postJobHead + 1) % MAX_POST_JOBS;
+    postJobCount--;
+    published = true;
+  }
+  if (published && bTUI) {
+    DrawTUIHeader();  // drop the "Processing" note
+    RedrawTUILogs();
+  }
+}
+
+void HandlePostDone(LoopSource *src, uint32_t events) {
+  (void)events;
+  uint64_t count;
+  if (read(src->fd, &count, sizeof(count)) < 0) {
+    // Spurious wakeup
+  }
+  PostPublishReady();
+}
+
+// Takes the fetched text and the completed blobs into the FIFO. Large text
+// goes to a worker; anything else only waits for the jobs ahead of it.
+// Returns false when the pool is off or the capture can stay inline.
+bool PostJobQueue(char *text, size_t length) {
+  bool heavy = text && length >= postWorkerMin;
+  if (postThreadCount == 0 || (!heavy && postJobCount == 0))
+    return false;
+  while (postJobCount == MAX_POST_JOBS) {
+    PostWait(&postJobs[postJobHead].group);
+    PostPublishReady();
+  }
+  PostJob *job = &postJobs[(postJobHead + postJobCount) % MAX_POST_JOBS];
+  postJobCount++;
+  job->text = text;
+  job->length = length;
+  job->processed = heavy;
+  job->clipboard = fetchSelection == fetchClipboardAtom;
+  job->owner = fetchOwner;
+  job->monitorSelection = monitorFetching;
+  char *placeholder;
+  while (job->blobCount < MAX_EXTRA_TARGETS && (placeholder = TakeBlobPlaceholder()))
+    job->blobs[job->blobCount++] = placeholder;
+  if (heavy) {
+    postPendingBytes += length;
+    MetricAdd(&metrics.offloaded, 1);
+    atomic_init(&job->group.remaining, 1);
+    job->group.notify = true;
+    PostSubmit((PostTask){PostJobRun, job, 0, &job->group});
+    if (bTUI) {
+      DrawTUIHeader();
+      RedrawTUILogs();
+    }
+  } else {
+    atomic_init(&job->group.remaining, 0);
+  }
+  return true;
+}
+
+bool PostWorkersStart() {
+  if (postWorkerCount == 0)
+    return true;
+  postDoneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (postDoneFd < 0 || !LoopAdd(&srcPostDone, postDoneFd, HandlePostDone, NULL))
+    return false;
+  for (int i = 0; i < postWorkerCount; i++) {
+    if (pthread_create(&postThreads[i], NULL, PostWorkerMain, NULL) != 0)
+      break;
+    postThreadCount++;
+  }
+  return postThreadCount > 0;
+}
+
+// Finishes and publishes every queued capture, then joins the workers.
+void PostWorkersStop() {
+  while (postJobCount > 0) {
+    PostWait(&postJobs[postJobHead].group);
+    PostPublishReady();
+  }
+  pthread_mutex_lock(&postMutex);
+  postStopping = true;
+  pthread_cond_broadcast(&postCond);
+  pthread_mutex_unlock(&postMutex);
+  for (int i = 0; i < postThreadCount; i++)
+    pthread_join(postThreads[i], NULL);
+  postThreadCount = 0;
+}
+
+void HandleHookInput(LoopSource *src, uint32_t events);
+void HandleHookReply(LoopSource *src, uint32_t events);
+
+static void HookClosePipes(HookHelper *h) {
+  int input = h->input.fd, reply = h->reply.fd;
+  LoopRemove(&h->input);
+  LoopRemove(&h->reply);
+  close(input);
+  close(reply);
+}
+
+// Ends a helper that timed out, exited or broke the protocol. Its queued
+// records are lost; the timer restarts it after HOOK_RESTART_MS.
+static void HookKill(HookHelper *h) {
+  if (h->pid <= 0)
+    return;
+  HookClosePipes(h);
+  kill(h->pid, SIGKILL);
+  waitpid(h->pid, NULL, 0);
+  h->pid = 0;
+  MetricAdd(&metrics.hookFailures, 1);
+  MetricAdd(&metrics.hookDropped, (unsigned long)h->count);
+  for (int i = 0; i < h->count; i++)
+    free(h->queue[(h->head + i) % HOOK_QUEUE_RECORDS].data);
+  memset(h->queue, 0, sizeof(h->queue));
+  h->head = h->count = 0;
+  h->queuedBytes = 0;
+  ArmTimer(h->timer.fd, HOOK_RESTART_MS);
+}
+
+static bool HookSpawn(HookHelper *h) {
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) != 0)
+    return false;
+  if (pipe2(out, O_CLOEXEC) != 0) {
+    close(in[0]);
+    close(in[1]);
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Only async-signal-safe calls until exec: other threads may hold locks.
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    if (bTUI) {
+      int null = open("/dev/null", O_WRONLY);
+      if (null >= 0)
+        dup2(null, STDERR_FILENO);
+    }
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", szOnCapture, (char *)NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  if (pid < 0) {
+    close(in[1]);
+    close(out[0]);
+    return false;
+  }
+  fcntl(in[1], F_SETPIPE_SZ, 1 << 20);  // best effort: bigger captures go out without a copy
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  fcntl(out[0], F_SETFL, O_NONBLOCK);
+  h->pid = pid;
+  h->lineLength = 0;
+  LoopAdd(&h->input, in[1], HandleHookInput, NULL);
+  LoopSetEvents(&h->input, 0);  // hangups are still reported
+  LoopAdd(&h->reply, out[0], HandleHookReply, NULL);
+  return true;
+}
+
+// Writes queued records in order until the pipe is full. False when the
+// helper is gone.
+static bool HookFlush(HookHelper *h) {
+  for (int i = 0; i < h->count && h->queuedBytes > 0; i++) {
+    HookRecord *r = &h->queue[(h->head + i) % HOOK_QUEUE_RECORDS];
+    while (r->data && r->offset < r->length) {
+      ssize_t n = write(h->input.fd, r->data + r->offset, r->length - r->offset);
+      if (n < 0 && errno == EAGAIN) {
+        LoopSetEvents(&h->input, EPOLLOUT);
+        return true;
+      }
+      if (n < 0)
+        return false;
+      r->offset += (size_t)n;
+    }
+    if (r->data) {
+      h->queuedBytes -= r->length;
+      free(r->data);
+      r->data = NULL;
+    }
+  }
+  LoopSetEvents(&h->input, 0);
+  return true;
+}
+
+void HandleHookInput(LoopSource *src, uint32_t events) {
+  HookHelper *h = (HookHelper *)((char *)src - offsetof(HookHelper, input));
+  if ((events & (EPOLLERR | EPOLLHUP)) || !HookFlush(h))
+    HookKill(h);
+}
+
+// One line per record, oldest first.
+void HandleHookReply(LoopSource *src, uint32_t events) {
+  HookHelper *h = (HookHelper *)((char *)src - offsetof(HookHelper, reply));
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(src->fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      if (buf[i] == '\r')
+        continue;
+      if (buf[i] != '\n') {
+        if (h->lineLength < sizeof(h->line) - 1)
+          h->line[h->lineLength++] = buf[i];
+        continue;
+      }
+      h->line[h->lineLength] = '\0';
+      h->lineLength = 0;
+      if (h->count == 0 || h->queue[h->head].data) {
+        HookKill(h);  // an answer to a record it has not been sent
+        return;
+      }
+      h->head = (h->head + 1) % HOOK_QUEUE_RECORDS;
+      h->count--;
+      MetricAdd(strcmp(h->line, "ok") == 0 ? &metrics.hookRecords : &metrics.hookFailures, 1);
+      ArmTimer(h->timer.fd, h->count > 0 ? hookTimeoutMs : 0);
+    }
+  }
+  if (n == 0 || errno != EAGAIN)
+    HookKill(h);  // the helper exited
+}
+
+void HandleHookTimer(LoopSource *src, uint32_t events) {
+  HookHelper *h = (HookHelper *)((char *)src - offsetof(HookHelper, timer));
+  uint64_t expirations;
+  if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+  if (h->pid == 0) {
+    if (!HookSpawn(h))
+      ArmTimer(src->fd, HOOK_RESTART_MS);
+  } else if (h->count > 0) {
+    HookKill(h);  // the oldest record is past --hook-timeout
+  }
+}
+
+// Hands a published capture to the least busy helper. Text the pipe takes
+// right away is not copied.
+void HookPublish(unsigned long long id, const char *text, size_t length) {
+  HookHelper *best = NULL;
+  for (int i = 0; i < hookHelperCount; i++) {
+    HookHelper *h = &hookHelpers[i];
+    if (h->pid > 0 && h->count < HOOK_QUEUE_RECORDS && h->queuedBytes + length <= HOOK_QUEUE_BYTES &&
+        (!best || h->count < best->count))
+      best = h;
+  }
+  if (!best) {
+    MetricAdd(&metrics.hookDropped, 1);
+    return;
+  }
+
+  char header[48];
+  size_t headerLength = (size_t)snprintf(header, sizeof(header), "%llu %zu\n", id, length);
+  size_t total = headerLength + length, written = 0;
+  if (best->queuedBytes == 0) {
+    struct iovec iov[2] = {{header, headerLength}, {(void *)text, length}};
+    ssize_t n = writev(best->input.fd, iov, 2);
+    if (n < 0 && errno != EAGAIN) {
+      MetricAdd(&metrics.hookDropped, 1);
+      HookKill(best);
+      return;
+    }
+    if (n > 0)
+      written = (size_t)n;
+  }
+
+  HookRecord *r = &best->queue[(best->head + best->count) % HOOK_QUEUE_RECORDS];
+  r->data = NULL;
+  r->length = r->offset = 0;
+  if (written < total) {
+    r->data = malloc(total - written);
+    if (!r->data) {
+      MetricAdd(&metrics.hookDropped, 1);
+      if (written > 0)
+        HookKill(best);  // half a record is in the pipe
+      return;
+    }
+    size_t skip = written, at = 0;
+    if (skip < headerLength) {
+      memcpy(r->data, header + skip, headerLength - skip);
+      at = headerLength - skip;
+      skip = 0;
+    } else {
+      skip -= headerLength;
+    }
+    memcpy(r->data + at, text + skip, length - skip);
+    r->length = total - written;
+    best->queuedBytes += r->length;
+    LoopSetEvents(&best->input, EPOLLOUT);
+  }
+  if (best->count++ == 0)
+    ArmTimer(best->timer.fd, hookTimeoutMs);
+}
+
+bool HookStart() {
+  for (int i = 0; i < hookHelperCount; i++) {
+    HookHelper *h = &hookHelpers[i];
+    h->input.fd = h->reply.fd = -1;
+    if (!LoopAdd(&h->timer, timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), HandleHookTimer, NULL) ||
+        !HookSpawn(h))
+      return false;
+  }
+  return true;
+}
+
+// Closing stdin tells helpers to finish; ones still running after a second
+// are killed.
+void HookStop() {
+  int64_t deadline = NowMicros() + 1000000;
+  for (int i = 0; i < hookHelperCount; i++) {
+    HookHelper *h = &hookHelpers[i];
+    if (h->pid > 0)
+      HookClosePipes(h);
+  }
+  for (int i = 0; i < hookHelperCount; i++) {
+    HookHelper *h = &hookHelpers[i];
+    while (h->pid > 0 && waitpid(h->pid, NULL, WNOHANG) == 0) {
+      if (NowMicros() > deadline) {
+        kill(h->pid, SIGKILL);
+        waitpid(h->pid, NULL, 0);
+        break;
+      }
+      usleep(10000);
+    }
+    h->pid = 0;
+    for (int k = 0; k < h->count; k++)
+      free(h->queue[(h->head + k) % HOOK_QUEUE_RECORDS].data);
+    h->count = 0;
+  }
+}
+
+// Length of the leading run of bytes a JSON string holds as they are:
+// anything but control characters, '"' and '\\'.
+static size_t JsonPlainRunLength(const unsigned char *s, size_t len) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+                                  _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i quote16 = _mm_set1_epi8('"'), backslash16 = _mm_set1_epi8('\\');
+  const __m128i control16 = _mm_set1_epi8(0x1f);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote16), _mm_cmpeq_epi8(v, backslash16)),
+                               _mm_cmpeq_epi8(_mm_min_epu8(v, control16), v));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+#else
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, sizeof(word));
+    // A byte below 0x20, or a zero byte after XOR with '"' or '\\'.
+    uint64_t quote = word ^ 0x2222222222222222ULL, backslash = word ^ 0x5c5c5c5c5c5c5c5cULL;
+    if ((((word - 0x2020202020202020ULL) & ~word) | ((quote - 0x0101010101010101ULL) & ~quote) |
+         ((backslash - 0x0101010101010101ULL) & ~backslash)) & 0x8080808080808080ULL)
+      break;
+  }
+#endif
+  while (i < len && s[i] >= 0x20 && s[i] != '"' && s[i] != '\\')
+    i++;
+  return i;
+}
+
+// Writes text as the inside of a JSON string; out needs 6 * len bytes.
+static size_t JsonEscape(char *out, const char *text, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *s = (const unsigned char *)text;
+  size_t o = 0, i = 0;
+  while (i < len) {
+    size_t run = JsonPlainRunLength(s + i, len - i);
+    memcpy(out + o, s + i, run);
+    o += run;
+    i += run;
+    if (i == len)
+      break;
+    unsigned char c = s[i++];
+    out[o++] = '\\';
+    switch (c) {
+    case '"': out[o++] = '"'; break;
+    case '\\': out[o++] = '\\'; break;
+    case '\n': out[o++] = 'n'; break;
+    case '\r': out[o++] = 'r'; break;
+    case '\t': out[o++] = 't'; break;
+    default:
+      memcpy(out + o, "u00", 3);
+      out[o + 3] = hex[c >> 4];
+      out[o + 4] = hex[c & 15];
+      o += 5;
+    }
+  }
+  return o;
+}
+
+// The consumer closed stdout: like any filter, stop.
+static void OutputClosed() {
+  fprintf(stderr, "autocopy: --output stream closed, exiting.\n");
+  outputStart = outputEnd = 0;
+  loopShouldExit = true;
+}
+
+// Writes buffered records until stdout would block. False once the
+// consumer is gone.
+static bool OutputFlush() {
+  while (outputStart < outputEnd) {
+    ssize_t n = write(STDOUT_FILENO, outputBuffer + outputStart, outputEnd - outputStart);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN) {
+      if (!outputWaiting && srcOutput.fd >= 0)
+        LoopSetEvents(&srcOutput, EPOLLOUT);
+      outputWaiting = true;
+      return true;
+    }
+    if (n < 0)
+      return false;
+    outputStart += (size_t)n;
+  }
+  outputStart = outputEnd = 0;
+  if (outputWaiting && srcOutput.fd >= 0)
+    LoopSetEvents(&srcOutput, 0);
+  outputWaiting = false;
+  return true;
+}
+
+// Blocks until everything buffered is written, or for at most timeoutMs
+// (-1: no limit).
+static void OutputDrain(int timeoutMs) {
+  int64_t deadline = NowMicros() + (int64_t)timeoutMs * 1000;
+  while (outputStart < outputEnd) {
+    if (!OutputFlush()) {
+      OutputClosed();
+      return;
+    }
+    if (outputStart == outputEnd)
+      break;
+    int wait = -1;
+    if (timeoutMs >= 0) {
+      wait = (int)((deadline - NowMicros()) / 1000);
+      if (wait <= 0)
+        return;
+    }
+    struct pollfd pfd = {STDOUT_FILENO, POLLOUT, 0};
+    poll(&pfd, 1, wait);
+  }
+}
+
+void HandleOutputWritable(LoopSource *src, uint32_t events) {
+  if (!OutputFlush())
+    OutputClosed();
+}
+
+// Appends one --output record for a published capture and writes what
+// stdout takes now. Fields: id, UTC time, selection owner window, length.
+void OutputCapture(unsigned long long id, const char *text, size_t length, unsigned entryFlags) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  struct tm tmNow;
+  gmtime_r(&now.tv_sec, &tmNow);
+  char stamp[40];
+  size_t stampLength = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tmNow);
+  snprintf(stamp + stampLength, sizeof(stamp) - stampLength, ".%03ldZ", now.tv_nsec / 1000000);
+
+  size_t need = (outputMode == OUTPUT_JSONL ? 6 * length : length) + 256;
+  if (outputStart > 0 && outputEnd + need > outputCapacity) {
+    memmove(outputBuffer, outputBuffer + outputStart, outputEnd - outputStart);
+    outputEnd -= outputStart;
+    outputStart = 0;
+  }
+  if (outputEnd + need > outputCapacity) {
+    size_t capacity = outputEnd + need < 65536 ? 65536 : outputEnd + need;
+    char *buffer = realloc(outputBuffer, capacity);
+    if (!buffer) {
+      MetricAdd(&metrics.outputDropped, 1);
+      return;
+    }
+    outputBuffer = buffer;
+    outputCapacity = capacity;
+  }
+
+  size_t before = outputEnd;
+  char *p = outputBuffer + outputEnd;
+  if (outputMode == OUTPUT_JSONL) {
+    p += sprintf(p, "{\"id\":%llu,\"time\":\"%s\",\"window\":\"0x%lx\",\"length\":%zu,%s\"text\":\"", id, stamp,
+                 (unsigned long)publishWindow, length, (entryFlags & TUI_ENTRY_BLOB) ? "\"blob\":true," : "");
+    p += JsonEscape(p, text, length);
+    memcpy(p, "\"}\n", 3);
+    p += 3;
+  } else {
+    // NUL: "id\ttime\twindow\tlength\ttext\0". Netstring: the same fields
+    // and text framed as "<bytes>:...,".
+    char header[128];
+    int headerLength = snprintf(header, sizeof(header), "%llu\t%s\t0x%lx\t%zu\t", id, stamp,
+                                (unsigned long)publishWindow, length);
+    if (outputMode == OUTPUT_NETSTRING)
+      p += sprintf(p, "%zu:", (size_t)headerLength + length);
+    memcpy(p, header, (size_t)headerLength);
+    p += headerLength;
+    memcpy(p, text, length);
+    p += length;
+    *p++ = outputMode == OUTPUT_NETSTRING ? ',' : '\0';
+  }
+  outputEnd = (size_t)(p - outputBuffer);
+
+  size_t backlog = before - outputStart;
+  if (backlog > 0 && backlog + (outputEnd - before) > outputLimit) {
+    if (!bOutputBlock) {
+      outputEnd = before;
+      MetricAdd(&metrics.outputDropped, 1);
+      return;
+    }
+    MetricAdd(&metrics.outputRecords, 1);
+    OutputDrain(-1);
+    return;
+  }
+  MetricAdd(&metrics.outputRecords, 1);
+  if (!outputWaiting && !OutputFlush())
+    OutputClosed();
+}
+
+// Regular files never block, so stdout only goes non-blocking (and into the
+// loop) when it is a pipe or socket. A terminal is written synchronously as
+// well: O_NONBLOCK on it would also apply to stdin and stderr, which share
+// its file description.
+bool OutputInit() {
+  fflush(stdout);
+  struct stat st;
+  if (fstat(STDOUT_FILENO, &st) != 0)
+    return false;
+  if (S_ISREG(st.st_mode) || isatty(STDOUT_FILENO))
+    return true;
+  outputFlags = fcntl(STDOUT_FILENO, F_GETFL);
+  if (outputFlags < 0 || fcntl(STDOUT_FILENO, F_SETFL, outputFlags | O_NONBLOCK) != 0)
+    return false;
+  if (!LoopAdd(&srcOutput, STDOUT_FILENO, HandleOutputWritable, NULL)) {
+    fcntl(STDOUT_FILENO, F_SETFL, outputFlags);  // e.g. /dev/null, which epoll refuses
+    outputFlags = -1;
+    return true;
+  }
+  LoopSetEvents(&srcOutput, 0);
+  return true;
+}
+
+// Gives the consumer two seconds to take what is left.
+void OutputClose() {
+  OutputDrain(2000);
+  LoopRemove(&srcOutput);
+  if (outputFlags >= 0)
+    fcntl(STDOUT_FILENO, F_SETFL, outputFlags);
+  free(outputBuffer);
+  outputBuffer = NULL;
+}
+
+// Counts a left-button release at server time now and decides whether it
+// completes the configured click/modifier combination. display is used to
+// read the modifier state.
+bool ClassifyClick(ClickState *state, Display *display, Time now) {
+  Time diff = now - state->lastClickTime;
+
+  if (state->clicks > 0 && (diff < minTime || diff > maxTime)) {
+    state->clicks = 1;
+  } else {
+    state->clicks++;
+  }
+  state->lastClickTime = now;
+
+  Window root, child;
+  int root_x, root_y, win_x, win_y;
+  unsigned int mask;
+  XQueryPointer(display, DefaultRootWindow(display), &root,
+                &child, &root_x, &root_y, &win_x, &win_y, &mask);
+
+  bool alt_pressed = (mask & Mod1Mask);
+  bool ctrl_pressed = (mask & ControlMask);
+
+  bool trigger = false;
+  if (bRequireAlt && alt_pressed && state->clicks == nRequiredClicks)
+    trigger = true;
+  else if (bRequireCtrl && ctrl_pressed &&
+           state->clicks == nRequiredClicks)
+    trigger = true;
+  else if (!bRequireAlt && !bRequireCtrl &&
+           state->clicks == nRequiredClicks)
+    trigger = true;
+
+  bool ctrl_short_trigger = false;
+  if (ctrl_pressed) {
+    if (bCtrl1 && state->clicks == 1)
+      ctrl_short_trigger = true;
+    else if (bCtrl2 && state->clicks == 2)
+      ctrl_short_trigger = true;
+  }
+
+  AUTOCOPY_PROBE2(classify, state->clicks, trigger || ctrl_short_trigger);
+  if (trigger || ctrl_short_trigger) {
+    state->clicks = 0;
+    return true;
+  }
+  return false;
+}
+
+void event_callback(XPointer ptr, XRecordInterceptData *data) {
+  if (data->category == XRecordStartOfData)
+    NotifyReady();  // the server is recording now
+  if (data->category != XRecordFromServer) {
+    XRecordFreeData(data);
+    return;
+  }
+
+  unsigned char *xdata = (unsigned char *)data->data;
+  int type = xdata[0];
+
+  if (type == KeyPress || type == KeyRelease) {
+    int keycode = xdata[1];
+    // Use XKeysymToKeycode to get the correct keycodes for this system
+    static int ctrl_l_code = 0;
+    static int ctrl_r_code = 0;
+    static bool initialized = false;
+    
+    if (!initialized && ctrl_display) {
+      ctrl_l_code = XKeysymToKeycode(ctrl_display, XK_Control_L);
+      ctrl_r_code = XKeysymToKeycode(ctrl_display, XK_Control_R);
+      initialized = true;
+    }
+    
+    if ((ctrl_l_code && keycode == ctrl_l_code) || 
+        (ctrl_r_code && keycode == ctrl_r_code)) {
+      bCtrlKeyPressed = (type == KeyPress);
+    }
+  }
+
+  if (type == ButtonRelease) {
+    int button = xdata[1];
+    if (button == 1) {
+      uint64_t classifyStart = TraceBegin();
+      if (ClassifyClick(&clickState, ctrl_display, data->server_time)) {
+        OnCaptureTrigger();
+        TraceSpan("classify", classifyStart, traceCaptureId);
+      } else {
+        TraceSpan("classify", classifyStart, 0);
+      }
+    }
+  }
+
+  XRecordFreeData(data);
+}
+
+// Every button and key event from every client, for the XRecord backend.
+XRecordContext CreateInputRecordContext(Display *display) {
+  XRecordRange *range_mouse = XRecordAllocRange();
+  range_mouse->device_events.first = ButtonPress;
+  range_mouse->device_events.last = ButtonRelease;
+
+  XRecordRange *range_key = XRecordAllocRange();
+  range_key->device_events.first = KeyPress;
+  range_key->device_events.last = KeyRelease;
+
+  XRecordRange *ranges[2] = {range_mouse, range_key};
+  XRecordClientSpec spec = XRecordAllClients;
+  XRecordContext context = XRecordCreateContext(display, 0, &spec, 1, ranges, 2);
+  XFree(range_mouse);
+  XFree(range_key);
+  return context;
+}
+
+bool RecordInit() {
+  if (bInputXI2)
+    return XI2Init();
+  if (!data_display)
+    data_display = XOpenDisplay(NULL);
+
+  if (!data_display) {
+    fprintf(stderr, "Error: Could not open data display.\n");
+    return false;
+  }
+
+  recordContext = CreateInputRecordContext(data_display);
+  if (!recordContext) {
+    fprintf(stderr, "Error: Could not create XRecord context.\n");
+    return false;
+  }
+
+  // Async enable: intercepted data is delivered when the loop sees the fd readable.
+  if (!XRecordEnableContextAsync(data_display, recordContext, event_callback, NULL)) {
+    fprintf(stderr, "Error: Could not enable XRecord context.\n");
+    return false;
+  }
+  return true;
+}
+
+void HandleRecordData(LoopSource *src, uint32_t events) {
+  uint64_t start = TraceBegin();
+  unsigned long long seq = traceCaptureSeq;
+  if (bInputXI2)
+    HandleXI2Events(data_display);
+  else
+    XRecordProcessReplies(data_display);
+  if (traceCaptureSeq != seq)
+    TraceSpan("xrecord_receipt", start, traceCaptureSeq);
+}
+
+// XInput2 backend (--input xi2). The server sends raw left-button releases
+// and, through XKB, a notification only when the modifier state changes, so
+// ordinary keystrokes never leave the server. Raw events reach the root
+// window even while another client holds a grab (XI 2.1 and later).
+// Returns false if the server lacks XI 2.1 or XKB.
+bool XI2Select(Display *display) {
+  int event, error, major = 2, minor = 1;
+  if (!XQueryExtension(display, "XInputExtension", &xi2Opcode, &event, &error) ||
+      XIQueryVersion(display, &major, &minor) != Success || (major == 2 && minor < 1))
+    return false;
+  int xkbOpcode, xkbMajor = XkbMajorVersion, xkbMinor = XkbMinorVersion;
+  if (!XkbQueryExtension(display, &xkbOpcode, &xkbEventBase, &error, &xkbMajor, &xkbMinor))
+    return false;
+
+  unsigned char bits[XIMaskLen(XI_RawButtonRelease)] = {0};
+  XISetMask(bits, XI_RawButtonRelease);
+  XIEventMask mask = {XIAllMasterDevices, sizeof(bits), bits};
+  XISelectEvents(display, DefaultRootWindow(display), &mask, 1);
+  XkbSelectEventDetails(display, XkbUseCoreKbd, XkbStateNotify, XkbModifierStateMask, XkbModifierStateMask);
+  return true;
+}
+
+bool XI2Init() {
+  if (!data_display)
+    data_display = XOpenDisplay(NULL);
+  if (!data_display) {
+    fprintf(stderr, "Error: Could not open data display.\n");
+    return false;
+  }
+  if (!XI2Select(data_display)) {
+    fprintf(stderr, "Error: --input xi2 needs the XInputExtension 2.1 and XKB on the X server.\n");
+    return false;
+  }
+  XkbStateRec state;
+  if (XkbGetState(data_display, XkbUseCoreKbd, &state) == Success)
+    bCtrlKeyPressed = state.mods & ControlMask;
+  xi2ButtonCount = XGetPointerMapping(data_display, xi2ButtonMap, sizeof(xi2ButtonMap));
+  return true;  // the XkbGetState reply means the selections are in place
+}
+
+// Raw events carry the physical button; a left-handed mapping swaps 1 and 3.
+static bool XI2IsLeftButton(int detail) {
+  if (detail < 1 || detail > xi2ButtonCount)
+    return detail == 1;
+  return xi2ButtonMap[detail - 1] == 1;
+}
+
+void HandleXI2Events(Display *display) {
+  XEvent event;
+  while (XPending(display)) {
+    XNextEvent(display, &event);
+    if (event.type == MappingNotify) {
+      if (event.xmapping.request == MappingPointer)
+        xi2ButtonCount = XGetPointerMapping(display, xi2ButtonMap, sizeof(xi2ButtonMap));
+      continue;
+    }
+    if (event.type == xkbEventBase) {
+      XkbEvent *xkb = (XkbEvent *)&event;
+      if (xkb->any.xkb_type == XkbStateNotify)
+        bCtrlKeyPressed = xkb->state.mods & ControlMask;
+      continue;
+    }
+    XGenericEventCookie *cookie = &event.xcookie;
+    if (event.type != GenericEvent || cookie->extension != xi2Opcode || !XGetEventData(display, cookie))
+      continue;
+    XIRawEvent *raw = cookie->data;
+    if (cookie->evtype == XI_RawButtonRelease && XI2IsLeftButton(raw->detail)) {
+      uint64_t classifyStart = TraceBegin();
+      if (ClassifyClick(&clickState, ctrl_display, raw->time)) {
+        OnCaptureTrigger();
+        TraceSpan("classify", classifyStart, traceCaptureId);
+      } else {
+        TraceSpan("classify", classifyStart, 0);
+      }
+    }
+    XFreeEventData(display, cookie);
+  }
+}
+
+// Tells a supervisor that capture is armed: "READY=1" on --ready-fd (which is
+// then closed) and as a datagram to $NOTIFY_SOCKET, as systemd's Type=notify
+// expects. Runs once, on whichever thread sees the last XRecord context start.
+void NotifyReady() {
+  if (atomic_exchange(&readySent, true))
+    return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long micros = (now.tv_sec - startupStart.tv_sec) * 1000000 + (now.tv_nsec - startupStart.tv_nsec) / 1000;
+  MetricAdd(&metrics.startupMicros, (unsigned long)micros);
+
+  if (readyFd >= 0) {
+    if (write(readyFd, "READY=1\n", 8) != 8)
+      fprintf(stderr, "Warning: Could not write to --ready-fd: %s\n", strerror(errno));
+    close(readyFd);
+    readyFd = -1;
+  }
+  if (szNotifySocket[0] != '\0') {
+    char message[96];
+    int len = snprintf(message, sizeof(message), "READY=1\nSTATUS=Capturing, started in %.1f ms\n", micros / 1000.0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    size_t pathLen = strlen(szNotifySocket);
+    memcpy(addr.sun_path, szNotifySocket, pathLen);
+    if (addr.sun_path[0] == '@')
+      addr.sun_path[0] = '\0';
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || sendto(fd, message, (size_t)len, MSG_NOSIGNAL, (struct sockaddr *)&addr,
+                         (socklen_t)(offsetof(struct sockaddr_un, sun_path) + pathLen)) < 0)
+      fprintf(stderr, "Warning: Could not notify %s: %s\n", szNotifySocket, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+  }
+  if (!bBatch && !bTUI && outputMode == OUTPUT_NONE) {
+    printf("Ready in %.1f ms\n", micros / 1000.0);
+    fflush(stdout);
+  }
+}
+
+// One X connection set up on its own thread during startup.
+typedef struct {
+  bool (*init)(void);
+  bool ok;
+  bool threaded;
+  pthread_t thread;
+} StartupTask;
+
+static void *RunStartupTask(void *arg) {
+  StartupTask *task = arg;
+  task->ok = task->init();
+  return NULL;
+}
+
+static bool FetchStartupInit() {
+  return ClipboardFetchInit() && (!bMonitor || MonitorInit());
+}
+
+// Each connection's handshake, atom lookups and extension queries are round
+// trips that do not depend on the others, so the owner, fetch and record
+// connections come up in parallel while the caller opens ctrl_display.
+// Needs XInitThreads.
+bool StartupConnect() {
+  StartupTask tasks[3] = {{ClipboardOwnerInit}, {FetchStartupInit}, {RecordInit}};
+  int count = bMonitor ? 2 : 3;
+  for (int i = 0; i < count; i++)
+    tasks[i].threaded = pthread_create(&tasks[i].thread, NULL, RunStartupTask, &tasks[i]) == 0;
+  ctrl_display = XOpenDisplay(NULL);
+  bool ok = true;
+  for (int i = 0; i < count; i++) {
+    if (tasks[i].threaded)
+      pthread_join(tasks[i].thread, NULL);
+    else
+      RunStartupTask(&tasks[i]);
+    ok = ok && tasks[i].ok;
+  }
+  return ok;
+}
+
+// Event loop: every X connection, stdin, timers, signals and cross-thread
+// wakeups are multiplexed on one epoll instance and handled on this thread.
+bool LoopAdd(LoopSource *src, int fd, LoopHandler handler, Display *display) {
+  src->fd = fd;
+  src->handler = handler;
+  src->display = display;
+
+  struct epoll_event ev = {0};
+  ev.events = EPOLLIN;
+  ev.data.ptr = src;
+  if (epoll_ctl(loopEpollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    src->fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void LoopRemove(LoopSource *src) {
+  if (src->fd >= 0) {
+    epoll_ctl(loopEpollFd, EPOLL_CTL_DEL, src->fd, NULL);
+    src->fd = -1;
+  }
+}
+
+// Replaces what src waits for, e.g. EPOLLOUT while a write is pending.
+void LoopSetEvents(LoopSource *src, uint32_t events) {
+  struct epoll_event ev = {0};
+  ev.events = events;
+  ev.data.ptr = src;
+  epoll_ctl(loopEpollFd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+
+void LoopWakeup() {
+  uint64_t one = 1;
+  if (loopWakeFd >= 0 && write(loopWakeFd, &one, sizeof(one)) < 0) {
+    // Counter saturated: a wakeup is already pending.
+  }
+}
+
+void ArmTimer(int fd, int ms) {
+  struct itimerspec spec = {0};
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+  timerfd_settime(fd, 0, &spec, NULL);
+}
+
+void HandleWake(LoopSource *src, uint32_t events) {
+  uint64_t count;
+  if (read(src->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    return;
+  ClaimClipboardOwnership();
+}
+
+void HandleSignal(LoopSource *src, uint32_t events) {
+  struct signalfd_siginfo info;
+  while (read(src->fd, &info, sizeof(info)) == sizeof(info)) {
+    if (info.ssi_signo == SIGWINCH) {
+      if (bTUI) {
+        DrawTUIHeader();
+        RedrawTUILogs();
+      }
+    } else {
+      loopShouldExit = true;
+    }
+  }
+}
+
+// --hotkey: the first press of the chord puts the newest history entry on
+// the clipboard, each further press while the modifiers stay down the next
+// older one, wrapping around. Releasing the modifiers pastes the pick with
+// Ctrl+V; Escape ends the cycle without pasting. History entries are array
+// slots, so a step costs the same however long the history is.
+bool ParseHotkey(const char *spec) {
+  char buf[64] = {0};
+  strncpy(buf, spec, sizeof(buf) - 1);
+  hotkeyModifiers = 0;
+  hotkeyKeysym = NoSymbol;
+  for (char *part = strtok(buf, "+"); part; part = strtok(NULL, "+")) {
+    if (strcasecmp(part, "ctrl") == 0 || strcasecmp(part, "control") == 0)
+      hotkeyModifiers |= ControlMask;
+    else if (strcasecmp(part, "alt") == 0)
+      hotkeyModifiers |= Mod1Mask;
+    else if (strcasecmp(part, "shift") == 0)
+      hotkeyModifiers |= ShiftMask;
+    else if (strcasecmp(part, "super") == 0 || strcasecmp(part, "win") == 0)
+      hotkeyModifiers |= Mod4Mask;
+    else if (hotkeyKeysym != NoSymbol || (hotkeyKeysym = XStringToKeysym(part)) == NoSymbol)
+      return false;
+  }
+  // Without a modifier there is nothing to release, so no way to cycle.
+  return hotkeyKeysym != NoSymbol && hotkeyModifiers != 0;
+}
+
+static int HotkeyGrabError(Display *display, XErrorEvent *event) {
+  hotkeyGrabFailed = true;  // BadAccess: another client has the chord
+  return 0;
+}
+
+bool HotkeyInit(const char *spec) {
+  hotkeyKeycode = XKeysymToKeycode(ctrl_display, hotkeyKeysym);
+  if (!hotkeyKeycode) {
+    fprintf(stderr, "Error: No key on this keyboard produces the --hotkey %s\n", spec);
+    return false;
+  }
+  // Grab the chord with and without Caps Lock and Num Lock.
+  unsigned locks[] = {0, LockMask, Mod2Mask, LockMask | Mod2Mask};
+  Window root = DefaultRootWindow(ctrl_display);
+  XErrorHandler previous = XSetErrorHandler(HotkeyGrabError);
+  for (int i = 0; i < 4; i++)
+    XGrabKey(ctrl_display, hotkeyKeycode, hotkeyModifiers | locks[i], root, False, GrabModeAsync, GrabModeAsync);
+  XSync(ctrl_display, False);
+  XSetErrorHandler(previous);
+  if (hotkeyGrabFailed) {
+    fprintf(stderr, "Error: --hotkey %s is already taken by another application.\n", spec);
+    return false;
+  }
+  return true;
+}
+
+static void HotkeyFinish(bool paste) {
+  XUngrabKeyboard(ctrl_display, CurrentTime);
+  int index = hotkeyIndex;
+  hotkeyIndex = -1;
+  if (!paste || index >= tuiLogCount || tuiLogBuffer[index].id != hotkeyEntryId) {
+    XFlush(ctrl_display);
+    return;
+  }
+  RecopyTUIEntry(index);
+  // The paste goes out on another connection: own CLIPBOARD first.
+  ClaimClipboardOwnership();
+  XSync(clipboardDisplay, False);
+  InjectCtrlKey(ctrl_display, XK_v);
+}
+
+static void HotkeyStep() {
+  if (tuiLogCount == 0)
+    return;
+  int index;
+  if (hotkeyIndex < 0 || hotkeyIndex >= tuiLogCount || tuiLogBuffer[hotkeyIndex].id != hotkeyEntryId)
+    index = tuiLogCount - 1;  // new cycle, or the history moved under it
+  else
+    index = hotkeyIndex > 0 ? hotkeyIndex - 1 : tuiLogCount - 1;
+  // Take the whole keyboard so the modifier releases reach us. If another
+  // client holds it, the release would never arrive: copy this entry and end
+  // the cycle here instead of waiting for it.
+  bool grabbed = hotkeyIndex >= 0 ||
+                 XGrabKeyboard(ctrl_display, DefaultRootWindow(ctrl_display), False,
+                               GrabModeAsync, GrabModeAsync, CurrentTime) == GrabSuccess;
+  hotkeyIndex = index;
+  hotkeyEntryId = tuiLogBuffer[index].id;
+  CopyTUIEntryToClipboard(&tuiLogBuffer[index]);
+  TUISelect(index);
+  if (!grabbed)
+    HotkeyFinish(false);
+}
+
+void HandleCtrlEvents(LoopSource *src, uint32_t events) {
+  XEvent event;
+  while (XPending(ctrl_display)) {
+    XNextEvent(ctrl_display, &event);
+    if (event.type == MappingNotify) {
+      XRefreshKeyboardMapping(&event.xmapping);
+    } else if (event.type == KeyPress && hotkeyKeysym != NoSymbol) {
+      if (event.xkey.keycode == hotkeyKeycode)
+        HotkeyStep();
+      else if (hotkeyIndex >= 0 && XLookupKeysym(&event.xkey, 0) == XK_Escape)
+        HotkeyFinish(false);
+    } else if (event.type == KeyRelease && hotkeyIndex >= 0) {
+      // The event carries the state before the release; ask for the current one.
+      Window root, child;
+      int rootX, rootY, winX, winY;
+      unsigned int mask;
+      XQueryPointer(ctrl_display, DefaultRootWindow(ctrl_display), &root, &child,
+                    &rootX, &rootY, &winX, &winY, &mask);
+      if (!(mask & hotkeyModifiers))
+        HotkeyFinish(true);
+    }
+  }
+  if (bTUI && tuiNeedRedraw) {
+    tuiNeedRedraw = false;
+    DrawTUIHeader();
+    RedrawTUILogs();
+  }
+}
+
+bool CaptureHasSinks() {
+  return bShowText || bTUI || szLogFile[0] != '\0' || ringHeader != NULL || szOnCapture[0] != '\0' ||
+         outputMode != OUTPUT_NONE;
+}
+
+void OnCaptureTrigger() {
+  if (captureState != CAPTURE_IDLE) {
+    MetricAdd(&metrics.coalesced, 1);
+    capturePending = true;
+    return;
+  }
+  MetricAdd(&metrics.triggers, 1);
+#if defined(AUTOCOPY_COUNT_MALLOC)
+  captureMallocStart = atomic_load(&mallocCalls);
+#endif
+  traceCaptureId = ++traceCaptureSeq;
+  traceStepStart = TraceBegin();
+  AUTOCOPY_PROBE1(trigger, traceCaptureId);
+  if (bMonitor) {
+    captureState = CAPTURE_DEBOUNCE;
+    clock_gettime(CLOCK_MONOTONIC, &monitorDebounceStart);
+    ArmTimer(srcCaptureTimer.fd, MONITOR_DEBOUNCE_MS);
+    return;
+  }
+  captureState = CAPTURE_PRE_INJECT;
+  ArmTimer(srcCaptureTimer.fd, PRE_INJECT_DELAY_MS);
+}
+
+void FinishCapture() {
+  traceFinishedCapture = traceCaptureId;
+  captureState = CAPTURE_IDLE;
+  ArmTimer(srcCaptureTimer.fd, 0);
+  if (capturePending || monitorPending) {
+    capturePending = false;
+    OnCaptureTrigger();
+  }
+}
+
+void HandleCaptureTimer(LoopSource *src, uint32_t events) {
+  uint64_t expirations;
+  if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+
+  switch (captureState) {
+  case CAPTURE_PRE_INJECT: {
+    TraceSpan("pre_inject_wait", traceStepStart, traceCaptureId);
+    uint64_t injectStart = TraceBegin();
+    send_ctrl_c();
+    TraceSpan("xtest_inject", injectStart, traceCaptureId);
+    traceStepStart = TraceBegin();
+    if (CaptureHasSinks()) {
+      captureState = CAPTURE_POST_INJECT;
+      ArmTimer(src->fd, POST_INJECT_DELAY_MS);
+    } else {
+      FinishCapture();
+    }
+    break;
+  }
+  case CAPTURE_POST_INJECT:
+    TraceSpan("post_inject_wait", traceStepStart, traceCaptureId);
+    traceStepStart = TraceBegin();
+    if (StartClipboardFetch()) {
+      captureState = CAPTURE_FETCHING;
+      ArmTimer(src->fd, FETCH_TIMEOUT_MS);
+    } else {
+      MetricAdd(&metrics.fetchFailures, 1);
+      FinishCapture();
+    }
+    break;
+  case CAPTURE_DEBOUNCE:
+    TraceSpan("owner_debounce", traceStepStart, traceCaptureId);
+    traceStepStart = TraceBegin();
+    monitorFetching = (monitorPending & MONITOR_CLIPBOARD) ? MONITOR_CLIPBOARD : MONITOR_PRIMARY;
+    monitorPending &= ~monitorFetching;
+    if (StartSelectionFetch(monitorFetching == MONITOR_CLIPBOARD ? fetchClipboardAtom : fetchPrimaryAtom)) {
+      captureState = CAPTURE_FETCHING;
+      ArmTimer(src->fd, FETCH_TIMEOUT_MS);
+    } else {
+      MetricAdd(&metrics.fetchFailures, 1);
+      FinishCapture();
+    }
+    break;
+  case CAPTURE_FETCHING:
+    // Owner never answered.
+    MetricAdd(&metrics.fetchTimeouts, 1);
+    TraceSpan("selection_timeout", traceStepStart, traceCaptureId);
+    fetchUsingMultiple = false;
+    if (BlobTransfersActive()) {
+      // Keep the text and finished blobs, drop the stalled ones.
+      AbortBlobTransfers();
+      char *text = fetchPendingText;
+      fetchPendingText = NULL;
+      DeliverFetchResult(text);
+      break;
+    }
+    FinishCapture();
+    break;
+  default:
+    break;
+  }
+}
+
+bool LoopInit() {
+  loopEpollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (loopEpollFd < 0)
+    return false;
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGWINCH);
+  int sigFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  loopWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  return LoopAdd(&srcSignal, sigFd, HandleSignal, NULL) &&
+         LoopAdd(&srcWake, loopWakeFd, HandleWake, NULL) &&
+         LoopAdd(&srcCaptureTimer, timerFd, HandleCaptureTimer, NULL);
+}
+
+void RunEventLoop() {
+  LoopSource *xSources[] = {&srcCtrl, &srcOwner, &srcFetch};
+  struct epoll_event events[16];
+
+  while (!loopShouldExit) {
+    int n = epoll_wait(loopEpollFd, events, 16, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (int i = 0; i < n && !loopShouldExit; i++) {
+      LoopSource *src = (LoopSource *)events[i].data.ptr;
+      if (events[i].events & (EPOLLHUP | EPOLLERR) && src == &srcRecord) {
+        fprintf(stderr, "Error: Lost connection to the X server.\n");
+        loopShouldExit = true;
+        break;
+      }
+      if (src->fd >= 0)
+        src->handler(src, events[i].events);
+    }
+
+    // Round trips made by the handlers may have pulled events into Xlib's
+    // queue without the fd becoming readable again.
+    for (size_t i = 0; i < sizeof(xSources) / sizeof(xSources[0]); i++) {
+      if (xSources[i]->fd >= 0 && XEventsQueued(xSources[i]->display, QueuedAlready) > 0)
+        xSources[i]->handler(xSources[i], EPOLLIN);
+    }
+  }
+}
+
+// Multi-display daemon (--displays, --display-dir). Every display is a
+// DisplaySession holding what single-display mode keeps in globals: two X
+// connections, a capture timer and the click and capture state. Sessions
+// are spread over a few worker threads, each with its own epoll instance,
+// and only the owning worker touches a session after it is attached.
+static DisplaySession *DaemonSessionOf(LoopSource *src);
+
+static void DaemonIOExit(Display *display, void *closure) {
+  // Replaces Xlib's exit(): one server going away must not end the daemon.
+  ((DisplaySession *)closure)->dead = true;
+}
+
+static int DaemonIOError(Display *display) {
+  return 0;  // reported as a detach once the session is torn down
+}
+
+static int DaemonXError(Display *display, XErrorEvent *event) {
+  return 0;  // e.g. a requestor window that vanished; not fatal for everyone
+}
+
+static bool DaemonHasSinks() {
+  return bShowText || szLogFile[0] != '\0' || bNormalizeCopy;
+}
+
+static void DaemonTrigger(DisplaySession *s) {
+  if (s->state != CAPTURE_IDLE) {
+    MetricAdd(&metrics.coalesced, 1);
+    s->pending = true;
+    return;
+  }
+  MetricAdd(&metrics.triggers, 1);
+  AUTOCOPY_PROBE1(trigger, (uintptr_t)s);
+  s->state = CAPTURE_PRE_INJECT;
+  ArmTimer(s->srcTimer.fd, PRE_INJECT_DELAY_MS);
+}
+
+static void DaemonFinish(DisplaySession *s) {
+  s->state = CAPTURE_IDLE;
+  ArmTimer(s->srcTimer.fd, 0);
+  if (s->pending) {
+    s->pending = false;
+    DaemonTrigger(s);
+  }
+}
+
+// A startup display is recording, or gave up before it got there.
+static void DaemonSessionArmed(DisplaySession *s) {
+  if (s->armPending) {
+    s->armPending = false;
+    if (atomic_fetch_sub(&readyPending, 1) == 1)
+      NotifyReady();
+  }
+}
+
+static void DaemonRecordCallback(XPointer closure, XRecordInterceptData *data) {
+  DisplaySession *s = (DisplaySession *)closure;
+  if (data->category == XRecordStartOfData)
+    DaemonSessionArmed(s);
+  if (data->category == XRecordFromServer) {
+    unsigned char *xdata = (unsigned char *)data->data;
+    if (xdata[0] == ButtonRelease && xdata[1] == 1 && ClassifyClick(&s->clicks, s->ctrl, data->server_time))
+      DaemonTrigger(s);
+  }
+  XRecordFreeData(data);
+}
+
+// Takes CLIPBOARD on this display for --normalize-copy.
+static void DaemonOwnClipboard(DisplaySession *s, const char *text) {
+  free(s->owned);
+  s->owned = strdup(text);
+  if (s->owned) {
+    XSetSelectionOwner(s->ctrl, s->atoms[DAEMON_ATOM_CLIPBOARD], s->window, CurrentTime);
+    XFlush(s->ctrl);
+  }
+}
+
+static void DaemonServe(DisplaySession *s, XSelectionRequestEvent *req) {
+  XEvent response = {0};
+  response.xselection.type = SelectionNotify;
+  response.xselection.requestor = req->requestor;
+  response.xselection.selection = req->selection;
+  response.xselection.target = req->target;
+  response.xselection.time = req->time;
+  response.xselection.property = None;
+
+  if (req->property == None)
+    req->property = req->target;  // obsolete clients
+  size_t len = s->owned ? strlen(s->owned) : 0;
+  if (req->target == s->atoms[DAEMON_ATOM_TARGETS]) {
+    Atom targets[] = {s->atoms[DAEMON_ATOM_TARGETS], s->atoms[DAEMON_ATOM_UTF8], s->atoms[DAEMON_ATOM_STRING]};
+    XChangeProperty(s->ctrl, req->requestor, req->property, s->atoms[DAEMON_ATOM_ATOM], 32,
+                    PropModeReplace, (unsigned char *)targets, 3);
+    response.xselection.property = req->property;
+  } else if ((req->target == s->atoms[DAEMON_ATOM_UTF8] || req->target == s->atoms[DAEMON_ATOM_STRING]) &&
+             s->owned && len <= OWNER_CHUNK_SIZE) {
+    XChangeProperty(s->ctrl, req->requestor, req->property, s->atoms[DAEMON_ATOM_STRING], 8,
+                    PropModeReplace, (unsigned char *)s->owned, (int)len);
+    response.xselection.property = req->property;
+    MetricAdd(&metrics.ownerRequests, 1);
+    MetricAdd(&metrics.ownerBytes, len);
+    AUTOCOPY_PROBE2(owner_serve, req->requestor, len);
+  } else {
+    MetricAdd(&metrics.ownerRefused, 1);
+  }
+  XSendEvent(s->ctrl, req->requestor, False, 0, &response);
+  XFlush(s->ctrl);
+}
+
+// Same order as PrintCapture, minus the single-display sinks (TUI, ring).
+static void DaemonDeliver(DisplaySession *s, char *text) {
+  size_t length = text ? strlen(text) : 0;
+  AUTOCOPY_PROBE2(fetch_end, (uintptr_t)s, length);
+  if (!text) {
+    MetricAdd(&metrics.fetchFailures, 1);
+    DaemonFinish(s);
+    return;
+  }
+  if (normalizeFlags && NormalizeText(text, length) && bNormalizeCopy)
+    DaemonOwnClipboard(s, text);
+  DaemonFinish(s);
+
+  text = ApplyFilters(text);
+  if (!text)
+    return;
+  MetricAdd(&metrics.captures, 1);
+  MetricAdd(&metrics.captureBytes, strlen(text));
+  if (szLogFile[0] != '\0')
+    WriteToLogFile(s->logPath, s->logTag, text);
+  if (bShowText && !bBatch) {
+    printf("[Clipboard %s]: %s\n", s->name, text);
+    fflush(stdout);
+  }
+  FreeCaptureText(text);
+}
+
+void HandleDaemonCtrl(LoopSource *src, uint32_t events) {
+  DisplaySession *s = DaemonSessionOf(src);
+  XEvent event;
+  while (!s->dead && XPending(s->ctrl)) {
+    XNextEvent(s->ctrl, &event);
+    if (event.type == SelectionNotify && s->state == CAPTURE_FETCHING) {
+      DaemonDeliver(s, ReadSelectionText(s->ctrl, s->window, event.xselection.property));
+    } else if (event.type == SelectionRequest) {
+      DaemonServe(s, &event.xselectionrequest);
+    } else if (event.type == SelectionClear) {
+      free(s->owned);
+      s->owned = NULL;
+    } else if (event.type == MappingNotify) {
+      XRefreshKeyboardMapping(&event.xmapping);
+    }
+  }
+}
+
+// Round trips on the control connection can leave its events in Xlib's
+// queue without the fd becoming readable again.
+static void DaemonDrainCtrl(DisplaySession *s) {
+  if (!s->dead && XEventsQueued(s->ctrl, QueuedAlready) > 0)
+    HandleDaemonCtrl(&s->srcCtrl, EPOLLIN);
+}
+
+void HandleDaemonRecord(LoopSource *src, uint32_t events) {
+  DisplaySession *s = DaemonSessionOf(src);
+  XRecordProcessReplies(s->record);
+  DaemonDrainCtrl(s);
+}
+
+void HandleDaemonTimer(LoopSource *src, uint32_t events) {
+  DisplaySession *s = DaemonSessionOf(src);
+  uint64_t expirations;
+  if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+
+  switch (s->state) {
+  case CAPTURE_PRE_INJECT:
+    InjectCtrlC(s->ctrl);
+    if (DaemonHasSinks()) {
+      s->state = CAPTURE_POST_INJECT;
+      ArmTimer(src->fd, POST_INJECT_DELAY_MS);
+    } else {
+      DaemonFinish(s);
+    }
+    break;
+  case CAPTURE_POST_INJECT: {
+    Atom clipboard = s->atoms[DAEMON_ATOM_CLIPBOARD], utf8 = s->atoms[DAEMON_ATOM_UTF8];
+    if (XGetSelectionOwner(s->ctrl, clipboard) != None) {
+      AUTOCOPY_PROBE1(fetch_start, (uintptr_t)s);
+      XConvertSelection(s->ctrl, clipboard, utf8, utf8, s->window, CurrentTime);
+      XFlush(s->ctrl);
+      s->state = CAPTURE_FETCHING;
+      ArmTimer(src->fd, FETCH_TIMEOUT_MS);
+    } else {
+      MetricAdd(&metrics.fetchFailures, 1);
+      DaemonFinish(s);
+    }
+    break;
+  }
+  case CAPTURE_FETCHING:
+    MetricAdd(&metrics.fetchTimeouts, 1);
+    DaemonFinish(s);
+    break;
+  default:
+    break;
+  }
+  DaemonDrainCtrl(s);
+}
+
+static DisplaySession *DaemonSessionOf(LoopSource *src) {
+  if (src->handler == HandleDaemonRecord)
+    return (DisplaySession *)((char *)src - offsetof(DisplaySession, srcRecord));
+  if (src->handler == HandleDaemonCtrl)
+    return (DisplaySession *)((char *)src - offsetof(DisplaySession, srcCtrl));
+  return (DisplaySession *)((char *)src - offsetof(DisplaySession, srcTimer));
+}
+
+// Runs on the session's worker (or on the main thread before it was handed
+// over). A dead connection is not closed through Xlib's normal path.
+static void DaemonDetach(DisplaySession *s) {
+  DaemonSessionArmed(s);
+  pthread_mutex_lock(&daemonMutex);
+  for (DisplaySession **p = &daemonSessions; *p; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      daemonSessionCount--;
+      if (s->worker)
+        s->worker->sessionCount--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&daemonMutex);
+
+  LoopSource *sources[] = {&s->srcRecord, &s->srcCtrl, &s->srcTimer};
+  for (int i = 0; i < 3; i++) {
+    if (sources[i]->fd >= 0 && s->worker)
+      epoll_ctl(s->worker->epollFd, EPOLL_CTL_DEL, sources[i]->fd, NULL);
+  }
+  if (s->srcTimer.fd >= 0)
+    close(s->srcTimer.fd);
+  if (s->record)
+    XCloseDisplay(s->record);
+  if (s->ctrl)
+    XCloseDisplay(s->ctrl);
+  if (s->worker && !bBatch) {
+    printf("Display %s detached%s\n", s->name, s->dead ? " (connection closed)" : "");
+    fflush(stdout);
+  }
+  free(s->owned);
+  free(s);
+}
+
+static bool DaemonAttached(const char *name) {
+  bool found = false;
+  pthread_mutex_lock(&daemonMutex);
+  for (DisplaySession *s = daemonSessions; s && !found; s = s->next)
+    found = (strcmp(s->name, name) == 0);
+  pthread_mutex_unlock(&daemonMutex);
+  return found;
+}
+
+// Opens a display and hands it to the least loaded worker. Main thread only.
+bool DaemonAttach(const char *name, bool verbose) {
+  if (DaemonAttached(name))
+    return true;
+  DisplaySession *s = calloc(1, sizeof(DisplaySession));
+  if (!s)
+    return false;
+  strncpy(s->name, name, sizeof(s->name) - 1);
+  s->srcRecord.fd = s->srcCtrl.fd = s->srcTimer.fd = -1;
+
+  const char *error = NULL;
+  int major, minor;
+  s->record = XOpenDisplay(name);
+  s->ctrl = s->record ? XOpenDisplay(name) : NULL;
+  if (!s->ctrl) {
+    error = "cannot open display";
+  } else {
+    XSetIOErrorExitHandler(s->record, DaemonIOExit, s);
+    XSetIOErrorExitHandler(s->ctrl, DaemonIOExit, s);
+    if (!XRecordQueryVersion(s->ctrl, &major, &minor))
+      error = "RECORD extension missing";
+    else if (!XTestQueryExtension(s->ctrl, &major, &minor, &major, &minor))
+      error = "XTEST extension missing";
+  }
+
+  if (!error) {
+    static char *atomNames[DAEMON_ATOM_COUNT] = {"CLIPBOARD", "UTF8_STRING", "STRING", "TARGETS", "ATOM"};
+    XInternAtoms(s->ctrl, atomNames, DAEMON_ATOM_COUNT, False, s->atoms);
+    s->window = XCreateSimpleWindow(s->ctrl, DefaultRootWindow(s->ctrl), 0, 0, 1, 1, 0, 0, 0);
+
+    XRecordRange *range = XRecordAllocRange();
+    range->device_events.first = ButtonRelease;
+    range->device_events.last = ButtonRelease;
+    XRecordClientSpec spec = XRecordAllClients;
+    s->context = XRecordCreateContext(s->record, 0, &spec, 1, &range, 1);
+    XFree(range);
+    if (!s->context || !XRecordEnableContextAsync(s->record, s->context, DaemonRecordCallback, (XPointer)s))
+      error = "cannot enable XRecord context";
+    s->srcTimer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!error && s->srcTimer.fd < 0)
+      error = strerror(errno);
+  }
+  if (error || s->dead) {
+    if (verbose)
+      fprintf(stderr, "Warning: Display %s not attached: %s\n", name, error ? error : "connection closed");
+    DaemonDetach(s);
+    return false;
+  }
+
+  // Log lines carry the display unless --log names a file per display.
+  if (strstr(szLogFile, "%s")) {
+    char file[64];
+    snprintf(file, sizeof(file), "%s", name[0] == ':' ? name + 1 : name);
+    for (char *p = file; *p; p++) {
+      if (*p == '/' || *p == ':')
+        *p = '_';
+    }
+    snprintf(s->logPath, sizeof(s->logPath), szLogFile, file);
+  } else {
+    snprintf(s->logPath, sizeof(s->logPath), "%s", szLogFile);
+    snprintf(s->logTag, sizeof(s->logTag), "[%s] ", name);
+  }
+  s->srcRecord.handler = HandleDaemonRecord;
+  s->srcRecord.display = s->record;
+  s->srcCtrl.handler = HandleDaemonCtrl;
+  s->srcCtrl.display = s->ctrl;
+  s->srcTimer.handler = HandleDaemonTimer;
+  XFlush(s->record);
+  XFlush(s->ctrl);
+  if (daemonStarting) {
+    s->armPending = true;
+    atomic_fetch_add(&readyPending, 1);
+  }
+
+  pthread_mutex_lock(&daemonMutex);
+  DaemonWorker *worker = &daemonWorkers[0];
+  for (int i = 1; i < daemonWorkerCount; i++) {
+    if (daemonWorkers[i].sessionCount < worker->sessionCount)
+      worker = &daemonWorkers[i];
   }
+  s->worker = worker;
+  worker->sessionCount++;
+  s->next = daemonSessions;
+  daemonSessions = s;
+  daemonSessionCount++;
+  // From here on the worker owns the session.
+  s->srcRecord.fd = ConnectionNumber(s->record);
+  s->srcCtrl.fd = ConnectionNumber(s->ctrl);
+  LoopSource *sources[] = {&s->srcRecord, &s->srcCtrl, &s->srcTimer};
+  for (int i = 0; i < 3; i++) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = sources[i];
+    epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, sources[i]->fd, &ev);
+  }
+  pthread_mutex_unlock(&daemonMutex);
 
-  tuiSelectedLine = tuiLogCount - 1;
-
-  DrawTUIHeader();
-  RedrawTUILogs();
+  if (!bBatch) {
+    printf("Display %s attached\n", name);
+    fflush(stdout);
+  }
+  return true;
 }
 
-void *keyboard_input_thread(void *arg) {
-  struct termios newt;
-  tcgetattr(STDIN_FILENO, &g_original_termios);
-  g_termios_saved = true;
-  newt = g_original_termios;
-  newt.c_lflag &= ~(ICANON | ECHO);
-  tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-
-  // Get keycodes for Ctrl keys
-  static KeyCode ctrl_l_code = 0, ctrl_r_code = 0;
-  static bool ctrl_key_codes_initialized = false;
+static void *DaemonWorkerMain(void *arg) {
+  DaemonWorker *worker = (DaemonWorker *)arg;
+  struct epoll_event events[32];
+  DisplaySession *dead[32];
 
-  if (!ctrl_key_codes_initialized && ctrl_display) {
-    ctrl_l_code = XKeysymToKeycode(ctrl_display, XK_Control_L);
-    ctrl_r_code = XKeysymToKeycode(ctrl_display, XK_Control_R);
-    ctrl_key_codes_initialized = true;
-  }
-
-  int ch;
-  while (1) {
-    ch = getchar();
-    if (ch == 27) {
-      int ch2 = getchar();
-      int ch3 = getchar();
-      if (ch2 == 91) {
-        if (ch3 == 65) {
-          if (tuiSelectedLine > 0) {
-            tuiSelectedLine--;
-            if (tuiSelectedLine < tuiScrollOffset) {
-              tuiScrollOffset = tuiSelectedLine;
-            }
-          }
-          DrawTUIHeader();
-          RedrawTUILogs();
-        } else if (ch3 == 66) {
-          int logAreaHeight = terminalHeight - 3;
-          if (tuiSelectedLine < tuiLogCount - 1) {
-            tuiSelectedLine++;
-            if (tuiSelectedLine >= tuiScrollOffset + logAreaHeight) {
-              tuiScrollOffset = tuiSelectedLine - logAreaHeight + 1;
-            }
-          }
-          DrawTUIHeader();
-          RedrawTUILogs();
-        }
-      }
-    } else if (ch == 10 || ch == 13) {
-      // Check if Ctrl is pressed using XQueryKeymap
-      bool ctrl_pressed = false;
-      if (ctrl_display && (ctrl_l_code || ctrl_r_code)) {
-        char keys_return[32];
-        XQueryKeymap(ctrl_display, keys_return);
-        if (ctrl_l_code && (keys_return[ctrl_l_code >> 3] & (1 << (ctrl_l_code & 7)))) {
-          ctrl_pressed = true;
-        }
-        if (ctrl_r_code && (keys_return[ctrl_r_code >> 3] & (1 << (ctrl_r_code & 7)))) {
-          ctrl_pressed = true;
-        }
+  while (!atomic_load(&daemonExit)) {
+    int n = epoll_wait(worker->epollFd, events, 32, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    int deadCount = 0;
+    for (int i = 0; i < n; i++) {
+      LoopSource *src = (LoopSource *)events[i].data.ptr;
+      if (!src) {
+        uint64_t count;
+        if (read(worker->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          break;
+        continue;
       }
-      
-      if (ctrl_pressed && tuiSelectedLine >= 0 && tuiSelectedLine < tuiLogCount && tuiLogBuffer[tuiSelectedLine]) {
-        CopyToClipboard(tuiLogBuffer[tuiSelectedLine]);
+      DisplaySession *s = DaemonSessionOf(src);
+      if (s->detaching)
+        continue;
+      if (events[i].events & (EPOLLHUP | EPOLLERR))
+        s->dead = true;
+      else
+        src->handler(src, events[i].events);
+      if (s->dead) {
+        s->detaching = true;
+        dead[deadCount++] = s;
       }
-    } else if (ch == 'u' || ch == 'U') {
-      tuiScrollOffset--;
-      DrawTUIHeader();
-      RedrawTUILogs();
-    } else if (ch == 'd' || ch == 'D') {
-      tuiScrollOffset++;
-      DrawTUIHeader();
-      RedrawTUILogs();
     }
+    // Torn down after the batch, which may still name their sources.
+    for (int i = 0; i < deadCount; i++)
+      DaemonDetach(dead[i]);
   }
 
-  tcsetattr(STDIN_FILENO, TCSANOW, &g_original_termios);
+  for (;;) {
+    DisplaySession *s = NULL;
+    pthread_mutex_lock(&daemonMutex);
+    for (s = daemonSessions; s && s->worker != worker; s = s->next)
+      ;
+    pthread_mutex_unlock(&daemonMutex);
+    if (!s)
+      break;
+    DaemonDetach(s);
+  }
   return NULL;
 }
 
-
-void WriteToLog(const char *text) {
-  if (szLogFile[0] == '\0')
+// --display-dir: every X<n> socket in the directory is display :<n>.
+static void DaemonScanDir() {
+  DIR *dir = opendir(szDaemonDir);
+  if (!dir)
     return;
-  FILE *f = fopen(szLogFile, "a");
-  if (f) {
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    fprintf(f, "[%04d-%02d-%02d %02d:%02d:%02d] %s\n",
-            t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-            t->tm_hour, t->tm_min, t->tm_sec, text);
-    fclose(f);
+  bool failed = false;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const char *p = entry->d_name;
+    if (p[0] != 'X' || !p[1] || strspn(p + 1, "0123456789") != strlen(p + 1))
+      continue;
+    char name[32];
+    snprintf(name, sizeof(name), ":%s", p + 1);
+    if (!DaemonAttach(name, false))
+      failed = true;  // server still starting, or not ours to watch
   }
+  closedir(dir);
+  if (failed)
+    ArmTimer(srcDaemonRetry.fd, DAEMON_RETRY_MS);
 }
 
-void send_ctrl_c() {
-  if (!ctrl_display)
-    return;
-
-  // Get keycodes
-  KeyCode control = XKeysymToKeycode(ctrl_display, XK_Control_L);
-  KeyCode c = XKeysymToKeycode(ctrl_display, XK_c);
-
-  // Press Ctrl
-  XTestFakeKeyEvent(ctrl_display, control, True, CurrentTime);
-  // Press C
-  XTestFakeKeyEvent(ctrl_display, c, True, CurrentTime);
-  // Release C
-  XTestFakeKeyEvent(ctrl_display, c, False, CurrentTime);
-  // Release Ctrl
-  XTestFakeKeyEvent(ctrl_display, control, False, CurrentTime);
-
-  XFlush(ctrl_display);
+void HandleDaemonDir(LoopSource *src, uint32_t events) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (read(src->fd, buf, sizeof(buf)) > 0)
+    ;
+  DaemonScanDir();
 }
 
-char *GetClipboardText() {
-  Display *disp = XOpenDisplay(NULL);
-  if (!disp)
-    return NULL;
+void HandleDaemonRetry(LoopSource *src, uint32_t events) {
+  uint64_t expirations;
+  if (read(src->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+    DaemonScanDir();
+}
 
-  Atom clipboard = XInternAtom(disp, "CLIPBOARD", False);
-  Atom utf8 = XInternAtom(disp, "UTF8_STRING", False);
-  Atom string_atom = XInternAtom(disp, "STRING", False);
-  XEvent event;
+// Daemon main loop: the main thread keeps signals, metrics and the display
+// directory; captures run on the workers.
+int RunDaemon() {
+  XInitThreads();
+  XSetErrorHandler(DaemonXError);
+  XSetIOErrorHandler(DaemonIOError);
 
-  Window owner = XGetSelectionOwner(disp, clipboard);
-  if (owner == None) {
-    XCloseDisplay(disp);
-    return NULL;
+  if (!LoopInit()) {
+    fprintf(stderr, "Error: Could not set up the event loop.\n");
+    return 1;
+  }
+  for (int i = 0; i < daemonWorkerCount; i++) {
+    DaemonWorker *worker = &daemonWorkers[i];
+    worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (worker->epollFd < 0 || worker->wakeFd < 0 ||
+        epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &ev) != 0 ||
+        pthread_create(&worker->thread, NULL, DaemonWorkerMain, worker) != 0) {
+      fprintf(stderr, "Error: Could not start daemon worker threads.\n");
+      return 1;
+    }
   }
 
-  Window win = XCreateSimpleWindow(disp, DefaultRootWindow(disp), 0, 0, 1, 1, 0, 0, 0);
-
-  XSelectInput(disp, win, PropertyChangeMask);
+  // Ready once every display attached now is recording; the extra count
+  // keeps workers from signalling before the startup attaches are done.
+  atomic_store(&readyPending, 1);
+  daemonStarting = true;
+  if (szDaemonDisplays[0] != '\0') {
+    char list[sizeof(szDaemonDisplays)];
+    memcpy(list, szDaemonDisplays, sizeof(list));
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ","))
+      DaemonAttach(name, true);
+  }
+  if (szDaemonDir[0] != '\0') {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, szDaemonDir, IN_CREATE | IN_MOVED_TO) < 0) {
+      fprintf(stderr, "Error: Cannot watch %s: %s\n", szDaemonDir, strerror(errno));
+      loopShouldExit = true;
+    } else {
+      LoopAdd(&srcDaemonDir, fd, HandleDaemonDir, NULL);
+      LoopAdd(&srcDaemonRetry, timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), HandleDaemonRetry, NULL);
+      DaemonScanDir();
+    }
+  } else if (daemonSessionCount == 0) {
+    fprintf(stderr, "Error: No display could be attached.\n");
+    loopShouldExit = true;
+  }
 
-  XConvertSelection(disp, clipboard, utf8, utf8, win, CurrentTime);
-  XFlush(disp);
+  if (metricsListenFd >= 0) {
+    for (int i = 0; i < MAX_METRICS_CLIENTS; i++)
+      metricsClients[i].src.fd = -1;
+    LoopAdd(&srcMetrics, metricsListenFd, HandleMetricsAccept, NULL);
+  }
+  daemonStarting = false;
+  if (!loopShouldExit && !bBatch) {
+    printf("autocopy linux daemon started: %d session(s), %d worker thread(s). Press Ctrl+C to exit.\n",
+           daemonSessionCount, daemonWorkerCount);
+    fflush(stdout);
+  }
+  if (!loopShouldExit && atomic_fetch_sub(&readyPending, 1) == 1)
+    NotifyReady();
+  int exitCode = loopShouldExit ? 1 : 0;
+  if (!loopShouldExit)
+    RunEventLoop();
 
-  char *result = NULL;
-  for (int i = 0; i < 20; i++) {
-    if (XCheckTypedEvent(disp, SelectionNotify, &event)) {
-      XSelectionEvent *se = (XSelectionEvent *)&event.xselection;
-      if (se->property != None) {
-        Atom type;
-        int format;
-        unsigned long nitems, bytes_after;
-        unsigned char *prop;
-
-        if (XGetWindowProperty(disp, win, se->property,
-                               0, (1024 * 1024) / 4, False, AnyPropertyType,
-                               &type, &format, &nitems, &bytes_after, &prop) == Success) {
-          if (prop && nitems > 0) {
-            if (type == string_atom || type == utf8 || format == 8) {
-              result = strdup((char *)prop);
-            }
-            XFree(prop);
-          }
-          XDeleteProperty(disp, win, se->property);
-        }
-      }
-      break;
+  atomic_store(&daemonExit, true);
+  for (int i = 0; i < daemonWorkerCount; i++) {
+    uint64_t one = 1;
+    if (write(daemonWorkers[i].wakeFd, &one, sizeof(one)) < 0) {
+      // A wakeup is already pending.
     }
-    usleep(50000);
+    pthread_join(daemonWorkers[i].thread, NULL);
+    close(daemonWorkers[i].wakeFd);
+    close(daemonWorkers[i].epollFd);
   }
+  return exitCode;
+}
 
-  XDestroyWindow(disp, win);
-  XCloseDisplay(disp);
+// Clipboard transfer benchmarks (--bench). Each configuration runs in its own
+// process so peak RSS is per configuration; the stand-in owner or requestor
+// is a further child with its own X connection. Meant to run under Xvfb, see
+// bench_linux.sh.
+char szBenchOutput[MAX_PATH] = {0};
 
-  return result;
-}
+typedef enum { BENCH_OWNER_FAST, BENCH_OWNER_SLOW, BENCH_OWNER_INCR } BenchOwnerBehavior;
+// Further configurations after the three read ones
+#define BENCH_SERVE (BENCH_OWNER_INCR + 1)
+#define BENCH_INPUT_RECORD (BENCH_OWNER_INCR + 2)
+#define BENCH_INPUT_XI2 (BENCH_OWNER_INCR + 3)
 
-void CopyToClipboard(const char *text) {
-  if (!text)
-    return;
+#define BENCH_SLOW_OWNER_MS 20
+#define BENCH_INCR_CHUNK (256 * 1024)
+#define BENCH_EVENT_TIMEOUT_MS 5000
+#define BENCH_INPUT_KEYS 20000    // typed keys; every 10th also clicks, every 100th holds Ctrl
+#define BENCH_INPUT_IDLE_MS 500   // intake is done once events stop for this long
 
-  pthread_mutex_lock(&clipboardMutex);
-  free(copyClipboardText);
-  copyClipboardText = strdup(text);
-  pthread_mutex_unlock(&clipboardMutex);
+typedef struct {
+  double ms;
+  uint64_t bytes;
+} BenchSample;
 
-  if (!clipboardDisplay)
-    return;
+static const char *benchOwnerNames[] = {"fast", "slow", "incr", "serve", "input_record", "input_xi2"};
+static unsigned long benchXErrors = 0;
 
-  Atom clipboard = XInternAtom(clipboardDisplay, "CLIPBOARD", False);
-  XSetSelectionOwner(clipboardDisplay, clipboard, clipboardWindow, CurrentTime);
-  XFlush(clipboardDisplay);
+static int BenchXError(Display *display, XErrorEvent *event) {
+  benchXErrors++;
+  return 0;
 }
 
-void *clipboard_handler_thread(void *arg) {
-  clipboardDisplay = XOpenDisplay(NULL);
-  if (!clipboardDisplay)
+static char *BenchPayload(size_t size) {
+  char *payload = malloc(size + 1);
+  if (!payload)
     return NULL;
+  for (size_t i = 0; i < size; i++)
+    payload[i] = (char)('a' + i % 26);
+  payload[size] = '\0';
+  return payload;
+}
 
-  Atom utf8 = XInternAtom(clipboardDisplay, "UTF8_STRING", False);
-  Atom string_atom = XInternAtom(clipboardDisplay, "STRING", False);
-  Atom targets_atom = XInternAtom(clipboardDisplay, "TARGETS", False);
-  Atom atom_atom = XInternAtom(clipboardDisplay, "ATOM", False);
+static double BenchElapsedMs(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
 
-  clipboardWindow = XCreateSimpleWindow(clipboardDisplay, DefaultRootWindow(clipboardDisplay),
-                                        0, 0, 10, 10, 0, 0, 0);
+static bool BenchNextEvent(Display *display, XEvent *event, int timeoutMs) {
+  while (!XPending(display)) {
+    struct pollfd pfd = {ConnectionNumber(display), POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) <= 0)
+      return false;
+  }
+  XNextEvent(display, event);
+  return true;
+}
 
-  XSelectInput(clipboardDisplay, clipboardWindow, PropertyChangeMask);
-  XFlush(clipboardDisplay);
+// Stand-in clipboard owner. Answers like common toolkits do: in one property
+// when the payload fits a request, otherwise (or always, for BENCH_OWNER_INCR)
+// with the INCR protocol.
+static void BenchOwnerProcess(const char *payload, size_t size, BenchOwnerBehavior behavior, int readyFd) {
+  Display *display = XOpenDisplay(NULL);
+  if (!display)
+    _exit(1);
+  XSetErrorHandler(BenchXError);
+  Atom clipboard = XInternAtom(display, "CLIPBOARD", False);
+  Atom utf8 = XInternAtom(display, "UTF8_STRING", False);
+  Atom targets = XInternAtom(display, "TARGETS", False);
+  Atom incr = XInternAtom(display, "INCR", False);
+  Window window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0, 1, 1, 0, 0, 0);
+  XSetSelectionOwner(display, clipboard, window, CurrentTime);
+  XSync(display, False);
+  if (write(readyFd, "R", 1) != 1)
+    _exit(1);
+  close(readyFd);
 
-  XEvent event;
-  while (!clipboardShouldExit) {
-    if (XCheckTypedEvent(clipboardDisplay, SelectionRequest, &event)) {
-      if (event.type == SelectionRequest) {
-        XSelectionRequestEvent *req = (XSelectionRequestEvent *)&event;
-        XEvent response;
-        response.xselection.type = SelectionNotify;
-        response.xselection.requestor = req->requestor;
-        response.xselection.selection = req->selection;
-        response.xselection.target = req->target;
-        response.xselection.time = req->time;
-
-        pthread_mutex_lock(&clipboardMutex);
-        if (req->target == targets_atom) {
-          Atom supported_targets[] = {utf8, string_atom};
-          XChangeProperty(clipboardDisplay, req->requestor, req->property,
-                         atom_atom, 32, PropModeReplace,
-                         (unsigned char *)supported_targets, 2);
-          response.xselection.property = req->property;
-        } else if (req->target == utf8 || req->target == string_atom) {
-          if (copyClipboardText) {
-            XChangeProperty(clipboardDisplay, req->requestor, req->property,
-                           string_atom, 8, PropModeReplace,
-                           (unsigned char *)copyClipboardText,
-                           strlen(copyClipboardText));
-            response.xselection.property = req->property;
-          } else {
-            response.xselection.property = None;
-          }
-        } else {
-          response.xselection.property = None;
-        }
-        pthread_mutex_unlock(&clipboardMutex);
+  long maxRequest = XExtendedMaxRequestSize(display);
+  if (maxRequest == 0)
+    maxRequest = XMaxRequestSize(display);
+  size_t maxInline = (size_t)maxRequest * 4 - 1024;
 
-        XSendEvent(clipboardDisplay, req->requestor, False, 0, &response);
-        XFlush(clipboardDisplay);
+  Window incrWindow = None;
+  Atom incrProperty = None;
+  size_t incrOffset = 0;
+  XEvent event;
+  for (;;) {
+    XNextEvent(display, &event);
+    if (event.type == SelectionRequest) {
+      XSelectionRequestEvent *req = &event.xselectionrequest;
+      if (behavior == BENCH_OWNER_SLOW)
+        usleep(BENCH_SLOW_OWNER_MS * 1000);
+      XEvent response = {0};
+      response.xselection.type = SelectionNotify;
+      response.xselection.requestor = req->requestor;
+      response.xselection.selection = req->selection;
+      response.xselection.target = req->target;
+      response.xselection.time = req->time;
+      response.xselection.property = req->property;
+      if (req->target == targets) {
+        Atom supported[] = {targets, utf8};
+        XChangeProperty(display, req->requestor, req->property, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char *)supported, 2);
+      } else if (req->target == utf8 && (behavior == BENCH_OWNER_INCR || size > maxInline)) {
+        long total = (long)size;
+        XSelectInput(display, req->requestor, PropertyChangeMask);
+        XChangeProperty(display, req->requestor, req->property, incr, 32,
+                        PropModeReplace, (unsigned char *)&total, 1);
+        incrWindow = req->requestor;
+        incrProperty = req->property;
+        incrOffset = 0;
+      } else if (req->target == utf8) {
+        XChangeProperty(display, req->requestor, req->property, utf8, 8,
+                        PropModeReplace, (const unsigned char *)payload, (int)size);
+      } else {
+        response.xselection.property = None;
+      }
+      XSendEvent(display, req->requestor, False, 0, &response);
+      XFlush(display);
+    } else if (event.type == PropertyNotify && event.xproperty.state == PropertyDelete &&
+               event.xproperty.window == incrWindow && event.xproperty.atom == incrProperty) {
+      // Requestor consumed the previous chunk; a zero-length chunk ends the transfer.
+      size_t chunk = size - incrOffset < BENCH_INCR_CHUNK ? size - incrOffset : BENCH_INCR_CHUNK;
+      XChangeProperty(display, incrWindow, incrProperty, utf8, 8, PropModeReplace,
+                      (const unsigned char *)payload + incrOffset, (int)chunk);
+      incrOffset += chunk;
+      if (chunk == 0) {
+        XSelectInput(display, incrWindow, NoEventMask);
+        incrWindow = None;
       }
+      XFlush(display);
     }
-    usleep(10000);
   }
+}
 
-  if (clipboardWindow != None) {
-    XDestroyWindow(clipboardDisplay, clipboardWindow);
-    clipboardWindow = None;
+// Reads a property in 4 MB slices, deleting it once fully read.
+static uint64_t BenchReadProperty(Display *display, Window window, Atom property, Atom *typeOut) {
+  uint64_t total = 0;
+  long offset = 0;
+  for (;;) {
+    Atom type;
+    int format;
+    unsigned long nitems, bytesAfter;
+    unsigned char *data = NULL;
+    if (XGetWindowProperty(display, window, property, offset, 1024 * 1024, True, AnyPropertyType,
+                           &type, &format, &nitems, &bytesAfter, &data) != Success)
+      return total;
+    if (typeOut)
+      *typeOut = type;
+    uint64_t bytes = (uint64_t)nitems * (format == 32 ? sizeof(long) : (unsigned)format / 8);
+    total += bytes;
+    offset += (long)(bytes / 4);
+    if (data)
+      XFree(data);
+    if (bytesAfter == 0)
+      return total;
   }
-  XCloseDisplay(clipboardDisplay);
-  clipboardDisplay = NULL;
-
-  return NULL;
 }
 
-void PrintClipboardText() {
-  char *text = GetClipboardText();
-  if (text) {
-    WriteToLog(text);
+// Stand-in requestor: a plain client that converts CLIPBOARD and reads the
+// whole text, INCR included, reporting one sample per transfer.
+static void BenchRequestorProcess(int iterations, int resultFd) {
+  Display *display = XOpenDisplay(NULL);
+  if (!display)
+    _exit(1);
+  XSetErrorHandler(BenchXError);
+  Atom clipboard = XInternAtom(display, "CLIPBOARD", False);
+  Atom utf8 = XInternAtom(display, "UTF8_STRING", False);
+  Atom incr = XInternAtom(display, "INCR", False);
+  Atom property = XInternAtom(display, "AUTOCOPY_BENCH", False);
+  Window window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0, 1, 1, 0, 0, 0);
+  XSelectInput(display, window, PropertyChangeMask);
 
-    if (bTUI) {
-      nTotalTexts++;
-      nTotalChars += (long long)strlen(text);
-      AddTUILogMessage(text);
-    } else if (bShowText && !bBatch) {
-      printf("[Clipboard]: %s\n", text);
-    }
+  for (int i = 0; i < iterations; i++) {
+    BenchSample sample = {0, 0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    XConvertSelection(display, clipboard, utf8, property, window, CurrentTime);
+    XFlush(display);
 
-    free(text);
+    XEvent event;
+    bool notified = false;
+    while (!notified && BenchNextEvent(display, &event, BENCH_EVENT_TIMEOUT_MS))
+      notified = (event.type == SelectionNotify);
+    if (notified && event.xselection.property != None) {
+      Atom type = None;
+      sample.bytes = BenchReadProperty(display, window, property, &type);
+      if (type == incr) {
+        sample.bytes = 0;
+        while (BenchNextEvent(display, &event, BENCH_EVENT_TIMEOUT_MS)) {
+          if (event.type != PropertyNotify || event.xproperty.state != PropertyNewValue ||
+              event.xproperty.atom != property)
+            continue;
+          uint64_t chunk = BenchReadProperty(display, window, property, NULL);
+          if (chunk == 0)
+            break;
+          sample.bytes += chunk;
+        }
+      }
+    }
+    sample.ms = BenchElapsedMs(&start);
+    if (write(resultFd, &sample, sizeof(sample)) != sizeof(sample))
+      break;
   }
+  _exit(0);
 }
 
-void event_callback(XPointer ptr, XRecordInterceptData *data) {
-  if (data->category != XRecordFromServer) {
-    XRecordFreeData(data);
-    return;
+static int CompareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void BenchReport(FILE *out, const char *mode, const char *owner, size_t size,
+                        const BenchSample *samples, int count, double wallMs) {
+  double *latencies = malloc(sizeof(double) * (count > 0 ? count : 1));
+  int complete = 0;
+  uint64_t bytes = 0;
+  for (int i = 0; i < count; i++) {
+    latencies[i] = samples[i].ms;
+    bytes += samples[i].bytes;
+    if (samples[i].bytes == size)
+      complete++;
+  }
+  qsort(latencies, count, sizeof(double), CompareDoubles);
+  double p50 = 0, p90 = 0, p99 = 0, max = 0;
+  if (count > 0) {
+    p50 = latencies[(count - 1) * 50 / 100];
+    p90 = latencies[(count - 1) * 90 / 100];
+    p99 = latencies[(count - 1) * 99 / 100];
+    max = latencies[count - 1];
   }
+  free(latencies);
 
-  unsigned char *xdata = (unsigned char *)data->data;
-  int type = xdata[0];
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out,
+          "{\"mode\":\"%s\",\"owner\":\"%s\",\"payload_bytes\":%zu,\"iterations\":%d,"
+          "\"complete\":%d,\"bytes\":%llu,\"mb_per_s\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,"
+          "\"p99_ms\":%.3f,\"max_ms\":%.3f,\"peak_rss_kb\":%ld,\"x_errors\":%lu}",
+          mode, owner, size, count, complete, (unsigned long long)bytes,
+          wallMs > 0 ? bytes / 1e6 / (wallMs / 1000.0) : 0.0, p50, p90, p99, max,
+          usage.ru_maxrss, benchXErrors);
+}
 
-  if (type == KeyPress || type == KeyRelease) {
-    int keycode = xdata[1];
-    // Use XKeysymToKeycode to get the correct keycodes for this system
-    static int ctrl_l_code = 0;
-    static int ctrl_r_code = 0;
-    static bool initialized = false;
-    
-    if (!initialized && ctrl_display) {
-      ctrl_l_code = XKeysymToKeycode(ctrl_display, XK_Control_L);
-      ctrl_r_code = XKeysymToKeycode(ctrl_display, XK_Control_R);
-      initialized = true;
-    }
-    
-    if ((ctrl_l_code && keycode == ctrl_l_code) || 
-        (ctrl_r_code && keycode == ctrl_r_code)) {
-      pthread_mutex_lock(&ctrlKeyMutex);
-      bCtrlKeyPressed = (type == KeyPress);
-      pthread_mutex_unlock(&ctrlKeyMutex);
-    }
+// Read path: GetClipboardText against a stand-in owner.
+static void BenchRead(FILE *out, size_t size, BenchOwnerBehavior behavior, int iterations) {
+  char *payload = BenchPayload(size);
+  int ready[2];
+  if (!payload || pipe(ready) != 0)
+    _exit(1);
+  pid_t owner = fork();
+  if (owner == 0) {
+    close(ready[0]);
+    BenchOwnerProcess(payload, size, behavior, ready[1]);
   }
+  close(ready[1]);
+  free(payload);
+  char byte;
+  if (owner < 0 || read(ready[0], &byte, 1) != 1 || !ClipboardFetchInit())
+    _exit(1);
+  close(ready[0]);
+  XSetErrorHandler(BenchXError);
 
-  if (type == ButtonRelease) {
-    int button = xdata[1];
-    if (button == 1) {
-      Time now = data->server_time;
-      Time diff = now - lastClickTime;
+  BenchSample *samples = calloc(iterations, sizeof(BenchSample));
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < iterations; i++) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    char *text = GetClipboardText();
+    samples[i].ms = BenchElapsedMs(&t);
+    samples[i].bytes = text ? strlen(text) : 0;
+    FreeCaptureText(text);
+  }
+  double wallMs = BenchElapsedMs(&start);
+  kill(owner, SIGTERM);
+  waitpid(owner, NULL, 0);
+  BenchReport(out, "read", benchOwnerNames[behavior], size, samples, iterations, wallMs);
+  free(samples);
+}
 
-      if (nCurrentClicks > 0 && (diff < minTime || diff > maxTime)) {
-        nCurrentClicks = 1;
-      } else {
-        nCurrentClicks++;
-      }
-      lastClickTime = now;
+// Serve path: HandleOwnerEvents answering a stand-in requestor.
+static void BenchServe(FILE *out, size_t size, int iterations) {
+  char *payload = BenchPayload(size);
+  if (!payload || !ClipboardOwnerInit())
+    _exit(1);
+  XSetErrorHandler(BenchXError);
+  CopyToClipboard(payload);
+  free(payload);
+  ClaimClipboardOwnership();
+  XSync(clipboardDisplay, False);
 
-      Window root, child;
-      int root_x, root_y, win_x, win_y;
-      unsigned int mask;
-      XQueryPointer(ctrl_display, DefaultRootWindow(ctrl_display), &root,
-                    &child, &root_x, &root_y, &win_x, &win_y, &mask);
-
-      bool alt_pressed = (mask & Mod1Mask);
-      bool ctrl_pressed = (mask & ControlMask);
-
-      bool trigger = false;
-      if (bRequireAlt && alt_pressed && nCurrentClicks == nRequiredClicks)
-        trigger = true;
-      else if (bRequireCtrl && ctrl_pressed &&
-               nCurrentClicks == nRequiredClicks)
-        trigger = true;
-      else if (!bRequireAlt && !bRequireCtrl &&
-               nCurrentClicks == nRequiredClicks)
-        trigger = true;
-
-      bool ctrl_short_trigger = false;
-      if (ctrl_pressed) {
-        if (bCtrl1 && nCurrentClicks == 1)
-          ctrl_short_trigger = true;
-        else if (bCtrl2 && nCurrentClicks == 2)
-          ctrl_short_trigger = true;
-      }
-
-      if (trigger || ctrl_short_trigger) {
-        usleep(200000);
-        send_ctrl_c();
-        nCurrentClicks = 0;
-
-        if (bShowText || bTUI || szLogFile[0] != '\0') {
-          usleep(100000);
-          PrintClipboardText();
-        }
+  int results[2];
+  if (pipe(results) != 0)
+    _exit(1);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t requestor = fork();
+  if (requestor == 0) {
+    close(results[0]);
+    BenchRequestorProcess(iterations, results[1]);
+  }
+  close(results[1]);
+
+  BenchSample *samples = calloc(iterations, sizeof(BenchSample));
+  int count = 0;
+  size_t partial = 0;
+  struct pollfd pfds[2] = {{ConnectionNumber(clipboardDisplay), POLLIN, 0}, {results[0], POLLIN, 0}};
+  while (requestor > 0 && count < iterations) {
+    if (XPending(clipboardDisplay)) {
+      HandleOwnerEvents(&srcOwner, EPOLLIN);
+      continue;
+    }
+    if (poll(pfds, 2, BENCH_EVENT_TIMEOUT_MS * 2) <= 0)
+      break;
+    if (pfds[0].revents & POLLIN)
+      HandleOwnerEvents(&srcOwner, EPOLLIN);
+    if (pfds[1].revents & (POLLIN | POLLHUP)) {
+      ssize_t n = read(results[0], (char *)&samples[count] + partial, sizeof(BenchSample) - partial);
+      if (n <= 0)
+        break;
+      partial += (size_t)n;
+      if (partial == sizeof(BenchSample)) {
+        count++;
+        partial = 0;
       }
     }
   }
+  double wallMs = BenchElapsedMs(&start);
+  if (requestor > 0) {
+    kill(requestor, SIGTERM);
+    waitpid(requestor, NULL, 0);
+  }
+  BenchReport(out, "serve", "autocopy", size, samples, count, wallMs);
+  free(samples);
+}
+
+// Stand-in user: types, clicks and presses Ctrl through XTest as fast as the
+// server takes it, then writes the number of device events injected to doneFd.
+static void BenchInjectProcess(int doneFd) {
+  Display *display = XOpenDisplay(NULL);
+  if (!display)
+    _exit(1);
+  KeyCode key = XKeysymToKeycode(display, XK_a);
+  KeyCode control = XKeysymToKeycode(display, XK_Control_L);
+  unsigned long injected = 0;
+  for (int i = 0; i < BENCH_INPUT_KEYS; i++) {
+    bool ctrl = i % 100 == 0;
+    if (ctrl)
+      XTestFakeKeyEvent(display, control, True, CurrentTime);
+    XTestFakeKeyEvent(display, key, True, CurrentTime);
+    XTestFakeKeyEvent(display, key, False, CurrentTime);
+    if (ctrl)
+      XTestFakeKeyEvent(display, control, False, CurrentTime);
+    injected += ctrl ? 4 : 2;
+    if (i % 10 == 0) {
+      XTestFakeButtonEvent(display, 1, True, CurrentTime);
+      XTestFakeButtonEvent(display, 1, False, CurrentTime);
+      injected += 2;
+    }
+    if (i % 512 == 0)
+      XSync(display, False);  // keep the request queue bounded
+  }
+  XSync(display, False);
+  if (write(doneFd, &injected, sizeof(injected)) != sizeof(injected))
+    _exit(1);
+  XCloseDisplay(display);
+  _exit(0);
+}
 
+static unsigned long benchInputEvents = 0;
+
+static void BenchRecordCallback(XPointer closure, XRecordInterceptData *data) {
+  if (data->category == XRecordFromServer)
+    benchInputEvents++;
   XRecordFreeData(data);
 }
 
-void *record_thread(void *arg) {
-  XRecordRange *range;
-  XRecordContext context;
-  Display *data_display = XOpenDisplay(NULL);
+// Input intake cost: the same injected stream received through XRecord or
+// XInput2. CPU time is this process only, i.e. what autocopy would spend.
+static void BenchInput(FILE *out, bool xi2) {
+  Display *display = XOpenDisplay(NULL);
+  if (!display)
+    _exit(1);
+  XSetErrorHandler(BenchXError);
+  if (xi2 ? !XI2Select(display) : !XRecordEnableContextAsync(display, CreateInputRecordContext(display),
+                                                             BenchRecordCallback, NULL))
+    _exit(1);
+  XSync(display, False);
 
-  if (!data_display) {
-    fprintf(stderr, "Error: Could not open data display.\n");
-    return NULL;
+  int done[2];
+  if (pipe(done) != 0)
+    _exit(1);
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  pid_t injector = fork();
+  if (injector == 0) {
+    close(done[0]);
+    BenchInjectProcess(done[1]);
   }
+  close(done[1]);
 
-  XRecordRange *range_mouse = XRecordAllocRange();
-  range_mouse->device_events.first = ButtonPress;
-  range_mouse->device_events.last = ButtonRelease;
-
-  XRecordRange *range_key = XRecordAllocRange();
-  range_key->device_events.first = KeyPress;
-  range_key->device_events.last = KeyRelease;
+  unsigned long injected = 0;
+  struct pollfd pfds[2] = {{ConnectionNumber(display), POLLIN, 0}, {done[0], POLLIN, 0}};
+  while (injector > 0) {
+    if (xi2) {
+      XEvent event;
+      while (XPending(display)) {
+        XNextEvent(display, &event);
+        if (event.type == GenericEvent && XGetEventData(display, &event.xcookie))
+          XFreeEventData(display, &event.xcookie);
+        benchInputEvents++;
+      }
+    } else {
+      XRecordProcessReplies(display);
+    }
+    bool finished = injected > 0;
+    if (poll(pfds, finished ? 1 : 2, finished ? BENCH_INPUT_IDLE_MS : BENCH_EVENT_TIMEOUT_MS * 4) <= 0)
+      break;
+    if (!finished && (pfds[1].revents & (POLLIN | POLLHUP)) &&
+        read(done[0], &injected, sizeof(injected)) != sizeof(injected))
+      break;
+  }
+  getrusage(RUSAGE_SELF, &after);
+  if (injector > 0)
+    waitpid(injector, NULL, 0);
 
-  XRecordRange *ranges[2] = {range_mouse, range_key};
-  XRecordClientSpec spec = XRecordAllClients;
-  context = XRecordCreateContext(data_display, 0, &spec, 1, ranges, 2);
-  XFree(range_mouse);
-  XFree(range_key);
+  double cpuMs = (after.ru_utime.tv_sec - before.ru_utime.tv_sec + after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000.0 +
+                 (after.ru_utime.tv_usec - before.ru_utime.tv_usec + after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1000.0;
+  fprintf(out,
+          "{\"mode\":\"input\",\"backend\":\"%s\",\"injected_events\":%lu,\"events_received\":%lu,"
+          "\"cpu_ms\":%.3f,\"cpu_us_per_injected_event\":%.3f,\"peak_rss_kb\":%ld,\"x_errors\":%lu}",
+          xi2 ? "xi2" : "record", injected, benchInputEvents, cpuMs,
+          injected ? cpuMs * 1000.0 / injected : 0.0, after.ru_maxrss, benchXErrors);
+}
 
-  if (!context) {
-    fprintf(stderr, "Error: Could not create XRecord context.\n");
-    return NULL;
+// Runs one configuration in a child process and appends its JSON line.
+static void BenchRunChild(FILE *out, bool *first, int config, size_t size, int iterations) {
+  int results[2];
+  if (pipe(results) != 0)
+    return;
+  pid_t child = fork();
+  if (child == 0) {
+    close(results[0]);
+    FILE *pipeOut = fdopen(results[1], "w");
+    if (config <= BENCH_OWNER_INCR)
+      BenchRead(pipeOut, size, (BenchOwnerBehavior)config, iterations);
+    else if (config == BENCH_SERVE)
+      BenchServe(pipeOut, size, iterations);
+    else
+      BenchInput(pipeOut, config == BENCH_INPUT_XI2);
+    fclose(pipeOut);
+    _exit(0);
   }
+  close(results[1]);
+  char line[1024];
+  size_t n = 0;
+  ssize_t got;
+  while (child > 0 && n < sizeof(line) - 1 &&
+         (got = read(results[0], line + n, sizeof(line) - 1 - n)) > 0)
+    n += (size_t)got;
+  close(results[0]);
+  if (child > 0)
+    waitpid(child, NULL, 0);
+  if (n == 0) {
+    fprintf(stderr, "Warning: benchmark %s/%zu produced no result\n", benchOwnerNames[config], size);
+    return;
+  }
+  line[n] = '\0';
+  fprintf(out, "%s%s", *first ? "  " : ",\n  ", line);
+  *first = false;
+  fflush(out);
+}
 
-  XRecordEnableContext(data_display, context, event_callback, NULL);
+int RunBenchmarks(const char *outPath) {
+  static const struct {
+    size_t size;
+    int iterations;
+  } sizes[] = {{1024, 200}, {1024 * 1024, 20}, {100 * 1024 * 1024, 3}};
+  const int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
 
-  return NULL;
+  Display *probe = XOpenDisplay(NULL);
+  if (!probe) {
+    fprintf(stderr, "Error: Cannot open display for benchmarks (run under Xvfb, see bench_linux.sh).\n");
+    return 1;
+  }
+  XCloseDisplay(probe);
+
+  FILE *out = (strcmp(outPath, "-") == 0) ? stdout : fopen(outPath, "w");
+  if (!out) {
+    fprintf(stderr, "Error: Could not open %s: %s\n", outPath, strerror(errno));
+    return 1;
+  }
+  fprintf(out, "{\"benchmark\":\"clipboard\",\"version\":\"%s\",\"results\":[\n", APP_VERSION);
+  bool first = true;
+  for (int s = 0; s < sizeCount; s++) {
+    for (int config = 0; config <= BENCH_SERVE; config++)
+      BenchRunChild(out, &first, config, sizes[s].size, sizes[s].iterations);
+  }
+  BenchRunChild(out, &first, BENCH_INPUT_RECORD, 0, 0);
+  BenchRunChild(out, &first, BENCH_INPUT_XI2, 0, 0);
+  fprintf(out, "\n]}\n");
+  if (out != stdout)
+    fclose(out);
+  return 0;
 }
 
 void ShowShortHelp(const char *name) {
@@ -592,7 +8054,7 @@ void ShowShortHelp(const char *name) {
   printf("Author: %s\n", APP_AUTHOR);
   printf("Exit: Press Ctrl+C in terminal to exit\n\n");
   printf("Usage: %s [options]\n", name);
-  printf("Options: -h --help --version --showtext --1click --2click --3click --alt --ctrl --ctrl1 --ctrl2 --tui --log <file> --logbuffer N --linesize M --mintime <ms> --maxtime <ms> -b --batch\n");
+  printf("Options: -h --help --version --showtext --output jsonl|nul|netstring --output-full block|drop --output-buffer SIZE --1click --2click --3click --alt --ctrl --ctrl1 --ctrl2 --input record|xi2 --tui --hotkey KEYS --separator STR --log <file> --filter <file> --ring <socket> --ringsize <KB> --subscribe <socket> --metrics <addr> --on-capture CMD --hooks N --hook-timeout <ms> --trace-out <file> --bench <file> --displays LIST --display-dir <dir> --threads N --pool N --workers N --workermin SIZE --ready-fd N --monitor --primary --targets LIST --blobdir <dir> --normalize LIST --normalize-copy --logbuffer N --linesize M --maxmem SIZE --session <file> --compressmin B --mintime <ms> --maxtime <ms> -b --batch\n");
 }
 
 
@@ -608,6 +8070,11 @@ void ShowLongHelp(const char *name) {
   printf("  --version         Show version information\n");
   printf("  --showtext        Show the text copied to clipboard (on by default if not in TUI or batch mode)\n");
   printf("  -b, --batch       Run in batch mode (no output to console, useful for background operation)\n");
+  printf("  --output MODE     Write each capture to stdout as a machine-readable record instead: jsonl, nul\n");
+  printf("                    (tab-separated fields, NUL-terminated) or netstring. Records carry id, time,\n");
+  printf("                    selection owner window and length. Not with --tui.\n");
+  printf("  --output-full P   When the reader is more than --output-buffer behind: block (default) or drop.\n");
+  printf("  --output-buffer SIZE  Records kept for a slow reader, e.g. 16M (default: 4M).\n");
 
   printf("\nClick Options:\n");
   printf("  --1click          Copy after 1 click (default behavior)\n");
@@ -619,18 +8086,79 @@ void ShowLongHelp(const char *name) {
   printf("  --ctrl            Only copy if Ctrl is held down\n");
   printf("  --ctrl1           Always allow single-click + Ctrl to copy, overriding other click/modifier options\n");
   printf("  --ctrl2           Always allow double-click + Ctrl to copy, overriding other click/modifier options\n");
+  printf("  --input record|xi2  How clicks are observed (default: record). xi2 uses XInput2 raw button events and\n");
+  printf("                    XKB modifier changes, so keystrokes are never sent to autocopy; needs XI 2.1.\n");
+  printf("  --monitor         Passive mode: record every CLIPBOARD change without watching clicks or injecting Ctrl+C.\n");
+  printf("  --primary         With --monitor, also record PRIMARY (mouse selection) changes.\n");
+  printf("  --targets LIST    Also capture these clipboard types, e.g. html,png (or MIME types); they are saved\n");
+  printf("                    as <sha256>.<ext> files and logged as '[type, size] path' entries.\n");
+  printf("  --blobdir <dir>   Where --targets files go (default: ~/.cache/autocopy/blobs).\n");
+  printf("  --normalize LIST  Clean up captured text: trim, eol, spaces, unwrap (comma-separated) or all.\n");
+  printf("  --normalize-copy  Put the cleaned text back on the clipboard when --normalize changed it.\n");
 
   printf("\nTUI (Terminal User Interface) Options:\n");
   printf("  --tui             Enable Terminal User Interface mode.\n");
-  printf("                    - In TUI mode, use arrow keys to navigate logs.\n");
+  printf("                    - In TUI mode, use arrow keys or the mouse wheel to navigate logs.\n");
+  printf("                    - PgUp/PgDn: Move one page, Home/End: Jump to the first/last entry.\n");
+  printf("                    - Type an entry number and press Enter to jump to it (Esc cancels).\n");
+  printf("                    - Press Enter to open the selected entry with all of its lines (Esc/q closes).\n");
   printf("                    - Press Ctrl+Enter to copy the selected log line to the system clipboard.\n");
+  printf("                    - 'p'/'P': Pin or unpin the selected entry (pinned entries are marked '*').\n");
+  printf("                    - Space marks/unmarks an entry ('+'), Shift+Up/Down marks a range, Esc clears.\n");
+  printf("                      Ctrl+Enter then copies the marked entries, oldest first, joined by --separator.\n");
   printf("                    - 'u'/'U': Scroll up.\n");
   printf("                    - 'd'/'D': Scroll down.\n");
+  printf("  --hotkey KEYS     Global paste-from-history chord, e.g. ctrl+alt+v (needs --tui). Each press puts\n");
+  printf("                    the next older entry on the clipboard; releasing the modifiers pastes it, Esc cancels.\n");
+  printf("  --separator STR   Text put between entries copied together with Ctrl+Enter (default: \\n).\n");
+  printf("                    Escapes \\n, \\t and \\\\ are recognised.\n");
   printf("  --logbuffer N     Maximum number of log lines to keep in memory in TUI mode (default: 200).\n");
   printf("  --linesize M      Maximum size of text (in characters) to store per log line (default: 4096).\n");
+  printf("  --maxmem SIZE     Memory budget for the log history, e.g. 64M (K/M/G suffixes). Least recently viewed\n");
+  printf("                    or copied entries are evicted first; pinned ('p') and re-copied entries are kept.\n");
+  printf("  --session <file>  Keep the log history in a snapshot file and restore it on the next start.\n");
+  printf("  --compressmin B   Keep log entries of at least B bytes LZ4-compressed in memory (default: 16384, 0 = off).\n");
 
   printf("\nLogging Options:\n");
   printf("  --log <file>      Log all copied text to the specified file.\n");
+  printf("  --filter <file>   Drop, redact or hash captures matching the rules in the file, one per line:\n");
+  printf("                    '<drop|redact|hash> regex <pattern>', '... literal <text>' or\n");
+  printf("                    '... entropy <bits-per-char> [min-length]' for key-like tokens.\n");
+  printf("  --trace-out <file>  Write a Chrome/Perfetto trace of every capture's pipeline steps to the file.\n");
+
+  printf("\nBroadcast Options:\n");
+  printf("  --ring <socket>   Publish every capture into a shared-memory ring; subscribers attach via this Unix socket.\n");
+  printf("  --ringsize <KB>   Size of the shared-memory ring in kilobytes (default: 1024).\n");
+  printf("  --subscribe <socket>  Attach read-only to a running instance's ring and print its captures.\n");
+  printf("  --metrics <addr>  Serve Prometheus metrics on [host:]port (default host 127.0.0.1) or on a Unix socket path.\n");
+  printf("  --on-capture CMD  Send each capture to long-running helpers started with sh -c CMD, as a line\n");
+  printf("                    \"<id> <length>\" and <length> bytes of text. Helpers answer each with a line, \"ok\" on success.\n");
+  printf("  --hooks N         Number of --on-capture helpers (default: 1, max 8).\n");
+  printf("  --hook-timeout <ms>  Kill and restart a helper that takes longer to answer (default: 5000).\n");
+
+  printf("\nMulti-display Daemon:\n");
+  printf("  --displays LIST   Serve several X displays from one process, e.g. :1,:2,:5. Each display gets its\n");
+  printf("                    own XRecord context, click state and clipboard window. Works with --log (a '%%s'\n");
+  printf("                    in the name gives one file per display), --showtext, --filter, --normalize and\n");
+  printf("                    --metrics; not with --tui, --monitor, --ring, --session, --targets, --on-capture\n");
+  printf("                    or --output.\n");
+  printf("  --display-dir <dir>  Also attach every display whose socket appears in the directory (/tmp/.X11-unix).\n");
+  printf("  --threads N       Worker threads shared by all displays (default: 2).\n");
+
+  printf("\nMemory:\n");
+  printf("  --pool N          Read captures into N preallocated 1 MB buffers (max 64) so the steady-state\n");
+  printf("                    capture path does not allocate. Pages are only committed once used.\n");
+  printf("  --workers N       Normalize, hash and filter large captures on N threads (default: 2, max 16,\n");
+  printf("                    0 = off). Results are still published in capture order.\n");
+  printf("  --workermin SIZE  Smallest capture handed to --workers, e.g. 64K or 1M (default: 256K).\n");
+
+  printf("\nStartup:\n");
+  printf("  --ready-fd N      Write READY=1 to file descriptor N and close it once capture is armed. With\n");
+  printf("                    $NOTIFY_SOCKET set (systemd Type=notify) READY=1 is also sent there.\n");
+
+  printf("\nDiagnostics:\n");
+  printf("  --bench <file>    Benchmark clipboard reads and serving across payload sizes and owner behaviours;\n");
+  printf("                    writes JSON results to the file ('-' for stdout). Run under Xvfb, see bench_linux.sh.\n");
 
   printf("\nTiming Options:\n");
   printf("  --mintime <ms>    Minimum time in milliseconds between clicks to be considered part of a multi-click sequence (default: 0ms).\n");
@@ -638,6 +8166,7 @@ void ShowLongHelp(const char *name) {
 }
 
 int main(int argc, char *argv[]) {
+  clock_gettime(CLOCK_MONOTONIC, &startupStart);
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-h") == 0) {
       ShowShortHelp(argv[0]);
@@ -671,6 +8200,117 @@ int main(int argc, char *argv[]) {
       bTUI = true;
     } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
       strncpy(szLogFile, argv[++i], MAX_PATH - 1);
+    } else if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc) {
+      strncpy(szRingSocket, argv[++i], sizeof(szRingSocket) - 1);
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      strncpy(szFilterFile, argv[++i], MAX_PATH - 1);
+    } else if (strcmp(argv[i], "--trace-out") == 0 && i + 1 < argc) {
+      strncpy(szTraceFile, argv[++i], MAX_PATH - 1);
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      strncpy(szMetricsAddress, argv[++i], MAX_PATH - 1);
+    } else if (strcmp(argv[i], "--ringsize") == 0 && i + 1 < argc) {
+      int kb = atoi(argv[++i]);
+      ringSizeKB = (kb < 4) ? 4 : (size_t)kb;
+    } else if (strcmp(argv[i], "--targets") == 0 && i + 1 < argc) {
+      char list[256];
+      strncpy(list, argv[++i], sizeof(list) - 1);
+      list[sizeof(list) - 1] = '\0';
+      for (char *item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+        if (!AddExtraTarget(item)) {
+          fprintf(stderr, "Error: Invalid or too many --targets entries at '%s'\n", item);
+          return 1;
+        }
+      }
+    } else if (strcmp(argv[i], "--blobdir") == 0 && i + 1 < argc) {
+      strncpy(szBlobDir, argv[++i], MAX_PATH - 1);
+    } else if (strcmp(argv[i], "--normalize") == 0 && i + 1 < argc) {
+      if (!ParseNormalizeList(argv[++i])) {
+        fprintf(stderr, "Error: Invalid --normalize list '%s' (use trim, eol, spaces, unwrap or all)\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--normalize-copy") == 0) {
+      bNormalizeCopy = true;
+    } else if (strcmp(argv[i], "--monitor") == 0) {
+      bMonitor = true;
+    } else if (strcmp(argv[i], "--primary") == 0) {
+      bMonitorPrimary = true;
+    } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+      strncpy(szBenchOutput, argv[++i], MAX_PATH - 1);
+    } else if (strcmp(argv[i], "--displays") == 0 && i + 1 < argc) {
+      strncpy(szDaemonDisplays, argv[++i], sizeof(szDaemonDisplays) - 1);
+    } else if (strcmp(argv[i], "--display-dir") == 0 && i + 1 < argc) {
+      strncpy(szDaemonDir, argv[++i], MAX_PATH - 1);
+    } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "xi2") == 0) {
+        bInputXI2 = true;
+      } else if (strcmp(argv[i], "record") != 0) {
+        fprintf(stderr, "Error: Invalid --input '%s' (use record or xi2)\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--hotkey") == 0 && i + 1 < argc) {
+      strncpy(szHotkey, argv[++i], sizeof(szHotkey) - 1);
+      if (!ParseHotkey(szHotkey)) {
+        fprintf(stderr, "Error: Invalid --hotkey '%s' (use modifiers and a key, e.g. ctrl+alt+v)\n", szHotkey);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--separator") == 0 && i + 1 < argc) {
+      if (!ParseSeparator(argv[++i])) {
+        fprintf(stderr, "Error: Invalid --separator '%s' (up to 63 bytes; escapes \\n, \\t, \\\\)\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--ready-fd") == 0 && i + 1 < argc) {
+      readyFd = atoi(argv[++i]);
+      if (readyFd < 0 || fcntl(readyFd, F_SETFD, FD_CLOEXEC) != 0) {
+        fprintf(stderr, "Error: --ready-fd %s is not an open file descriptor\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc) {
+      capturePoolSize = atoi(argv[++i]);
+      if (capturePoolSize < 1) capturePoolSize = 1;
+      if (capturePoolSize > MAX_CAPTURE_POOL) capturePoolSize = MAX_CAPTURE_POOL;
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      const char *mode = argv[++i];
+      if (strcmp(mode, "jsonl") == 0) {
+        outputMode = OUTPUT_JSONL;
+      } else if (strcmp(mode, "nul") == 0) {
+        outputMode = OUTPUT_NUL;
+      } else if (strcmp(mode, "netstring") == 0) {
+        outputMode = OUTPUT_NETSTRING;
+      } else {
+        fprintf(stderr, "Error: --output takes jsonl, nul or netstring, not %s\n", mode);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--output-full") == 0 && i + 1 < argc) {
+      const char *policy = argv[++i];
+      if (strcmp(policy, "block") != 0 && strcmp(policy, "drop") != 0) {
+        fprintf(stderr, "Error: --output-full takes block or drop, not %s\n", policy);
+        return 1;
+      }
+      bOutputBlock = strcmp(policy, "block") == 0;
+    } else if (strcmp(argv[i], "--output-buffer") == 0 && i + 1 < argc) {
+      outputLimit = ParseByteSize(argv[++i]);
+    } else if (strcmp(argv[i], "--on-capture") == 0 && i + 1 < argc) {
+      strncpy(szOnCapture, argv[++i], sizeof(szOnCapture) - 1);
+    } else if (strcmp(argv[i], "--hooks") == 0 && i + 1 < argc) {
+      hookHelperCount = atoi(argv[++i]);
+      if (hookHelperCount < 1) hookHelperCount = 1;
+      if (hookHelperCount > MAX_HOOK_HELPERS) hookHelperCount = MAX_HOOK_HELPERS;
+    } else if (strcmp(argv[i], "--hook-timeout") == 0 && i + 1 < argc) {
+      hookTimeoutMs = atoi(argv[++i]);
+      if (hookTimeoutMs < 1) hookTimeoutMs = 1;
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      postWorkerCount = atoi(argv[++i]);
+      if (postWorkerCount < 0) postWorkerCount = 0;
+      if (postWorkerCount > MAX_POST_WORKERS) postWorkerCount = MAX_POST_WORKERS;
+    } else if (strcmp(argv[i], "--workermin") == 0 && i + 1 < argc) {
+      postWorkerMin = ParseByteSize(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      daemonWorkerCount = atoi(argv[++i]);
+      if (daemonWorkerCount < 1) daemonWorkerCount = 1;
+      if (daemonWorkerCount > MAX_DAEMON_WORKERS) daemonWorkerCount = MAX_DAEMON_WORKERS;
+    } else if (strcmp(argv[i], "--subscribe") == 0 && i + 1 < argc) {
+      strncpy(szSubscribeSocket, argv[++i], sizeof(szSubscribeSocket) - 1);
     } else if (strcmp(argv[i], "--logbuffer") == 0 && i + 1 < argc) {
       tuiMaxLogLines = atoi(argv[++i]);
       if (tuiMaxLogLines < 1) tuiMaxLogLines = 1;
@@ -682,6 +8322,13 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(argv[i], "--linesize") == 0 && i + 1 < argc) {
       tuiLineSizeLimit = atoi(argv[++i]);
       if (tuiLineSizeLimit < 1) tuiLineSizeLimit = 1;
+    } else if (strcmp(argv[i], "--session") == 0 && i + 1 < argc) {
+      strncpy(szSessionFile, argv[++i], MAX_PATH - 1);
+    } else if (strcmp(argv[i], "--maxmem") == 0 && i + 1 < argc) {
+      tuiMaxMemory = ParseByteSize(argv[++i]);
+    } else if (strcmp(argv[i], "--compressmin") == 0 && i + 1 < argc) {
+      int bytes = atoi(argv[++i]);
+      tuiCompressMin = (bytes < 0) ? 0 : (size_t)bytes;
     } else if (strcmp(argv[i], "--mintime") == 0 && i + 1 < argc) {
       minTime = atoi(argv[++i]);
     } else if (strcmp(argv[i], "--maxtime") == 0 && i + 1 < argc) {
@@ -695,9 +8342,69 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  signal(SIGINT, cleanup_and_exit);
+  if (szSubscribeSocket[0] != '\0') {
+    return RunSubscriber(szSubscribeSocket);
+  }
+  if (szBenchOutput[0] != '\0') {
+    return RunBenchmarks(szBenchOutput);
+  }
+  bool bDaemon = szDaemonDisplays[0] != '\0' || szDaemonDir[0] != '\0';
+  if (bDaemon && (bTUI || bMonitor || bInputXI2 || szRingSocket[0] != '\0' || szSessionFile[0] != '\0' || extraTargetCount > 0 ||
+                  szOnCapture[0] != '\0' || outputMode != OUTPUT_NONE)) {
+    fprintf(stderr, "Error: --displays/--display-dir cannot be combined with --tui, --monitor, --input xi2, --ring, --session, --targets, --on-capture or --output\n");
+    return 1;
+  }
+  if (outputMode != OUTPUT_NONE && bTUI) {
+    fprintf(stderr, "Error: --output writes to stdout, which --tui draws on\n");
+    return 1;
+  }
+  if (szHotkey[0] != '\0' && !bTUI) {
+    fprintf(stderr, "Error: --hotkey picks from the TUI history and needs --tui\n");
+    return 1;
+  }
+
+  // SIGINT/SIGTERM/SIGWINCH are consumed through a signalfd by the event loop,
+  // so shutdown runs on the normal path instead of inside a signal handler.
+  sigset_t loopSignals;
+  sigemptyset(&loopSignals);
+  sigaddset(&loopSignals, SIGINT);
+  sigaddset(&loopSignals, SIGTERM);
+  sigaddset(&loopSignals, SIGWINCH);
+  sigprocmask(SIG_BLOCK, &loopSignals, NULL);
+  signal(SIGPIPE, SIG_IGN);
 
-  ctrl_display = XOpenDisplay(NULL);
+  if (szRingSocket[0] != '\0' && !RingCreate(szRingSocket, ringSizeKB)) {
+    return 1;
+  }
+  if (szMetricsAddress[0] != '\0' && !MetricsCreate(szMetricsAddress)) {
+    return 1;
+  }
+  if (szTraceFile[0] != '\0' && !TraceOpen(szTraceFile)) {
+    return 1;
+  }
+  if (szFilterFile[0] != '\0' && !LoadFilterRules(szFilterFile)) {
+    return 1;
+  }
+  if (extraTargetCount > 0 && !BlobDirInit()) {
+    return 1;
+  }
+  if (capturePoolSize > 0 && !CapturePoolInit(capturePoolSize)) {
+    return 1;
+  }
+  // Kept for NotifyReady and hidden from anything we start later.
+  const char *notifySocket = getenv("NOTIFY_SOCKET");
+  if (notifySocket && (notifySocket[0] == '/' || notifySocket[0] == '@') &&
+      strlen(notifySocket) < sizeof(szNotifySocket))
+    strcpy(szNotifySocket, notifySocket);
+  unsetenv("NOTIFY_SOCKET");
+  if (bDaemon) {
+    int exitCode = RunDaemon();
+    TraceClose();
+    return exitCode;
+  }
+
+  XInitThreads();
+  bool connected = StartupConnect();
   if (!ctrl_display) {
     fprintf(stderr, "Error: Cannot open display. Are you on X11? (ctrl_display is NULL)\n");
     return 1;
@@ -715,48 +8422,92 @@ int main(int argc, char *argv[]) {
              "%04d-%02d-%02d %02d:%02d:%02d",
              t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
              t->tm_hour, t->tm_min, t->tm_sec);
+    if (szSessionFile[0] != '\0' && !SessionOpen(szSessionFile)) {
+      fprintf(stderr, "Warning: Session file %s not usable, history will not be kept.\n", szSessionFile);
+    }
     DrawTUIHeader();
-  } else if (!bBatch) {
+  } else if (!bBatch && outputMode == OUTPUT_NONE) {
     printf("autocopy linux started (X11). Press Ctrl+C in terminal to exit.\n");
-    printf("Settings: %d click(s)%s%s\n", nRequiredClicks,
-           bRequireAlt ? " + Alt" : "", bRequireCtrl ? " + Ctrl" : "");
+    if (bMonitor)
+      printf("Settings: monitoring CLIPBOARD%s changes, no clicks or keys are injected\n",
+             bMonitorPrimary ? " and PRIMARY" : "");
+    else
+      printf("Settings: %d click(s)%s%s\n", nRequiredClicks,
+             bRequireAlt ? " + Alt" : "", bRequireCtrl ? " + Ctrl" : "");
     printf("Timing: Min %d ms, Max %d ms\n", minTime, maxTime);
     fflush(stdout);
   }
 
-  pthread_t record_thread_id;
-  pthread_t keyboard_thread_id;
-  pthread_t clipboard_thread_id;
-
-  pthread_create(&record_thread_id, NULL, record_thread, NULL);
-  pthread_create(&clipboard_thread_id, NULL, clipboard_handler_thread, NULL);
-  usleep(100000);
-  if (bTUI) {
-    pthread_create(&keyboard_thread_id, NULL, keyboard_input_thread, NULL);
+  int exitCode = 0;
+  if (!connected || !LoopInit() || !PostWorkersStart() || (szOnCapture[0] != '\0' && !HookStart()) ||
+      (outputMode != OUTPUT_NONE && !OutputInit()) ||
+      !LoopAdd(&srcCtrl, ConnectionNumber(ctrl_display), HandleCtrlEvents, ctrl_display) ||
+      !LoopAdd(&srcOwner, ConnectionNumber(clipboardDisplay), HandleOwnerEvents, clipboardDisplay) ||
+      !LoopAdd(&srcOwnerTimer, timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), HandleOwnerTimer, NULL) ||
+      !LoopAdd(&srcFetch, ConnectionNumber(fetchDisplay), HandleFetchEvents, fetchDisplay) ||
+      (!bMonitor && !LoopAdd(&srcRecord, ConnectionNumber(data_display), HandleRecordData, NULL)) ||
+      (szHotkey[0] != '\0' && !HotkeyInit(szHotkey))) {
+    fprintf(stderr, "Error: Could not set up the event loop.\n");
+    exitCode = 1;
+  } else {
+    if (ringListenFd >= 0) {
+      fcntl(ringListenFd, F_SETFL, fcntl(ringListenFd, F_GETFL) | O_NONBLOCK);
+      LoopAdd(&srcRing, ringListenFd, HandleRingAccept, NULL);
+    }
+    if (metricsListenFd >= 0) {
+      for (int i = 0; i < MAX_METRICS_CLIENTS; i++)
+        metricsClients[i].src.fd = -1;
+      LoopAdd(&srcMetrics, metricsListenFd, HandleMetricsAccept, NULL);
+    }
+    if (bTUI && TUIInputInit()) {
+      LoopAdd(&srcStdin, STDIN_FILENO, HandleTUIInput, NULL);
+      LoopAdd(&srcEscTimer, timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), HandleEscTimer, NULL);
+    }
+    if (bMonitor || bInputXI2)
+      NotifyReady();  // the init waited for the server; with XRecord, event_callback signals
+    RunEventLoop();
   }
+  PostWorkersStop();
+  HookStop();
+  if (outputMode != OUTPUT_NONE)
+    OutputClose();
 
-  pthread_join(record_thread_id, NULL);
-  clipboardShouldExit = true;
-  pthread_join(clipboard_thread_id, NULL);
   if (bTUI) {
-    pthread_cancel(keyboard_thread_id);
+    RestoreTerminal();
   }
 
-  if (bTUI) {
-    printf("\033[?25h");
-    printf("\033[0m");
-    printf("\033[J");
-    fflush(stdout);
+  SessionClose();
+  TraceClose();
+#if defined(AUTOCOPY_COUNT_MALLOC)
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(stderr, "autocopy: %lu heap allocations, peak RSS %ld KB\n", atomic_load(&mallocCalls), usage.ru_maxrss);
+#endif
+  for (int i = 0; i < tuiLogCount; i++) {
+    FreeTUIEntry(&tuiLogBuffer[i]);
+  }
+  if (sessionMap) {
+    munmap(sessionMap, sessionMapSize);
   }
 
-  for (int i = 0; i < tuiLogCount; i++) {
-    if (tuiLogBuffer[i]) {
-      free(tuiLogBuffer[i]);
-    }
+  if (szRingSocket[0] != '\0') {
+    unlink(szRingSocket);
+  }
+  if (bMetricsUnixSocket) {
+    unlink(szMetricsAddress);
   }
 
+  if (data_display) {
+    XCloseDisplay(data_display);
+  }
+  if (fetchDisplay) {
+    XCloseDisplay(fetchDisplay);
+  }
+  if (clipboardDisplay) {
+    XCloseDisplay(clipboardDisplay);
+  }
   XCloseDisplay(ctrl_display);
-  return 0;
+  return exitCode;
 }
 
-// Compile with: gcc autocopy_linux.c -o autocopy_linux -lX11 -lXtst -lXfixes -lpthread
+// Compile with: gcc autocopy_linux.c -o autocopy_linux -lX11 -lXtst -lXfixes -lXi -lpthread
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs the clipboard benchmarks on a private Xvfb display.
+# Usage: ./bench_linux.sh [results.json]
+# Compare two builds with e.g.: diff <(jq -c '.results[]' old.json) <(jq -c '.results[]' new.json)
+
+OUT=${1:-bench_output.json}
+BIN=${AUTOCOPY:-./autocopy_linux}
+DISP=${BENCH_DISPLAY:-:99}
+
+if [ ! -x "$BIN" ]; then
+  gcc -O2 autocopy_linux.c -o autocopy_linux -lX11 -lXtst -lXfixes -lXi -lpthread || exit 1
+fi
+
+Xvfb "$DISP" -screen 0 1024x768x24 -nolisten tcp >/dev/null 2>&1 &
+XVFB_PID=$!
+trap 'kill $XVFB_PID 2>/dev/null' EXIT INT TERM
+sleep 1
+
+DISPLAY=$DISP "$BIN" --bench "$OUT"